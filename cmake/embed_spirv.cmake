@@ -0,0 +1,23 @@
+# Writes every SPIR-V file under ${SPV_ROOT}/shaders into a C++ source, as
+# the table declared in src/context/spirv.h. Run in script mode:
+#   cmake -DSPV_ROOT=<dir> -DOUTPUT=<file.cpp> -P embed_spirv.cmake
+file(GLOB_RECURSE SPV_FILES RELATIVE ${SPV_ROOT} ${SPV_ROOT}/shaders/*.spv)
+list(SORT SPV_FILES)
+
+set(ARRAYS "")
+set(ENTRIES "")
+set(INDEX 0)
+foreach(SPV_FILE ${SPV_FILES})
+  file(READ ${SPV_ROOT}/${SPV_FILE} HEX_CONTENT HEX)
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX_CONTENT}")
+  string(APPEND ARRAYS "static const unsigned char spv${INDEX}[] = {${BYTES}};\n")
+  string(APPEND ENTRIES "    {\"${SPV_FILE}\", spv${INDEX}, sizeof(spv${INDEX})},\n")
+  math(EXPR INDEX "${INDEX} + 1")
+endforeach()
+
+set(SOURCE "// Generated by cmake/embed_spirv.cmake, do not edit\n")
+string(APPEND SOURCE "#include <context/spirv.h>\n\n${ARRAYS}\n")
+string(APPEND SOURCE "const EmbeddedSpirv embeddedSpirv[] = {\n${ENTRIES}};\n")
+string(APPEND SOURCE "const size_t embeddedSpirvNum = ${INDEX};\n")
+
+file(WRITE ${OUTPUT} "${SOURCE}")
@@ -0,0 +1,179 @@
+#include "allocator.h"
+#include "context.h"
+
+static thread_local MemCategory s_category = MemCategoryOther;
+
+static const char* s_categoryNames[MemCategoryNum] = {
+    "other", "geometry", "textures", "accel", "film", "host"};
+
+static double toMegaBytes(VkDeviceSize size) {
+  return double(size) / (1024.0 * 1024.0);
+}
+
+MemCategoryScope::MemCategoryScope(MemCategory category) {
+  m_prevCategory = s_category;
+  s_category = category;
+}
+
+MemCategoryScope::~MemCategoryScope() { s_category = m_prevCategory; }
+
+void BudgetBlockAllocator::init(VkDevice device,
+                                VkPhysicalDevice physicalDevice,
+                                bool hasBudget, VkDeviceSize blockSize) {
+  DeviceMemoryAllocator::init(device, physicalDevice, blockSize);
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memProps);
+  m_hasBudget = hasBudget;
+  if (!m_hasBudget)
+    LOG_WARN("{}: VK_EXT_memory_budget is not supported, using heap sizes",
+             "Allocator");
+}
+
+VkResult BudgetBlockAllocator::allocBlockMemory(BlockID id,
+                                                VkMemoryAllocateInfo& memInfo,
+                                                VkDeviceMemory& deviceMemory) {
+  int heap = int(m_memProps.memoryTypes[memInfo.memoryTypeIndex].heapIndex);
+  if (!checkBudget(heap, memInfo.allocationSize))
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  VkResult result =
+      DeviceMemoryAllocator::allocBlockMemory(id, memInfo, deviceMemory);
+  if (result == VK_SUCCESS) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_blocks[deviceMemory] = {heap, memInfo.allocationSize};
+    m_heapUsage[heap] += memInfo.allocationSize;
+  }
+  return result;
+}
+
+void BudgetBlockAllocator::freeBlockMemory(BlockID id,
+                                           VkDeviceMemory deviceMemory) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_blocks.find(deviceMemory);
+    if (it != m_blocks.end()) {
+      m_heapUsage[it->second.heap] -= it->second.size;
+      m_blocks.erase(it);
+    }
+  }
+  DeviceMemoryAllocator::freeBlockMemory(id, deviceMemory);
+}
+
+bool BudgetBlockAllocator::checkBudget(int heapIndex, VkDeviceSize size) {
+  VkDeviceSize usage, budget;
+  if (m_hasBudget) {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProps{
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT};
+    VkPhysicalDeviceMemoryProperties2 memProps2{
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, &budgetProps};
+    vkGetPhysicalDeviceMemoryProperties2(getPhysicalDevice(), &memProps2);
+    usage = budgetProps.heapUsage[heapIndex];
+    budget = budgetProps.heapBudget[heapIndex];
+  } else {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    usage = m_heapUsage[heapIndex];
+    budget = m_memProps.memoryHeaps[heapIndex].size;
+  }
+  if (usage + size <= budget) return true;
+  LOG_ERROR("{}: heap {} is over budget, {:.2f} MB used of {:.2f} MB",
+            "Allocator", heapIndex, toMegaBytes(usage), toMegaBytes(budget));
+  return false;
+}
+
+void BudgetMemAllocator::init(VkDevice device, VkPhysicalDevice physicalDevice,
+                              bool hasBudget, VkDeviceSize blockSize) {
+  m_dma.init(device, physicalDevice, hasBudget, blockSize);
+}
+
+void BudgetMemAllocator::deinit() {
+  if (!m_records.empty())
+    LOG_WARN("{}: {} allocations were not freed", "Allocator",
+             m_records.size());
+  m_records.clear();
+  m_dma.deinit();
+}
+
+void BudgetMemAllocator::printReport() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  LOG_INFO("{}: device memory usage", "Allocator");
+  for (int i = 0; i < MemCategoryNum; i++)
+    LOG_INFO("{}:   {:<10}{:>10.2f} MB", "Allocator", s_categoryNames[i],
+             toMegaBytes(m_categoryUsage[i]));
+  VkDeviceSize allocated = 0, used = 0;
+  m_dma.getUtilization(allocated, used);
+  LOG_INFO("{}:   {:<10}{:>10.2f} MB in blocks, {:.2f} MB used", "Allocator",
+           "total", toMegaBytes(allocated), toMegaBytes(used));
+}
+
+nvvk::MemHandle BudgetMemAllocator::allocMemory(
+    const nvvk::MemAllocateInfo& allocInfo, VkResult* pResult) {
+  MemCategory category = s_category;
+  if ((allocInfo.getMemoryProperties() &
+       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
+      !(allocInfo.getMemoryProperties() & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+    category = MemCategoryHost;
+  VkDeviceSize size = allocInfo.getMemoryRequirements().size;
+
+  VkResult result = VK_SUCCESS;
+  nvvk::MemHandle handle = m_dma.allocMemory(allocInfo, &result);
+  if (!handle) {
+    LOG_ERROR(
+        "{}: failed to allocate {:.2f} MB of {} memory (result {}), "
+        "the scene does not fit into the device memory budget",
+        "Allocator", toMegaBytes(size), s_categoryNames[category],
+        int(result));
+    printReport();
+    exit(1);
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_records[handle] = {category, size};
+  m_categoryUsage[category] += size;
+  if (pResult) *pResult = result;
+  return handle;
+}
+
+void BudgetMemAllocator::freeMemory(nvvk::MemHandle memHandle) {
+  if (!memHandle) return;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_records.find(memHandle);
+    if (it != m_records.end()) {
+      m_categoryUsage[it->second.category] -= it->second.size;
+      m_records.erase(it);
+    }
+  }
+  m_dma.freeMemory(memHandle);
+}
+
+nvvk::MemAllocator::MemInfo BudgetMemAllocator::getMemoryInfo(
+    nvvk::MemHandle memHandle) const {
+  return m_dma.getMemoryInfo(memHandle);
+}
+
+void* BudgetMemAllocator::map(nvvk::MemHandle memHandle, VkDeviceSize offset,
+                              VkDeviceSize size, VkResult* pResult) {
+  return m_dma.map(memHandle, offset, size, pResult);
+}
+
+void BudgetMemAllocator::unmap(nvvk::MemHandle memHandle) {
+  m_dma.unmap(memHandle);
+}
+
+VkDevice BudgetMemAllocator::getDevice() const { return m_dma.getDevice(); }
+
+VkPhysicalDevice BudgetMemAllocator::getPhysicalDevice() const {
+  return m_dma.getPhysicalDevice();
+}
+
+void ResourceAllocatorBudget::init(VkDevice device,
+                                   VkPhysicalDevice physicalDevice,
+                                   bool hasBudget,
+                                   VkDeviceSize stagingBlockSize) {
+  m_memAlloc.init(device, physicalDevice, hasBudget);
+  ResourceAllocator::init(device, physicalDevice, &m_memAlloc,
+                          stagingBlockSize);
+}
+
+void ResourceAllocatorBudget::deinit() {
+  ResourceAllocator::deinit();
+  m_memAlloc.deinit();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+
+#include <nvvk/memorymanagement_vk.hpp>
+#include <nvvk/resourceallocator_vk.hpp>
+
+// What a device allocation is used for, only for bookkeeping
+enum MemCategory {
+  MemCategoryOther = 0,     // scene tables, uniforms
+  MemCategoryGeometry = 1,  // vertex and index buffers
+  MemCategoryTextures = 2,  // textures and environment maps
+  MemCategoryAccel = 3,     // acceleration structures and scratch buffers
+  MemCategoryFilm = 4,      // render targets and readback buffers
+  MemCategoryHost = 5,      // host visible memory (staging)
+  MemCategoryNum = 6
+};
+
+// Every allocation made on the current thread while a scope is alive is
+// booked under its category
+class MemCategoryScope {
+public:
+  MemCategoryScope(MemCategory category);
+  ~MemCategoryScope();
+
+private:
+  MemCategory m_prevCategory;
+};
+
+// Block allocator of the nvvk DMA that checks the heap budget reported by
+// VK_EXT_memory_budget (or the heap size) whenever a new VkDeviceMemory block
+// is about to be allocated. Sub-allocations from existing blocks stay free of
+// driver queries.
+class BudgetBlockAllocator : public nvvk::DeviceMemoryAllocator {
+public:
+  void init(VkDevice device, VkPhysicalDevice physicalDevice, bool hasBudget,
+            VkDeviceSize blockSize);
+
+protected:
+  VkResult allocBlockMemory(BlockID id, VkMemoryAllocateInfo& memInfo,
+                            VkDeviceMemory& deviceMemory) override;
+  void freeBlockMemory(BlockID id, VkDeviceMemory deviceMemory) override;
+
+private:
+  bool checkBudget(int heapIndex, VkDeviceSize size);
+
+private:
+  struct Block {
+    int heap;
+    VkDeviceSize size;
+  };
+  VkPhysicalDeviceMemoryProperties m_memProps{};
+  bool m_hasBudget{false};
+  std::mutex m_mutex;
+  std::unordered_map<VkDeviceMemory, Block> m_blocks;
+  std::array<VkDeviceSize, VK_MAX_MEMORY_HEAPS> m_heapUsage{};
+};
+
+// Sub-allocates device memory from large blocks (nvvk DMA), so thousands of
+// assets no longer hit maxMemoryAllocationCount. Running out of the memory
+// budget ends the program with a per-category report instead of a crash later
+// on.
+class BudgetMemAllocator : public nvvk::MemAllocator {
+public:
+  void init(VkDevice device, VkPhysicalDevice physicalDevice, bool hasBudget,
+            VkDeviceSize blockSize = NVVK_DEFAULT_MEMORY_BLOCKSIZE);
+  void deinit();
+  void printReport();
+
+public:
+  nvvk::MemHandle allocMemory(const nvvk::MemAllocateInfo& allocInfo,
+                              VkResult* pResult = nullptr) override;
+  void freeMemory(nvvk::MemHandle memHandle) override;
+  MemInfo getMemoryInfo(nvvk::MemHandle memHandle) const override;
+  void* map(nvvk::MemHandle memHandle, VkDeviceSize offset = 0,
+            VkDeviceSize size = VK_WHOLE_SIZE,
+            VkResult* pResult = nullptr) override;
+  void unmap(nvvk::MemHandle memHandle) override;
+  VkDevice getDevice() const override;
+  VkPhysicalDevice getPhysicalDevice() const override;
+
+private:
+  struct Record {
+    MemCategory category;
+    VkDeviceSize size;
+  };
+  BudgetBlockAllocator m_dma;
+  std::mutex m_mutex;
+  std::unordered_map<nvvk::MemHandle, Record> m_records;
+  std::array<VkDeviceSize, MemCategoryNum> m_categoryUsage{};
+};
+
+class ResourceAllocatorBudget : public nvvk::ResourceAllocator {
+public:
+  void init(VkDevice device, VkPhysicalDevice physicalDevice, bool hasBudget,
+            VkDeviceSize stagingBlockSize = NVVK_DEFAULT_STAGING_BLOCKSIZE);
+  void deinit();
+  // Log device memory usage per category
+  void printReport() { m_memAlloc.printReport(); }
+
+private:
+  BudgetMemAllocator m_memAlloc;
+};
@@ -1,5 +1,14 @@
 #include "context.h"
+#ifdef ASUNA_EMBED_SPIRV
+#include "spirv.h"
+#endif
+#include <core/temp_file.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 
+#include <nvh/fileoperations.hpp>
 #include <nvvk/commands_vk.hpp>
 #include <nvvk/images_vk.hpp>
 #include <nvvk/structs_vk.hpp>
@@ -19,6 +28,9 @@ void ContextAware::init(ContextInitSetting cis) {
   // Search path for shaders and other media
   m_root = NVPSystem::exePath();
 
+  // Pipelines compiled by earlier runs
+  createPipelineCache();
+
   // Create offline resources for offline mode
   if (getOfflineMode()) createOfflineResources();
 
@@ -27,6 +39,9 @@ void ContextAware::init(ContextInitSetting cis) {
 }
 
 void ContextAware::deinit() {
+  savePipelineCache();
+  vkDestroyPipelineCache(m_device, m_pipelineCache, nullptr);
+  m_pipelineCache = VK_NULL_HANDLE;
   m_root.clear();
   m_alloc.deinit();
   AppBaseVk::destroy();
@@ -41,6 +56,108 @@ void ContextAware::resizeGlfwWindow() {
 
 string& ContextAware::getRoot() { return m_root; }
 
+bool ContextAware::hasRayQuery() {
+  return m_vkcontext.hasDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME);
+}
+
+bool ContextAware::hasTextureCompressionBC() {
+  // The device is created with every core feature it supports
+  VkPhysicalDeviceFeatures features{};
+  vkGetPhysicalDeviceFeatures(getPhysicalDevice(), &features);
+  return features.textureCompressionBC == VK_TRUE;
+}
+
+VkPipelineCache ContextAware::getPipelineCache() { return m_pipelineCache; }
+
+string ContextAware::loadShader(const string& spvPath) {
+#ifdef ASUNA_EMBED_SPIRV
+  for (size_t i = 0; i < embeddedSpirvNum; i++)
+    if (spvPath == embeddedSpirv[i].path)
+      return string(reinterpret_cast<const char*>(embeddedSpirv[i].code),
+                    embeddedSpirv[i].size);
+  LOG_WARN("{}: [{}] is not embedded, loading it from disk", "Context",
+           spvPath);
+#endif
+  string code = nvh::loadFile("../" + spvPath, true, {m_root});
+  if (code.empty()) {
+    LOG_ERROR("{}: failed to load shader [{}]", "Context", spvPath);
+    exit(1);
+  }
+  return code;
+}
+
+void ContextAware::createPipelineCache() {
+  m_pipelineCachePath = m_root + "/pipeline.cache";
+  vector<char> data;
+  std::ifstream file(m_pipelineCachePath, std::ios::binary | std::ios::ate);
+  if (file) {
+    data.resize(size_t(file.tellg()));
+    file.seekg(0);
+    file.read(data.data(), data.size());
+    if (!file) data.clear();
+  }
+
+  // A cache of another device or driver version is of no use, drivers would
+  // reject it anyway
+  if (!data.empty()) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &props);
+    VkPipelineCacheHeaderVersionOne header{};
+    bool valid = data.size() >= sizeof(header);
+    if (valid) memcpy(&header, data.data(), sizeof(header));
+    valid = valid &&
+            header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+            header.vendorID == props.vendorID &&
+            header.deviceID == props.deviceID &&
+            memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID,
+                   VK_UUID_SIZE) == 0;
+    if (!valid) {
+      LOG_INFO("{}: pipeline cache is outdated, rebuilding it", "Context");
+      data.clear();
+    }
+  }
+
+  VkPipelineCacheCreateInfo createInfo{
+      VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+  m_pipelineCacheLoadedSize = data.size();
+  createInfo.initialDataSize = data.size();
+  createInfo.pInitialData = data.empty() ? nullptr : data.data();
+  if (vkCreatePipelineCache(m_device, &createInfo, nullptr,
+                            &m_pipelineCache) != VK_SUCCESS) {
+    LOG_WARN("{}: pipeline cache rejected, starting an empty one", "Context");
+    m_pipelineCacheLoadedSize = 0;
+    createInfo.initialDataSize = 0;
+    createInfo.pInitialData = nullptr;
+    vkCreatePipelineCache(m_device, &createInfo, nullptr, &m_pipelineCache);
+  }
+}
+
+void ContextAware::savePipelineCache() {
+  if (m_pipelineCache == VK_NULL_HANDLE) return;
+  size_t size = 0;
+  vkGetPipelineCacheData(m_device, m_pipelineCache, &size, nullptr);
+  vector<char> data(size);
+  if (size == 0 || vkGetPipelineCacheData(m_device, m_pipelineCache, &size,
+                                          data.data()) != VK_SUCCESS)
+    return;
+  // Nothing new was compiled, short renders of a batch all end up here
+  if (size <= m_pipelineCacheLoadedSize) return;
+
+  string tmpPath = makeTempPath(m_pipelineCachePath);
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), size);
+    if (!file) {
+      LOG_WARN("{}: failed to write [{}]", "Context", tmpPath);
+      file.close();
+      std::remove(tmpPath.c_str());
+      return;
+    }
+  }
+  if (!replaceWithTemp(tmpPath, m_pipelineCachePath))
+    LOG_WARN("{}: failed to replace [{}]", "Context", m_pipelineCachePath);
+}
+
 nvvk::Texture ContextAware::getOfflineColor() { return m_offlineColor; }
 
 nvvk::Texture ContextAware::getOfflineDepth() { return m_offlineDepth; }
@@ -81,6 +198,7 @@ void ContextAware::setViewport(const VkCommandBuffer& cmdBuf) {
 }
 
 void ContextAware::createOfflineResources() {
+  MemCategoryScope memScope(MemCategoryFilm);
   m_alloc.destroy(m_offlineColor);
   m_alloc.destroy(m_offlineDepth);
   vkDestroyRenderPass(m_device, m_offlineRenderPass, nullptr);
@@ -196,7 +314,7 @@ void ContextAware::setSize(VkExtent2D& size) { m_size = size; }
 
 VkExtent2D& ContextAware::getSize() { return m_size; }
 
-nvvk::ResourceAllocatorDedicated& ContextAware::getAlloc() { return m_alloc; }
+ResourceAllocatorBudget& ContextAware::getAlloc() { return m_alloc; }
 
 nvvk::DebugUtil& ContextAware::getDebug() { return m_debug; }
 
@@ -254,6 +372,11 @@ void ContextAware::initializeVulkan() {
       nvvk::make<VkPhysicalDeviceRayTracingPipelineFeaturesKHR>();
   m_contextInfo.addDeviceExtension(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
                                    false, &rtPipelineFeatures);
+  // KHR_ray_query, only the wavefront path tracer traces from compute
+  VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures =
+      nvvk::make<VkPhysicalDeviceRayQueryFeaturesKHR>();
+  m_contextInfo.addDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME, true,
+                                   &rayQueryFeatures);
   // Extra queues for parallel load/build
   m_contextInfo.addRequestedQueue(m_contextInfo.defaultQueueGCT, 1, 1.0f);
   // Add the required device extensions for Debug Printf. If this is
@@ -289,6 +412,9 @@ void ContextAware::initializeVulkan() {
       VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME);
   m_contextInfo.addDeviceExtension(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
 
+  // Memory budget query for the allocator (optional)
+  m_contextInfo.addDeviceExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, true);
+
   // Synchronization (mix of timeline and binary semaphores)
   m_contextInfo.addDeviceExtension(VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
                                    false);
@@ -342,6 +468,8 @@ void ContextAware::createAppContext() {
                      m_vkcontext.m_physicalDevice,
                      m_vkcontext.m_queueGCT.familyIndex);
   }
-  m_alloc.init(m_instance, m_device, m_physicalDevice);
+  m_alloc.init(m_device, m_physicalDevice,
+               m_vkcontext.hasDeviceExtension(
+                   VK_EXT_MEMORY_BUDGET_EXTENSION_NAME));
   m_debug.setup(m_device);
 }
\ No newline at end of file
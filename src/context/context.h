@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+#include "allocator.h"
+
 #include <nvvk/appbase_vk.hpp>
 #include <nvvk/context_vk.hpp>
 #include <nvvk/debug_util_vk.hpp>
@@ -54,7 +56,7 @@ public:
   VkExtent2D& getSize();
 
   // Get vulkan resource allocator
-  nvvk::ResourceAllocatorDedicated& getAlloc();
+  ResourceAllocatorBudget& getAlloc();
 
   // Get vulkan debugger
   nvvk::DebugUtil& getDebug();
@@ -65,6 +67,20 @@ public:
   // Path of exectuable program
   string& getRoot();
 
+  // If ray queries are enabled, shaders other than ray tracing ones may trace
+  bool hasRayQuery();
+
+  // If block compressed (BC1-7) textures can be sampled
+  bool hasTextureCompressionBC();
+
+  // Pipeline cache of all pipelines, kept next to the executable between
+  // runs
+  VkPipelineCache getPipelineCache();
+
+  // SPIR-V of a compiled shader, e.g. "shaders/post.idle.vert.spv". Built
+  // with ASUNA_EMBED_SPIRV it comes from the executable instead of disk.
+  string loadShader(const string& spvPath);
+
   // Offline rgba32f buffer(ldr)
   nvvk::Texture getOfflineColor();
 
@@ -85,6 +101,8 @@ private:
   void createAppContext();
   void createOfflineResources();
   void createParallelQueues();
+  void createPipelineCache();
+  void savePipelineCache();
 
   // Overriding to create 2x more command buffer per frame
   void createSwapchain(const VkSurfaceKHR& surface, uint32_t width,
@@ -101,11 +119,14 @@ private:
 
 private:
   ContextInitSetting m_cis;
-  nvvk::ResourceAllocatorDedicated m_alloc;
+  ResourceAllocatorBudget m_alloc;
   nvvk::DebugUtil m_debug;
   nvvk::Context m_vkcontext{};
   nvvk::ContextCreateInfo m_contextInfo;
   std::string m_root{};
+  std::string m_pipelineCachePath{};
+  VkPipelineCache m_pipelineCache{VK_NULL_HANDLE};
+  size_t m_pipelineCacheLoadedSize{0};  // Saved again only once it grew
 
   // Collecting all the Queues the application will need.
   // - GTC1 for scene assets loading and pipeline creation
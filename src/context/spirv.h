@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+// SPIR-V compiled into the executable with ASUNA_EMBED_SPIRV, the table is
+// generated by cmake/embed_spirv.cmake at build time
+struct EmbeddedSpirv {
+  const char* path;  // relative to the shaders' parent, "shaders/..."
+  const unsigned char* code;
+  size_t size;
+};
+
+extern const EmbeddedSpirv embeddedSpirv[];
+extern const size_t embeddedSpirvNum;
@@ -0,0 +1,479 @@
+#include "bcn.h"
+#include "thread_pool.h"
+
+#include <ImfRgba.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+using nvmath::vec4f;
+
+static const int bc7Weights4[16] = {0,  4,  9,  13, 17, 21, 26, 30,
+                                    34, 38, 43, 47, 51, 55, 60, 64};
+
+static int clampInt(int v, int lo, int hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Writes fields into a zeroed block, least significant bit first
+struct BitWriter {
+  uint8_t* out;
+  int pos;
+  void put(uint32_t value, int bits) {
+    for (int b = 0; b < bits; b++, pos++)
+      if ((value >> b) & 1) out[pos >> 3] |= uint8_t(1 << (pos & 7));
+  }
+};
+
+// Fit a line through the 16 points of a block along their principal axis,
+// lo and hi are the extreme projections onto it
+template <int N>
+static void fitEndpoints(const float* pts, float lo[N], float hi[N]) {
+  float mean[N] = {}, vmin[N], vmax[N];
+  for (int k = 0; k < N; k++) vmin[k] = FLT_MAX, vmax[k] = -FLT_MAX;
+  for (int i = 0; i < 16; i++)
+    for (int k = 0; k < N; k++) {
+      float v = pts[i * N + k];
+      mean[k] += v / 16.f;
+      vmin[k] = std::min(vmin[k], v);
+      vmax[k] = std::max(vmax[k], v);
+    }
+
+  float cov[N][N] = {};
+  for (int i = 0; i < 16; i++)
+    for (int a = 0; a < N; a++)
+      for (int b = 0; b < N; b++)
+        cov[a][b] += (pts[i * N + a] - mean[a]) * (pts[i * N + b] - mean[b]);
+
+  // Power iteration starting from the bounding box diagonal
+  float axis[N];
+  for (int k = 0; k < N; k++) axis[k] = vmax[k] - vmin[k];
+  for (int iter = 0; iter < 8; iter++) {
+    float next[N] = {}, norm = 0.f;
+    for (int a = 0; a < N; a++) {
+      for (int b = 0; b < N; b++) next[a] += cov[a][b] * axis[b];
+      norm = std::max(norm, fabsf(next[a]));
+    }
+    if (norm < 1e-12f) break;
+    for (int k = 0; k < N; k++) axis[k] = next[k] / norm;
+  }
+  float len = 0.f;
+  for (int k = 0; k < N; k++) len += axis[k] * axis[k];
+  if (len < 1e-12f) {
+    for (int k = 0; k < N; k++) lo[k] = hi[k] = mean[k];
+    return;
+  }
+  len = sqrtf(len);
+  for (int k = 0; k < N; k++) axis[k] /= len;
+
+  float tmin = FLT_MAX, tmax = -FLT_MAX;
+  for (int i = 0; i < 16; i++) {
+    float t = 0.f;
+    for (int k = 0; k < N; k++) t += (pts[i * N + k] - mean[k]) * axis[k];
+    tmin = std::min(tmin, t);
+    tmax = std::max(tmax, t);
+  }
+  for (int k = 0; k < N; k++) {
+    lo[k] = mean[k] + tmin * axis[k];
+    hi[k] = mean[k] + tmax * axis[k];
+  }
+}
+
+// Index of the palette entry closest to every texel
+template <int N>
+static void findIndices(const float* pts, const int (*palette)[N],
+                        int numColors, int indices[16]) {
+  for (int i = 0; i < 16; i++) {
+    float bestErr = FLT_MAX;
+    for (int c = 0; c < numColors; c++) {
+      float err = 0.f;
+      for (int k = 0; k < N; k++) {
+        float d = pts[i * N + k] - palette[c][k];
+        err += d * d;
+      }
+      if (err < bestErr) bestErr = err, indices[i] = c;
+    }
+  }
+}
+
+static uint16_t packRGB565(const float c[3]) {
+  int r = clampInt(int(c[0] * 31.f / 255.f + 0.5f), 0, 31);
+  int g = clampInt(int(c[1] * 63.f / 255.f + 0.5f), 0, 63);
+  int b = clampInt(int(c[2] * 31.f / 255.f + 0.5f), 0, 31);
+  return uint16_t((r << 11) | (g << 5) | b);
+}
+
+static void unpackRGB565(uint16_t c, int rgb[3]) {
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+void encodeBC1(const uint8_t rgba[64], uint8_t block[8]) {
+  float pts[16 * 3];
+  for (int i = 0; i < 16; i++)
+    for (int k = 0; k < 3; k++) pts[i * 3 + k] = rgba[i * 4 + k];
+  float lo[3], hi[3];
+  fitEndpoints<3>(pts, lo, hi);
+
+  // c0 > c1 selects the four color mode
+  uint16_t c0 = packRGB565(hi), c1 = packRGB565(lo);
+  if (c0 < c1) std::swap(c0, c1);
+  uint32_t bits = 0;
+  if (c0 != c1) {
+    int palette[4][3];
+    unpackRGB565(c0, palette[0]);
+    unpackRGB565(c1, palette[1]);
+    for (int k = 0; k < 3; k++) {
+      palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+      palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+    }
+    int indices[16];
+    findIndices<3>(pts, palette, 4, indices);
+    for (int i = 0; i < 16; i++) bits |= uint32_t(indices[i]) << (2 * i);
+  }
+  block[0] = uint8_t(c0 & 0xff);
+  block[1] = uint8_t(c0 >> 8);
+  block[2] = uint8_t(c1 & 0xff);
+  block[3] = uint8_t(c1 >> 8);
+  for (int b = 0; b < 4; b++) block[4 + b] = uint8_t(bits >> (8 * b));
+}
+
+void encodeBC4(const uint8_t* values, int stride, uint8_t block[8]) {
+  float pts[16];
+  int lo = 255, hi = 0;
+  for (int i = 0; i < 16; i++) {
+    int v = values[i * stride];
+    pts[i] = float(v);
+    lo = std::min(lo, v);
+    hi = std::max(hi, v);
+  }
+
+  // red0 > red1 selects the eight value mode
+  uint64_t bits = 0;
+  if (hi > lo) {
+    int palette[8][1] = {{hi}, {lo}};
+    for (int i = 1; i < 7; i++)
+      palette[i + 1][0] = ((7 - i) * hi + i * lo + 3) / 7;
+    int indices[16];
+    findIndices<1>(pts, palette, 8, indices);
+    for (int i = 0; i < 16; i++) bits |= uint64_t(indices[i]) << (3 * i);
+  }
+  block[0] = uint8_t(hi);
+  block[1] = uint8_t(lo);
+  for (int b = 0; b < 6; b++) block[2 + b] = uint8_t(bits >> (8 * b));
+}
+
+void encodeBC5(const uint8_t rgba[64], uint8_t block[16]) {
+  encodeBC4(rgba + 0, 4, block);
+  encodeBC4(rgba + 1, 4, block + 8);
+}
+
+void encodeBC7(const uint8_t rgba[64], uint8_t block[16]) {
+  float pts[16 * 4];
+  for (int i = 0; i < 64; i++) pts[i] = rgba[i];
+  float ends[2][4];
+  fitEndpoints<4>(pts, ends[0], ends[1]);
+
+  // Endpoints are 7 bits per channel plus a shared lowest bit per endpoint
+  int quant[2][4], pbit[2], endpoint[2][4];
+  for (int e = 0; e < 2; e++) {
+    float bestErr = FLT_MAX;
+    for (int p = 0; p < 2; p++) {
+      int q[4];
+      float err = 0.f;
+      for (int k = 0; k < 4; k++) {
+        float v = std::min(std::max(ends[e][k], 0.f), 255.f);
+        q[k] = clampInt(int((v - p) * 0.5f + 0.5f), 0, 127);
+        float d = float((q[k] << 1) | p) - v;
+        err += d * d;
+      }
+      if (err < bestErr) {
+        bestErr = err;
+        pbit[e] = p;
+        for (int k = 0; k < 4; k++) quant[e][k] = q[k];
+      }
+    }
+    for (int k = 0; k < 4; k++) endpoint[e][k] = (quant[e][k] << 1) | pbit[e];
+  }
+
+  int palette[16][4];
+  for (int c = 0; c < 16; c++)
+    for (int k = 0; k < 4; k++)
+      palette[c][k] = (endpoint[0][k] * (64 - bc7Weights4[c]) +
+                       endpoint[1][k] * bc7Weights4[c] + 32) >>
+                      6;
+  int indices[16];
+  findIndices<4>(pts, palette, 16, indices);
+
+  // The most significant bit of the first index is implied zero
+  if (indices[0] & 8) {
+    for (int k = 0; k < 4; k++) std::swap(quant[0][k], quant[1][k]);
+    std::swap(pbit[0], pbit[1]);
+    for (int i = 0; i < 16; i++) indices[i] = 15 - indices[i];
+  }
+
+  memset(block, 0, 16);
+  BitWriter writer = {block, 0};
+  writer.put(1 << 6, 7);
+  for (int k = 0; k < 4; k++) {
+    writer.put(quant[0][k], 7);
+    writer.put(quant[1][k], 7);
+  }
+  writer.put(pbit[0], 1);
+  writer.put(pbit[1], 1);
+  writer.put(indices[0], 3);
+  for (int i = 1; i < 16; i++) writer.put(indices[i], 4);
+}
+
+static int unquantizeBC6H(int q) {
+  if (q == 0) return 0;
+  if (q == 1023) return 0xffff;
+  return ((q << 16) + 0x8000) >> 10;
+}
+
+void encodeBC6H(const uint16_t rgb[48], uint8_t block[16]) {
+  // Work in the unquantized domain, the decoder scales it by 31/64 to get
+  // the bits of the half again
+  float pts[16 * 3];
+  for (int i = 0; i < 48; i++) pts[i] = rgb[i] * 64.f / 31.f;
+  float ends[2][3];
+  fitEndpoints<3>(pts, ends[0], ends[1]);
+
+  int quant[2][3], endpoint[2][3];
+  for (int e = 0; e < 2; e++)
+    for (int k = 0; k < 3; k++) {
+      float v = std::min(std::max(ends[e][k], 0.f), 65535.f);
+      int q = clampInt(int((v - 32.f) / 64.f + 0.5f), 0, 1023);
+      // 0 and 1023 unquantize differently, check the neighbours as well
+      int best = q;
+      for (int c = std::max(q - 1, 0); c <= std::min(q + 1, 1023); c++)
+        if (fabsf(unquantizeBC6H(c) - v) < fabsf(unquantizeBC6H(best) - v))
+          best = c;
+      quant[e][k] = best;
+      endpoint[e][k] = unquantizeBC6H(best);
+    }
+
+  int palette[16][3];
+  for (int c = 0; c < 16; c++)
+    for (int k = 0; k < 3; k++)
+      palette[c][k] = (endpoint[0][k] * (64 - bc7Weights4[c]) +
+                       endpoint[1][k] * bc7Weights4[c] + 32) >>
+                      6;
+  int indices[16];
+  findIndices<3>(pts, palette, 16, indices);
+
+  if (indices[0] & 8) {
+    for (int k = 0; k < 3; k++) std::swap(quant[0][k], quant[1][k]);
+    for (int i = 0; i < 16; i++) indices[i] = 15 - indices[i];
+  }
+
+  memset(block, 0, 16);
+  BitWriter writer = {block, 0};
+  writer.put(0x03, 5);
+  for (int e = 0; e < 2; e++)
+    for (int k = 0; k < 3; k++) writer.put(quant[e][k], 10);
+  writer.put(indices[0], 3);
+  for (int i = 1; i < 16; i++) writer.put(indices[i], 4);
+}
+
+static float srgbToLinear(float v) {
+  return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linearToSrgb(float v) {
+  return v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.f / 2.4f) - 0.055f;
+}
+
+static uint8_t toUnorm8(float v) {
+  return uint8_t(clampInt(int(v * 255.f + 0.5f), 0, 255));
+}
+
+static uint16_t toHalfBits(float v) {
+  return half(std::min(std::max(v, -HALF_MAX), HALF_MAX)).bits();
+}
+
+// Texels of any texture format as linear rgba floats
+static vector<vec4f> decodeTexels(Texture* pTexture) {
+  VkExtent2D shape = pTexture->getSize();
+  size_t numTexels = size_t(shape.width) * shape.height;
+  vector<vec4f> texels(numTexels);
+  auto u8 = static_cast<const uint8_t*>(pTexture->getData());
+  auto u16 = static_cast<const uint16_t*>(pTexture->getData());
+  auto f32 = static_cast<const float*>(pTexture->getData());
+  auto fromHalf = [](uint16_t bits) {
+    half h;
+    h.setBits(bits);
+    return float(h);
+  };
+  float srgbLut[256];
+  for (int i = 0; i < 256; i++) srgbLut[i] = srgbToLinear(i / 255.f);
+
+  switch (pTexture->getFormat()) {
+    case VK_FORMAT_R8_UNORM:
+      for (size_t i = 0; i < numTexels; i++) {
+        float v = u8[i] / 255.f;
+        texels[i] = vec4f(v, v, v, 1.f);
+      }
+      break;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+      for (size_t i = 0; i < numTexels; i++)
+        texels[i] = vec4f(u8[4 * i + 0] / 255.f, u8[4 * i + 1] / 255.f,
+                          u8[4 * i + 2] / 255.f, u8[4 * i + 3] / 255.f);
+      break;
+    case VK_FORMAT_R8G8B8A8_SRGB:
+      for (size_t i = 0; i < numTexels; i++)
+        texels[i] = vec4f(srgbLut[u8[4 * i + 0]], srgbLut[u8[4 * i + 1]],
+                          srgbLut[u8[4 * i + 2]], u8[4 * i + 3] / 255.f);
+      break;
+    case VK_FORMAT_R16_SFLOAT:
+      for (size_t i = 0; i < numTexels; i++) {
+        float v = fromHalf(u16[i]);
+        texels[i] = vec4f(v, v, v, 1.f);
+      }
+      break;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+      for (size_t i = 0; i < numTexels; i++)
+        texels[i] = vec4f(fromHalf(u16[4 * i + 0]), fromHalf(u16[4 * i + 1]),
+                          fromHalf(u16[4 * i + 2]), fromHalf(u16[4 * i + 3]));
+      break;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+      memcpy(texels.data(), f32, sizeof(vec4f) * numTexels);
+      break;
+    default:
+      LOG_ERROR("{}: cannot compress texture format {}", "Scene",
+                int(pTexture->getFormat()));
+      exit(1);
+  }
+  return texels;
+}
+
+static VkFormat chooseFormat(VkFormat sourceFormat,
+                             const vector<vec4f>& texels) {
+  bool opaque = true, grey = true, noBlue = true, positive = true;
+  for (auto& t : texels) {
+    opaque &= (t.w == 1.f);
+    grey &= (t.x == t.y && t.y == t.z);
+    noBlue &= (t.z == 0.f);
+    positive &= (t.x >= 0.f && t.y >= 0.f && t.z >= 0.f);
+  }
+  switch (sourceFormat) {
+    case VK_FORMAT_R8_UNORM:
+      return VK_FORMAT_BC4_UNORM_BLOCK;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+      if (opaque && grey) return VK_FORMAT_BC4_UNORM_BLOCK;
+      if (opaque && noBlue) return VK_FORMAT_BC5_UNORM_BLOCK;
+      return opaque ? VK_FORMAT_BC1_RGB_UNORM_BLOCK : VK_FORMAT_BC7_UNORM_BLOCK;
+    case VK_FORMAT_R8G8B8A8_SRGB:
+      return opaque ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_BC7_SRGB_BLOCK;
+    case VK_FORMAT_R16_SFLOAT:
+      // Gamma corrected grey maps would lose their dark end in BC4
+      return VK_FORMAT_R16_SFLOAT;
+    default:
+      return opaque && positive ? VK_FORMAT_BC6H_UFLOAT_BLOCK
+                                : VK_FORMAT_R16G16B16A16_SFLOAT;
+  }
+}
+
+static vector<vec4f> downsample(const vector<vec4f>& src, VkExtent2D srcShape,
+                                VkExtent2D dstShape) {
+  vector<vec4f> dst(size_t(dstShape.width) * dstShape.height);
+  ThreadPool::get().parallelFor(
+      dstShape.height, 16, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++)
+          for (uint32_t x = 0; x < dstShape.width; x++) {
+            vec4f sum(0.f);
+            for (uint32_t dy = 0; dy < 2; dy++)
+              for (uint32_t dx = 0; dx < 2; dx++) {
+                uint32_t sx = std::min(2 * x + dx, srcShape.width - 1);
+                uint32_t sy = std::min(uint32_t(2 * y + dy), srcShape.height - 1);
+                sum += src[size_t(sy) * srcShape.width + sx];
+              }
+            dst[y * dstShape.width + x] = sum * 0.25f;
+          }
+      });
+  return dst;
+}
+
+static void encodeLevel(const vector<vec4f>& texels, VkExtent2D shape,
+                        VkFormat format, uint8_t* out) {
+  if (!isBlockCompressed(format)) {
+    int channels = (format == VK_FORMAT_R16_SFLOAT) ? 1 : 4;
+    auto halfs = reinterpret_cast<uint16_t*>(out);
+    for (size_t i = 0; i < texels.size(); i++)
+      for (int k = 0; k < channels; k++)
+        halfs[i * channels + k] = toHalfBits(texels[i][k]);
+    return;
+  }
+
+  bool srgb = (format == VK_FORMAT_BC1_RGB_SRGB_BLOCK ||
+               format == VK_FORMAT_BC7_SRGB_BLOCK);
+  VkDeviceSize blockSize = getTexelSize(format);
+  uint32_t blocksX = (shape.width + 3) / 4, blocksY = (shape.height + 3) / 4;
+  ThreadPool::get().parallelFor(blocksY, 4, [&](size_t begin, size_t end) {
+    uint8_t rgba[64];
+    uint16_t rgb[48];
+    for (size_t by = begin; by < end; by++)
+      for (uint32_t bx = 0; bx < blocksX; bx++) {
+        // Blocks hanging over the border repeat the last row and column
+        for (uint32_t i = 0; i < 16; i++) {
+          uint32_t x = std::min(bx * 4 + i % 4, shape.width - 1);
+          uint32_t y = std::min(uint32_t(by * 4 + i / 4), shape.height - 1);
+          const vec4f& t = texels[size_t(y) * shape.width + x];
+          for (int k = 0; k < 4; k++) {
+            float v = (srgb && k < 3) ? linearToSrgb(t[k]) : t[k];
+            rgba[i * 4 + k] = toUnorm8(v);
+          }
+          for (int k = 0; k < 3; k++) rgb[i * 3 + k] = toHalfBits(t[k]);
+        }
+        uint8_t* block = out + (by * blocksX + bx) * blockSize;
+        switch (format) {
+          case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+          case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+            encodeBC1(rgba, block);
+            break;
+          case VK_FORMAT_BC4_UNORM_BLOCK:
+            encodeBC4(rgba, 4, block);
+            break;
+          case VK_FORMAT_BC5_UNORM_BLOCK:
+            encodeBC5(rgba, block);
+            break;
+          case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+            encodeBC6H(rgb, block);
+            break;
+          default:
+            encodeBC7(rgba, block);
+            break;
+        }
+      }
+  });
+}
+
+Texture* compressTexture(Texture* pSource) {
+  VkExtent2D shape = pSource->getSize();
+  vector<vec4f> texels = decodeTexels(pSource);
+  VkFormat format = chooseFormat(pSource->getFormat(), texels);
+  uint32_t mipLevels = nvvk::mipLevels(shape);
+
+  VkDeviceSize totalSize = 0;
+  for (uint32_t level = 0; level < mipLevels; level++)
+    totalSize += getLevelSize(format, shape, level);
+  auto data = static_cast<uint8_t*>(malloc(totalSize));
+
+  VkDeviceSize offset = 0;
+  VkExtent2D levelShape = shape;
+  for (uint32_t level = 0; level < mipLevels; level++) {
+    if (level > 0) {
+      VkExtent2D nextShape = {std::max(levelShape.width / 2, 1u),
+                              std::max(levelShape.height / 2, 1u)};
+      texels = downsample(texels, levelShape, nextShape);
+      levelShape = nextShape;
+    }
+    encodeLevel(texels, levelShape, format, data + offset);
+    offset += getLevelSize(format, shape, level);
+  }
+  return new Texture(data, shape, format, mipLevels, true);
+}
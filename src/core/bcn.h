@@ -0,0 +1,32 @@
+#pragma once
+
+#include "texture.h"
+
+#include <cstdint>
+
+// Block encoders, every call compresses one 4x4 block of texels given in
+// row-major order. The encoders fit the endpoints to the principal axis of
+// the block colors and pick the closest palette entry per texel, which is
+// fast enough to run on first load.
+
+// rgba8 texels, alpha is ignored
+void encodeBC1(const uint8_t rgba[64], uint8_t block[8]);
+// One channel read with a stride of stride bytes
+void encodeBC4(const uint8_t* values, int stride, uint8_t block[8]);
+// Red and green of rgba8 texels
+void encodeBC5(const uint8_t rgba[64], uint8_t block[16]);
+// rgba8 texels, mode 6 only
+void encodeBC7(const uint8_t rgba[64], uint8_t block[16]);
+// Positive half float rgb texels (bits of the half), mode 11 only
+void encodeBC6H(const uint16_t rgb[48], uint8_t block[16]);
+
+// Build the full mip chain of a decoded texture and compress it into the
+// best fitting block format:
+// - r8 and grey rgba8 textures use BC4
+// - rgba8 textures with an empty blue channel use BC5
+// - opaque rgba8 textures use BC1, the others BC7
+// - opaque positive half textures use BC6H
+// Formats that cannot be compressed without changing their content keep
+// their texel format but still get the precomputed mip chain. The returned
+// texture owns its data.
+Texture* compressTexture(Texture* pSource);
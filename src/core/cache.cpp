@@ -0,0 +1,376 @@
+#include "cache.h"
+#include "bcn.h"
+#include "ktx.h"
+#include "temp_file.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <filesystem/path.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numEntries;
+};
+
+static const char cacheMagic[8] = {'A', 'S', 'U', 'N', 'A', 'C', 'C', 'H'};
+static const uint64_t cacheAlignment = 16;
+
+static void* mapFile(const std::string& filePath, size_t& size) {
+  size = 0;
+#ifdef _WIN32
+  HANDLE hFile = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) return nullptr;
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0) {
+    CloseHandle(hFile);
+    return nullptr;
+  }
+  HANDLE hMapping =
+      CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void* pData = nullptr;
+  if (hMapping) {
+    pData = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    // The view keeps the file and the mapping object alive
+    CloseHandle(hMapping);
+  }
+  CloseHandle(hFile);
+  if (pData) size = size_t(fileSize.QuadPart);
+  return pData;
+#else
+  int fd = ::open(filePath.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  void* pData = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (pData == MAP_FAILED) return nullptr;
+  size = size_t(st.st_size);
+  return pData;
+#endif
+}
+
+static void unmapFile(void* pData, size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(pData);
+#else
+  munmap(pData, size);
+#endif
+}
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash) {
+  // FNV-1a, consuming 8 bytes per round
+  const uint64_t prime = 1099511628211ull;
+  auto bytes = static_cast<const uint8_t*>(data);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * prime;
+  }
+  for (; i < size; i++) hash = (hash ^ bytes[i]) * prime;
+  return hash;
+}
+
+uint64_t hashFileContent(const std::string& filePath) {
+  std::ifstream file(filePath, std::ios::binary);
+  if (!file) {
+    LOG_ERROR("{}: failed to open [{}] for hashing", "Cache", filePath);
+    exit(1);
+  }
+  uint64_t hash = hashBytes(nullptr, 0);
+  vector<char> chunk(1 << 22);
+  while (file) {
+    file.read(chunk.data(), chunk.size());
+    hash = hashBytes(chunk.data(), size_t(file.gcount()), hash);
+  }
+  return hash;
+}
+
+template <typename T>
+static uint64_t hashValue(const T& value, uint64_t hash) {
+  return hashBytes(&value, sizeof(T), hash);
+}
+
+SceneCache::~SceneCache() { close(); }
+
+void SceneCache::open(const std::string& cachePath) {
+  close();
+  m_cachePath = cachePath;
+
+  size_t size = 0;
+  void* pData = mapFile(cachePath, size);
+  if (!pData) return;
+
+  auto pHeader = static_cast<const CacheHeader*>(pData);
+  bool valid = size >= sizeof(CacheHeader) &&
+               memcmp(pHeader->magic, cacheMagic, sizeof(cacheMagic)) == 0 &&
+               pHeader->version == SCENE_CACHE_VERSION &&
+               size >= sizeof(CacheHeader) +
+                           sizeof(Entry) * uint64_t(pHeader->numEntries);
+  if (!valid) {
+    LOG_WARN("{}: ignoring outdated scene cache [{}]", "Cache", cachePath);
+    unmapFile(pData, size);
+    return;
+  }
+
+  m_pMapped = pData;
+  m_mappedSize = size;
+  m_numEntries = pHeader->numEntries;
+  m_pEntries = reinterpret_cast<const Entry*>(static_cast<const char*>(pData) +
+                                              sizeof(CacheHeader));
+  LOG_INFO("{}: mapped scene cache [{}] with {} asset(s)", "Cache", cachePath,
+           m_numEntries);
+}
+
+void SceneCache::close() {
+  if (m_dirty) {
+    // Cached blobs are still read from the current mapping while the new
+    // version is written
+    std::string tmpPath = makeTempPath(m_cachePath);
+    if (write(tmpPath)) {
+      if (m_pMapped) unmapFile(m_pMapped, m_mappedSize);
+      m_pMapped = nullptr;
+      if (replaceWithTemp(tmpPath, m_cachePath))
+        LOG_INFO("{}: wrote {} asset(s) to scene cache [{}]", "Cache",
+                 m_blobs.size(), m_cachePath);
+      else
+        LOG_WARN("{}: failed to replace scene cache [{}]", "Cache",
+                 m_cachePath);
+    } else {
+      std::remove(tmpPath.c_str());
+      LOG_WARN("{}: failed to write scene cache [{}]", "Cache", m_cachePath);
+    }
+  }
+  if (m_pMapped) unmapFile(m_pMapped, m_mappedSize);
+  m_pMapped = nullptr;
+  m_mappedSize = 0;
+  m_pEntries = nullptr;
+  m_numEntries = 0;
+  m_blobs.clear();
+  m_keptKeys.clear();
+  m_dirty = false;
+}
+
+Mesh* SceneCache::loadMesh(const std::string& meshPath, bool recomputeNormal,
+                           vec2 uvScale) {
+  uint64_t key = hashValue(uint32_t(BlobTypeMesh), hashFileContent(meshPath));
+  key = hashValue(recomputeNormal, key);
+  key = hashValue(uvScale, key);
+
+  if (auto pEntry = find(key)) {
+    auto pVertices = static_cast<const GpuVertex*>(getSection(*pEntry, 0));
+    auto pIndices = static_cast<const uint*>(getSection(*pEntry, 1));
+    const float* b = pEntry->bounds;
+    return new Mesh(pVertices, pEntry->width, pIndices, pEntry->height,
+                    vec3(b[0], b[1], b[2]), vec3(b[3], b[4], b[5]));
+  }
+
+  Mesh* pMesh = new Mesh(meshPath, recomputeNormal, uvScale);
+  Entry entry = {};
+  entry.key = key;
+  entry.type = BlobTypeMesh;
+  entry.width = pMesh->getVerticesNum();
+  entry.height = pMesh->getIndicesNum();
+  const vec3& posMin = pMesh->getPosMin();
+  const vec3& posMax = pMesh->getPosMax();
+  float bounds[6] = {posMin.x, posMin.y, posMin.z,
+                     posMax.x, posMax.y, posMax.z};
+  memcpy(entry.bounds, bounds, sizeof(bounds));
+  entry.size[0] = sizeof(GpuVertex) * uint64_t(entry.width);
+  entry.size[1] = sizeof(uint) * uint64_t(entry.height);
+  store(entry, pMesh->getVertices().data(), pMesh->getIndices().data());
+  return pMesh;
+}
+
+uint64_t SceneCache::getTextureKey(const std::string& texturePath,
+                                   float gamma) {
+  uint64_t key =
+      hashValue(uint32_t(BlobTypeTexture), hashFileContent(texturePath));
+  return hashValue(gamma, key);
+}
+
+Texture* SceneCache::loadTexture(uint64_t key, const std::string& texturePath,
+                                 float gamma, bool compress) {
+  if (compress) {
+    // Decoded texels are not cached, the KTX2 file replaces them
+    return loadCompressed(key, [&]() {
+      if (auto pEntry = find(key))
+        return new Texture(const_cast<void*>(getSection(*pEntry, 0)),
+                           {pEntry->width, pEntry->height},
+                           VkFormat(pEntry->format));
+      return new Texture(texturePath, gamma);
+    });
+  }
+
+  if (auto pEntry = find(key)) {
+    return new Texture(const_cast<void*>(getSection(*pEntry, 0)),
+                       {pEntry->width, pEntry->height},
+                       VkFormat(pEntry->format));
+  }
+
+  Texture* pTexture = new Texture(texturePath, gamma);
+  VkExtent2D shape = pTexture->getSize();
+  Entry entry = {};
+  entry.key = key;
+  entry.type = BlobTypeTexture;
+  entry.format = pTexture->getFormat();
+  entry.width = shape.width;
+  entry.height = shape.height;
+  entry.size[0] = pTexture->getDataSize();
+  store(entry, pTexture->getData());
+  return pTexture;
+}
+
+EnvMap* SceneCache::loadEnvMap(const std::string& envmapPath, bool compress) {
+  uint64_t key =
+      hashValue(uint32_t(BlobTypeEnvMap), hashFileContent(envmapPath));
+
+  if (auto pEntry = find(key)) {
+    EnvMap* pEnvMap = new EnvMap(const_cast<void*>(getSection(*pEntry, 0)),
+                                 const_cast<void*>(getSection(*pEntry, 1)),
+                                 const_cast<void*>(getSection(*pEntry, 2)),
+                                 {pEntry->width, pEntry->height});
+    if (compress)
+      pEnvMap->setRadiance(loadCompressed(key, [pEnvMap]() {
+        return new Texture(pEnvMap->getData(), pEnvMap->getSize(),
+                           pEnvMap->getFormat());
+      }));
+    return pEnvMap;
+  }
+
+  EnvMap* pEnvMap = new EnvMap(envmapPath);
+  // Sampling tables stay uncompressed in the scene cache
+  if (compress)
+    pEnvMap->setRadiance(loadCompressed(key, [pEnvMap]() {
+      return new Texture(pEnvMap->getData(), pEnvMap->getSize(),
+                         pEnvMap->getFormat());
+    }));
+  VkExtent2D shape = pEnvMap->getSize();
+  Entry entry = {};
+  entry.key = key;
+  entry.type = BlobTypeEnvMap;
+  entry.format = pEnvMap->getFormat();
+  entry.width = shape.width;
+  entry.height = shape.height;
+  entry.size[0] = sizeof(nvmath::vec4f) * uint64_t(shape.width) * shape.height;
+  entry.size[1] = pEnvMap->getMarginalSize();
+  entry.size[2] = pEnvMap->getConditionalSize();
+  store(entry, pEnvMap->getData(), pEnvMap->getMarginal(),
+        pEnvMap->getConditional());
+  return pEnvMap;
+}
+
+Texture* SceneCache::loadCompressed(uint64_t key,
+                                    const std::function<Texture*()>& decode) {
+  char fileName[32];
+  snprintf(fileName, sizeof(fileName), "%016llx.ktx2",
+           static_cast<unsigned long long>(key));
+  std::string ktxDir = m_cachePath + ".textures";
+  std::string ktxPath = ktxDir + "/" + fileName;
+
+  Texture* pTexture = m_cachePath.empty() ? nullptr : readKtx2(ktxPath);
+  if (pTexture) return pTexture;
+
+  Texture* pDecoded = decode();
+  pTexture = compressTexture(pDecoded);
+  delete pDecoded;
+  if (!m_cachePath.empty()) {
+    filesystem::create_directory(filesystem::path(ktxDir));
+    if (!writeKtx2(ktxPath, pTexture))
+      LOG_WARN("{}: failed to write compressed texture [{}]", "Cache",
+               ktxPath);
+  }
+  return pTexture;
+}
+
+const SceneCache::Entry* SceneCache::find(uint64_t key) {
+  for (uint32_t i = 0; i < m_numEntries; i++) {
+    const Entry& entry = m_pEntries[i];
+    if (entry.key != key) continue;
+    bool inBounds = true;
+    for (int s = 0; s < maxSections; s++)
+      inBounds &= entry.offset[s] + entry.size[s] <= m_mappedSize;
+    if (!inBounds) return nullptr;
+    // Carry the blob over into the next version of the cache file, once
+    std::lock_guard<std::mutex> lock(m_blobsMutex);
+    if (!m_keptKeys.insert(key).second) return &entry;
+    Blob blob = {entry, {}};
+    for (int s = 0; s < maxSections; s++) blob.data[s] = getSection(entry, s);
+    m_blobs.emplace_back(blob);
+    return &entry;
+  }
+  return nullptr;
+}
+
+const void* SceneCache::getSection(const Entry& entry, int section) {
+  if (entry.size[section] == 0) return nullptr;
+  return static_cast<const char*>(m_pMapped) + entry.offset[section];
+}
+
+void SceneCache::store(const Entry& entry, const void* data0,
+                       const void* data1, const void* data2) {
+  if (m_cachePath.empty()) return;
+  std::lock_guard<std::mutex> lock(m_blobsMutex);
+  m_blobs.emplace_back(Blob{entry, {data0, data1, data2}});
+  m_dirty = true;
+}
+
+bool SceneCache::write(const std::string& filePath) {
+  std::ofstream file(filePath, std::ios::binary | std::ios::trunc);
+  if (!file) return false;
+
+  auto alignUp = [](uint64_t offset) {
+    return (offset + cacheAlignment - 1) / cacheAlignment * cacheAlignment;
+  };
+
+  // Lay out the data sections behind the header and the entry table
+  vector<Entry> entries;
+  entries.reserve(m_blobs.size());
+  uint64_t offset = alignUp(sizeof(CacheHeader) + sizeof(Entry) * m_blobs.size());
+  for (auto& blob : m_blobs) {
+    Entry entry = blob.entry;
+    for (int s = 0; s < maxSections; s++) {
+      entry.offset[s] = offset;
+      offset = alignUp(offset + entry.size[s]);
+    }
+    entries.emplace_back(entry);
+  }
+
+  CacheHeader header = {};
+  memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = SCENE_CACHE_VERSION;
+  header.numEntries = uint32_t(entries.size());
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(entries.data()),
+             sizeof(Entry) * entries.size());
+
+  const char padding[cacheAlignment] = {};
+  uint64_t written = sizeof(CacheHeader) + sizeof(Entry) * entries.size();
+  for (size_t i = 0; i < entries.size(); i++) {
+    for (int s = 0; s < maxSections; s++) {
+      const Entry& entry = entries[i];
+      file.write(padding, entry.offset[s] - written);
+      file.write(static_cast<const char*>(m_blobs[i].data[s]), entry.size[s]);
+      written = entry.offset[s] + entry.size[s];
+    }
+  }
+  return bool(file);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "mesh.h"
+#include "texture.h"
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Bump whenever the layout of any cached blob changes, stale caches are then
+// ignored and rebuilt on the next load
+#define SCENE_CACHE_VERSION 4
+
+// Hash the raw bytes of a file
+uint64_t hashFileContent(const std::string& filePath);
+
+// Hash a block of memory, chaining from a previous hash value
+uint64_t hashBytes(const void* data, size_t size,
+                   uint64_t hash = 14695981039346656037ull);
+
+// Per-scene cache of preprocessed assets. Every blob is keyed by the content
+// hash of its source file together with the options it was processed with, so
+// an edited file misses while a renamed one still hits. The cache file is
+// memory-mapped, texels and envmap tables are handed to the staging buffers
+// straight from the mapping. Block-compressed textures with their mip chains
+// are kept as KTX2 files in a directory next to the cache file, so warm
+// starts never decode them. The load*() functions may be called from several
+// threads at once.
+class SceneCache {
+public:
+  ~SceneCache();
+  // Map an existing cache file, a missing or outdated one is simply ignored
+  void open(const std::string& cachePath);
+  // Write newly processed assets back to disk and release the mapping. Assets
+  // returned by load*() may point into the mapping, so only call this after
+  // they have been uploaded.
+  void close();
+
+public:
+  Mesh* loadMesh(const std::string& meshPath, bool recomputeNormal,
+                 vec2 uvScale);
+  // Content key of a texture, equal for byte-identical files loaded with
+  // the same options
+  uint64_t getTextureKey(const std::string& texturePath, float gamma);
+  Texture* loadTexture(uint64_t key, const std::string& texturePath,
+                       float gamma, bool compress = false);
+  EnvMap* loadEnvMap(const std::string& envmapPath, bool compress = false);
+
+private:
+  enum BlobType {
+    BlobTypeMesh = 0,
+    BlobTypeTexture = 1,
+    BlobTypeEnvMap = 2,
+  };
+  static const int maxSections = 3;
+  struct Entry {
+    uint64_t key;
+    uint32_t type;
+    uint32_t format;  // VkFormat of texel blobs
+    uint32_t width;   // texel width, or number of vertices
+    uint32_t height;  // texel height, or number of indices
+    float bounds[6];  // mesh aabb
+    uint64_t offset[maxSections];
+    uint64_t size[maxSections];
+  };
+  struct Blob {
+    Entry entry;
+    const void* data[maxSections];
+  };
+
+  const Entry* find(uint64_t key);
+  const void* getSection(const Entry& entry, int section);
+  void store(const Entry& entry, const void* data0,
+             const void* data1 = nullptr, const void* data2 = nullptr);
+  bool write(const std::string& filePath);
+  // Compressed texture of a blob key, loaded from its KTX2 file or built from
+  // the decoded texture and written back
+  Texture* loadCompressed(uint64_t key,
+                          const std::function<Texture*()>& decode);
+
+private:
+  std::string m_cachePath{};
+  void* m_pMapped{nullptr};
+  size_t m_mappedSize{0};
+  const Entry* m_pEntries{nullptr};
+  uint32_t m_numEntries{0};
+  // Blobs that make up the next version of the cache file
+  std::vector<Blob> m_blobs{};
+  std::unordered_set<uint64_t> m_keptKeys{};  // Entries carried over
+  std::mutex m_blobsMutex;
+  bool m_dirty{false};
+};
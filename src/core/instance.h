@@ -16,29 +16,30 @@ public:
     m_transform = tm;
     m_meshIndex = meshId;
     m_materialIndex = matId;
-    m_lightIndex = -1;
+    m_emitterOffset = -1;
   }
-  Instance(uint meshId, uint lightId) {
+  // Emitter instance, emitterOffset points to the light record of its first
+  // primitive in the scene's emitter table
+  Instance(uint meshId, uint emitterOffset) {
     m_meshIndex = meshId;
-    m_lightIndex = lightId;
+    m_emitterOffset = emitterOffset;
   }
   const mat4& getTransform() { return m_transform; }
   uint getMeshIndex() { return m_meshIndex; }
   uint getMaterialIndex() { return m_materialIndex; }
-  int getLightIndex() { return m_lightIndex; }
+  int getEmitterOffset() { return m_emitterOffset; }
 
 private:
   mat4 m_transform{nvmath::mat4f_id};
   uint m_meshIndex{0};      // Model index reference
   uint m_materialIndex{0};  // Material index reference
-  int m_lightIndex{-1};
+  int m_emitterOffset{-1};
 };
 
 class InstancesAlloc : public GpuAlloc {
 public:
   InstancesAlloc(ContextAware* pContext, vector<Instance>& instances,
                  vector<MeshAlloc*>& meshAllocs,
-                 vector<MaterialAlloc*>& materialAllocs,
                  const VkCommandBuffer& cmdBuf);
   void deinit(ContextAware* pContext);
   VkBuffer getBuffer() { return m_bInstances.buffer; }
@@ -0,0 +1,298 @@
+#include "ktx.h"
+#include "temp_file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+static const uint8_t ktx2Identifier[12] = {0xAB, 'K',  'T',  'X', ' ',  '2',
+                                           '0',  0xBB, '\r', '\n', 0x1A, '\n'};
+
+struct Ktx2Header {
+  uint8_t identifier[12];
+  uint32_t vkFormat;
+  uint32_t typeSize;
+  uint32_t pixelWidth;
+  uint32_t pixelHeight;
+  uint32_t pixelDepth;
+  uint32_t layerCount;
+  uint32_t faceCount;
+  uint32_t levelCount;
+  uint32_t supercompressionScheme;
+  uint32_t dfdByteOffset;
+  uint32_t dfdByteLength;
+  uint32_t kvdByteOffset;
+  uint32_t kvdByteLength;
+  uint64_t sgdByteOffset;
+  uint64_t sgdByteLength;
+};
+
+struct Ktx2Level {
+  uint64_t byteOffset;
+  uint64_t byteLength;
+  uint64_t uncompressedByteLength;
+};
+
+// Khronos data format descriptor enums used below
+enum {
+  DfdModelRGBSDA = 1,
+  DfdModelBC1A = 128,
+  DfdModelBC4 = 131,
+  DfdModelBC5 = 132,
+  DfdModelBC6H = 133,
+  DfdModelBC7 = 134,
+  DfdPrimariesBT709 = 1,
+  DfdTransferLinear = 1,
+  DfdTransferSRGB = 2,
+  DfdChannelAlpha = 15,
+  DfdQualifierLinear = 0x10,
+  DfdQualifierFloat = 0x80,
+};
+
+static uint32_t floatBits(float v) {
+  uint32_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  return bits;
+}
+
+static void putSample(vector<uint32_t>& dfd, uint32_t bitOffset,
+                      uint32_t bitLength, uint32_t channel, uint32_t lower,
+                      uint32_t upper) {
+  dfd.push_back(bitOffset | ((bitLength - 1) << 16) | (channel << 24));
+  dfd.push_back(0);  // sample position
+  dfd.push_back(lower);
+  dfd.push_back(upper);
+}
+
+// Basic data format descriptor block, required by the container
+static vector<uint32_t> makeDfd(VkFormat format) {
+  bool srgb = (format == VK_FORMAT_R8G8B8A8_SRGB ||
+               format == VK_FORMAT_BC1_RGB_SRGB_BLOCK ||
+               format == VK_FORMAT_BC7_SRGB_BLOCK);
+  bool block = isBlockCompressed(format);
+  uint32_t texelSize = uint32_t(getTexelSize(format));
+  uint32_t model = DfdModelRGBSDA;
+  switch (format) {
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+      model = DfdModelBC1A;
+      break;
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+      model = DfdModelBC4;
+      break;
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+      model = DfdModelBC5;
+      break;
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+      model = DfdModelBC6H;
+      break;
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+      model = DfdModelBC7;
+      break;
+    default:
+      break;
+  }
+
+  vector<uint32_t> dfd = {0, 0, 0, 0, 0, 0, 0};
+  dfd[1] = 0;  // khronos vendor, basic descriptor type
+  dfd[3] = model | (DfdPrimariesBT709 << 8) |
+           ((srgb ? DfdTransferSRGB : DfdTransferLinear) << 16);
+  dfd[4] = block ? 3 | (3 << 8) : 0;
+  dfd[5] = texelSize;
+
+  uint32_t unormUpper = 0xffffffffu;
+  switch (format) {
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+      putSample(dfd, 0, 64, 0, 0, unormUpper);
+      putSample(dfd, 64, 64, 1, 0, unormUpper);
+      break;
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+      putSample(dfd, 0, 128, DfdQualifierFloat, 0, floatBits(1.f));
+      break;
+    case VK_FORMAT_R8_UNORM:
+      putSample(dfd, 0, 8, 0, 0, 255);
+      break;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+      for (uint32_t c = 0; c < 3; c++) putSample(dfd, 8 * c, 8, c, 0, 255);
+      putSample(dfd, 24, 8, DfdChannelAlpha | (srgb ? DfdQualifierLinear : 0),
+                0, 255);
+      break;
+    case VK_FORMAT_R16_SFLOAT:
+      putSample(dfd, 0, 16, DfdQualifierFloat, floatBits(-1.f),
+                floatBits(1.f));
+      break;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+      for (uint32_t c = 0; c < 4; c++)
+        putSample(dfd, 16 * c, 16,
+                  (c == 3 ? DfdChannelAlpha : c) | DfdQualifierFloat,
+                  floatBits(-1.f), floatBits(1.f));
+      break;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+      for (uint32_t c = 0; c < 4; c++)
+        putSample(dfd, 32 * c, 32,
+                  (c == 3 ? DfdChannelAlpha : c) | DfdQualifierFloat,
+                  floatBits(-1.f), floatBits(1.f));
+      break;
+    default:
+      // BC1, BC4 and BC7 blocks are described by a single sample
+      putSample(dfd, 0, uint32_t(texelSize * 8), 0, 0, unormUpper);
+      break;
+  }
+  uint32_t blockSize = uint32_t(sizeof(uint32_t) * (dfd.size() - 1));
+  dfd[2] = 2 | (blockSize << 16);  // version 1.3 of the descriptor
+  dfd[0] = uint32_t(sizeof(uint32_t) * dfd.size());
+  return dfd;
+}
+
+static bool isSupportedFormat(VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_R8_UNORM:
+    case VK_FORMAT_R16_SFLOAT:
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint64_t alignUp(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+bool writeKtx2(const std::string& filePath, Texture* pTexture) {
+  VkFormat format = pTexture->getFormat();
+  VkExtent2D shape = pTexture->getSize();
+  uint32_t levelCount = pTexture->getMipLevels();
+  vector<uint32_t> dfd = makeDfd(format);
+
+  Ktx2Header header = {};
+  memcpy(header.identifier, ktx2Identifier, sizeof(ktx2Identifier));
+  header.vkFormat = format;
+  // Size of the data type of a component, one for blocks
+  header.typeSize = isBlockCompressed(format)
+                        ? 1
+                        : uint32_t(getTexelSize(format) /
+                                   (format == VK_FORMAT_R8_UNORM ||
+                                            format == VK_FORMAT_R16_SFLOAT
+                                        ? 1
+                                        : 4));
+  header.pixelWidth = shape.width;
+  header.pixelHeight = shape.height;
+  header.faceCount = 1;
+  header.levelCount = levelCount;
+  header.dfdByteOffset =
+      uint32_t(sizeof(Ktx2Header) + sizeof(Ktx2Level) * levelCount);
+  header.dfdByteLength = uint32_t(sizeof(uint32_t) * dfd.size());
+
+  // Levels are stored from the smallest to the largest one, each aligned to
+  // the least common multiple of the texel block size and 4
+  uint64_t alignment = std::max<uint64_t>(getTexelSize(format), 4);
+  vector<Ktx2Level> levels(levelCount);
+  vector<uint64_t> srcOffsets(levelCount);
+  uint64_t srcOffset = 0;
+  for (uint32_t level = 0; level < levelCount; level++) {
+    srcOffsets[level] = srcOffset;
+    levels[level].byteLength = getLevelSize(format, shape, level);
+    levels[level].uncompressedByteLength = levels[level].byteLength;
+    srcOffset += levels[level].byteLength;
+  }
+  uint64_t offset = header.dfdByteOffset + header.dfdByteLength;
+  for (int level = int(levelCount) - 1; level >= 0; level--) {
+    offset = alignUp(offset, alignment);
+    levels[level].byteOffset = offset;
+    offset += levels[level].byteLength;
+  }
+
+  std::string tmpPath = makeTempPath(filePath);
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(levels.data()),
+               sizeof(Ktx2Level) * levelCount);
+    file.write(reinterpret_cast<const char*>(dfd.data()),
+               header.dfdByteLength);
+    uint64_t written = header.dfdByteOffset + header.dfdByteLength;
+    const char padding[16] = {};
+    auto data = static_cast<const char*>(pTexture->getData());
+    for (int level = int(levelCount) - 1; level >= 0; level--) {
+      file.write(padding, levels[level].byteOffset - written);
+      file.write(data + srcOffsets[level], levels[level].byteLength);
+      written = levels[level].byteOffset + levels[level].byteLength;
+    }
+    if (!file) {
+      file.close();
+      std::remove(tmpPath.c_str());
+      return false;
+    }
+  }
+  return replaceWithTemp(tmpPath, filePath);
+}
+
+Texture* readKtx2(const std::string& filePath) {
+  std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+  if (!file) return nullptr;
+  uint64_t fileSize = uint64_t(file.tellg());
+  file.seekg(0);
+
+  Ktx2Header header;
+  if (fileSize < sizeof(header) ||
+      !file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    return nullptr;
+  VkFormat format = VkFormat(header.vkFormat);
+  bool valid =
+      memcmp(header.identifier, ktx2Identifier, sizeof(ktx2Identifier)) == 0 &&
+      isSupportedFormat(format) && header.pixelWidth > 0 &&
+      header.pixelHeight > 0 && header.pixelDepth == 0 &&
+      header.layerCount == 0 && header.faceCount == 1 &&
+      header.supercompressionScheme == 0 && header.levelCount > 0 &&
+      header.levelCount <= 32;
+  if (!valid) {
+    LOG_WARN("{}: ignoring unsupported ktx2 file [{}]", "Cache", filePath);
+    return nullptr;
+  }
+
+  VkExtent2D shape = {header.pixelWidth, header.pixelHeight};
+  vector<Ktx2Level> levels(header.levelCount);
+  file.read(reinterpret_cast<char*>(levels.data()),
+            sizeof(Ktx2Level) * header.levelCount);
+
+  VkDeviceSize totalSize = 0;
+  for (uint32_t level = 0; level < header.levelCount; level++) {
+    const Ktx2Level& l = levels[level];
+    if (l.byteLength != getLevelSize(format, shape, level) ||
+        l.byteOffset + l.byteLength > fileSize) {
+      LOG_WARN("{}: ignoring broken ktx2 file [{}]", "Cache", filePath);
+      return nullptr;
+    }
+    totalSize += l.byteLength;
+  }
+
+  // Gather the levels from the largest one on
+  auto data = static_cast<char*>(malloc(totalSize));
+  char* dst = data;
+  for (uint32_t level = 0; level < header.levelCount; level++) {
+    file.seekg(levels[level].byteOffset);
+    file.read(dst, levels[level].byteLength);
+    dst += levels[level].byteLength;
+  }
+  if (!file) {
+    free(data);
+    LOG_WARN("{}: failed to read ktx2 file [{}]", "Cache", filePath);
+    return nullptr;
+  }
+  return new Texture(data, shape, format, header.levelCount, true);
+}
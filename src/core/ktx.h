@@ -0,0 +1,13 @@
+#pragma once
+
+#include "texture.h"
+
+#include <string>
+
+// Write a 2D texture with all of its mip levels as a KTX2 container
+bool writeKtx2(const std::string& filePath, Texture* pTexture);
+
+// Read a 2D texture written by writeKtx2, returns nullptr when the file is
+// missing or holds anything the texture loader does not support. The texture
+// owns its data.
+Texture* readKtx2(const std::string& filePath);
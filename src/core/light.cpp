@@ -1,14 +1,286 @@
 #include "light.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace {
+
+using nvmath::vec3f;
+
+const float kPi = 3.14159265358979f;
+
+// Everything the heuristic and the shaders need to know about a set of
+// lights, the cone holds the normals (axis, theta0) and the emission
+// around them (thetaE)
+struct LightBounds {
+  vec3f bmin{FLT_MAX, FLT_MAX, FLT_MAX};
+  vec3f bmax{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  float power{0.f};
+  vec3f axis{0.f, 0.f, 1.f};
+  float theta0{-1.f};  // negative while no light is bounded
+  float thetaE{0.f};
+
+  vec3f centroid() const { return (bmin + bmax) * 0.5f; }
+  float surfaceArea() const {
+    if (bmin.x > bmax.x) return 0.f;
+    vec3f d = bmax - bmin;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+};
+
+float luminance(const vec3f& rgb) {
+  return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+
+// Smallest cone holding both cones
+void unionCone(LightBounds& a, const LightBounds& b) {
+  if (b.theta0 < 0.f) return;
+  if (a.theta0 < 0.f) {
+    a.axis = b.axis, a.theta0 = b.theta0;
+    return;
+  }
+  float thetaD =
+      std::acos(std::min(std::max(nvmath::dot(a.axis, b.axis), -1.f), 1.f));
+  if (std::min(thetaD + b.theta0, kPi) <= a.theta0) return;
+  if (std::min(thetaD + a.theta0, kPi) <= b.theta0) {
+    a.axis = b.axis, a.theta0 = b.theta0;
+    return;
+  }
+  float theta0 = (a.theta0 + thetaD + b.theta0) * 0.5f;
+  vec3f wr = nvmath::cross(a.axis, b.axis);
+  if (theta0 >= kPi || nvmath::dot(wr, wr) == 0.f) {
+    a.theta0 = kPi;
+    return;
+  }
+  // Rotate the axis of a towards b
+  float thetaR = theta0 - a.theta0;
+  wr = nvmath::normalize(wr);
+  a.axis = nvmath::normalize(a.axis * std::cos(thetaR) +
+                             nvmath::cross(wr, a.axis) * std::sin(thetaR));
+  a.theta0 = theta0;
+}
+
+void unionBounds(LightBounds& a, const LightBounds& b) {
+  a.bmin = nvmath::nv_min(a.bmin, b.bmin);
+  a.bmax = nvmath::nv_max(a.bmax, b.bmax);
+  a.power += b.power;
+  a.thetaE = std::max(a.thetaE, b.thetaE);
+  unionCone(a, b);
+}
+
+LightBounds getLightBounds(const GpuLight& light) {
+  LightBounds lb;
+  lb.thetaE = kPi * 0.5f;
+  float lum = luminance(light.radiance);
+  if (light.type == LightTypeRect || light.type == LightTypeTriangle) {
+    vec3f corners[4] = {light.position, light.position + light.u,
+                        light.position + light.v,
+                        light.position + light.u + light.v};
+    int numCorners = light.type == LightTypeRect ? 4 : 3;
+    for (int i = 0; i < numCorners; i++) {
+      lb.bmin = nvmath::nv_min(lb.bmin, corners[i]);
+      lb.bmax = nvmath::nv_max(lb.bmax, corners[i]);
+    }
+    vec3f n = nvmath::cross(light.u, light.v);
+    float len = nvmath::length(n);
+    lb.axis = len > 0.f ? n / len : vec3f(0.f, 0.f, 1.f);
+    lb.theta0 = light.doubleSide == 1 ? kPi : 0.f;
+    lb.power = lum * light.area * kPi * (light.doubleSide == 1 ? 2.f : 1.f);
+  } else if (light.type == LightTypePoint) {
+    lb.bmin = lb.bmax = light.position;
+    lb.theta0 = kPi;
+    lb.power = lum * 4.f * kPi;
+  } else {
+    // Directional, no position and the same irradiance everywhere
+    lb.theta0 = kPi;
+    lb.power = lum * kPi;
+  }
+  return lb;
+}
+
+// Solid angle measure of the cone, weighted by the emitted cosine
+float coneMeasure(const LightBounds& lb) {
+  float theta0 = std::max(lb.theta0, 0.f);
+  float thetaW = std::min(theta0 + lb.thetaE, kPi);
+  float sinTheta0 = std::sin(theta0), cosTheta0 = std::cos(theta0);
+  return 2.f * kPi * (1.f - cosTheta0) +
+         kPi * 0.5f *
+             (2.f * thetaW * sinTheta0 - std::cos(theta0 - 2.f * thetaW) -
+              2.f * theta0 * sinTheta0 + cosTheta0);
+}
+
+class LightBvhBuilder {
+public:
+  struct Prim {
+    int lightId;
+    LightBounds bounds;
+  };
+
+  LightBvhBuilder(vector<GpuLight>& lights, vector<GpuLightBvhNode>& nodes)
+      : m_lights(lights), m_nodes(nodes) {}
+
+  // Fill the node at nodeId, which is already allocated, with the prims
+  // in [begin, end)
+  void build(int nodeId, int parent, vector<Prim>& prims, size_t begin,
+             size_t end) {
+    LightBounds lb;
+    for (size_t i = begin; i < end; i++) unionBounds(lb, prims[i].bounds);
+    writeNode(nodeId, parent, lb);
+    if (end - begin == 1) {
+      m_nodes[nodeId].lightId = prims[begin].lightId;
+      m_lights[prims[begin].lightId].bvhLeaf = nodeId;
+      return;
+    }
+
+    size_t mid = split(prims, begin, end, lb);
+    int child = int(m_nodes.size());
+    m_nodes.resize(m_nodes.size() + 2);
+    m_nodes[nodeId].child = child;
+    build(child, nodeId, prims, begin, mid);
+    build(child + 1, nodeId, prims, mid, end);
+  }
+
+  void writeNode(int nodeId, int parent, const LightBounds& lb) {
+    GpuLightBvhNode& node = m_nodes[nodeId];
+    node.boundsMin = lb.bmin;
+    node.boundsMax = lb.bmax;
+    node.power = lb.power;
+    node.axis = lb.axis;
+    node.cosTheta0 = std::cos(std::max(lb.theta0, 0.f));
+    node.cosThetaE = std::cos(lb.thetaE);
+    node.child = -1;
+    node.parent = parent;
+    node.lightId = 0;
+  }
+
+private:
+  static const int numBins = 12;
+
+  // Binned surface area orientation heuristic, falls back to a median
+  // split when the centroids can not be told apart
+  size_t split(vector<Prim>& prims, size_t begin, size_t end,
+               const LightBounds& lb) {
+    vec3f cmin{FLT_MAX, FLT_MAX, FLT_MAX}, cmax{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (size_t i = begin; i < end; i++) {
+      cmin = nvmath::nv_min(cmin, prims[i].bounds.centroid());
+      cmax = nvmath::nv_max(cmax, prims[i].bounds.centroid());
+    }
+    vec3f extent = lb.bmax - lb.bmin;
+    float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestBin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      if (!(cmax[axis] > cmin[axis])) continue;
+      float scale = numBins / (cmax[axis] - cmin[axis]);
+      LightBounds bins[numBins];
+      for (size_t i = begin; i < end; i++) {
+        unionBounds(bins[binOf(prims[i], axis, cmin[axis], scale)],
+                    prims[i].bounds);
+      }
+      // Costs of the splits after every bin, swept from both sides
+      LightBounds below[numBins - 1], above[numBins - 1];
+      LightBounds acc;
+      for (int b = 0; b < numBins - 1; b++) {
+        unionBounds(acc, bins[b]);
+        below[b] = acc;
+      }
+      acc = LightBounds();
+      for (int b = numBins - 1; b > 0; b--) {
+        unionBounds(acc, bins[b]);
+        above[b - 1] = acc;
+      }
+      // Thin boxes would otherwise be split along their short axes
+      float kr = extent[axis] > 0.f ? maxExtent / extent[axis] : 1.f;
+      for (int b = 0; b < numBins - 1; b++) {
+        if (below[b].theta0 < 0.f || above[b].theta0 < 0.f) continue;
+        float cost = kr * (cost0(below[b]) + cost0(above[b]));
+        if (cost < bestCost) bestCost = cost, bestAxis = axis, bestBin = b;
+      }
+    }
+
+    size_t mid = (begin + end) / 2;
+    if (bestAxis >= 0) {
+      float scale = numBins / (cmax[bestAxis] - cmin[bestAxis]);
+      auto it = std::partition(
+          prims.begin() + begin, prims.begin() + end, [&](const Prim& p) {
+            return binOf(p, bestAxis, cmin[bestAxis], scale) <= bestBin;
+          });
+      size_t cut = it - prims.begin();
+      if (cut > begin && cut < end) return cut;
+    }
+    return mid;
+  }
+
+  static int binOf(const Prim& p, int axis, float cmin, float scale) {
+    int b = int((p.bounds.centroid()[axis] - cmin) * scale);
+    return std::min(std::max(b, 0), numBins - 1);
+  }
+
+  static float cost0(const LightBounds& lb) {
+    return lb.power * coneMeasure(lb) * lb.surfaceArea();
+  }
+
+  vector<GpuLight>& m_lights;
+  vector<GpuLightBvhNode>& m_nodes;
+};
+
+}  // namespace
+
+vector<GpuLightBvhNode> buildLightBvh(vector<GpuLight>& lights) {
+  using Prim = LightBvhBuilder::Prim;
+  vector<Prim> prims;
+  prims.reserve(lights.size());
+  for (size_t i = 0; i < lights.size(); i++) {
+    lights[i].bvhLeaf = -1;
+    if (i > 0) prims.push_back({int(i), getLightBounds(lights[i])});
+  }
+  // Directional lights first, they are kept apart from positioned ones
+  auto localBegin = std::stable_partition(
+      prims.begin(), prims.end(), [&](const Prim& p) {
+        return lights[p.lightId].type == LightTypeDirectional;
+      });
+  size_t numDirectional = localBegin - prims.begin();
+
+  vector<GpuLightBvhNode> nodes(1);
+  LightBvhBuilder builder(lights, nodes);
+  if (prims.empty()) {
+    builder.writeNode(0, -1, LightBounds());
+    nodes[0].power = 0.f;
+  } else if (numDirectional == 0 || numDirectional == prims.size()) {
+    builder.build(0, -1, prims, 0, prims.size());
+  } else {
+    LightBounds lb;
+    for (auto& prim : prims) lb.power += prim.bounds.power;
+    builder.writeNode(0, -1, lb);
+    nodes.resize(3);
+    nodes[0].child = 1;
+    builder.build(1, 0, prims, 0, numDirectional);
+    builder.build(2, 0, prims, numDirectional, prims.size());
+  }
+  return nodes;
+}
+
 LightsAlloc::LightsAlloc(ContextAware* pContext, vector<GpuLight>& lights,
-                         const VkCommandBuffer& cmdBuf) {
+                         vector<int>& emitters, const VkCommandBuffer& cmdBuf) {
   auto& m_alloc = pContext->getAlloc();
   VkBufferUsageFlags flag = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+  // Sets the leaf of every light, build before uploading the lights
+  vector<GpuLightBvhNode> lightBvh = buildLightBvh(lights);
   m_bLights = m_alloc.createBuffer(cmdBuf, lights,
                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | flag);
+  // Storage buffers can not be empty
+  if (emitters.empty()) emitters.emplace_back(0);
+  m_bEmitters = m_alloc.createBuffer(cmdBuf, emitters,
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  m_bLightBvh = m_alloc.createBuffer(cmdBuf, lightBvh,
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 }
 
 void LightsAlloc::deinit(ContextAware* pContext) {
   pContext->getAlloc().destroy(m_bLights);
+  pContext->getAlloc().destroy(m_bEmitters);
+  pContext->getAlloc().destroy(m_bLightBvh);
   intoReleased();
-}
\ No newline at end of file
+}
@@ -5,13 +5,23 @@
 #include <context/context.h>
 #include "alloc.h"
 
+// Build the light bvh over every light but the dummy one at index 0 and
+// store the leaf of each light in its bvhLeaf. Lights are split by the
+// surface area orientation heuristic, directional lights get a subtree of
+// their own below the root.
+vector<GpuLightBvhNode> buildLightBvh(vector<GpuLight>& lights);
+
 class LightsAlloc : public GpuAlloc {
 public:
   LightsAlloc(ContextAware* pContext, vector<GpuLight>& lights,
-              const VkCommandBuffer& cmdBuf);
+              vector<int>& emitters, const VkCommandBuffer& cmdBuf);
   void deinit(ContextAware* pContext);
   VkBuffer getBuffer() { return m_bLights.buffer; }
+  VkBuffer getEmittersBuffer() { return m_bEmitters.buffer; }
+  VkBuffer getLightBvhBuffer() { return m_bLightBvh.buffer; }
 
 private:
   nvvk::Buffer m_bLights;
+  nvvk::Buffer m_bEmitters;  // Light id per emissive primitive
+  nvvk::Buffer m_bLightBvh;
 };
\ No newline at end of file
@@ -2,18 +2,22 @@
 
 #include <nvvk/buffers_vk.hpp>
 
-MaterialAlloc::MaterialAlloc(ContextAware* pContext, Material* pMaterial,
-                             const VkCommandBuffer& cmdBuf) {
+MaterialsAlloc::MaterialsAlloc(ContextAware* pContext,
+                               vector<GpuMaterial>& materials,
+                               const VkCommandBuffer& cmdBuf) {
   auto& m_alloc = pContext->getAlloc();
-  vector<GpuMaterial> m_materialData{};
-  m_materialData.emplace_back(pMaterial->getMaterial());
-  VkBufferUsageFlags flag = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-  m_type = pMaterial->getType();
-  m_bMaterial = m_alloc.createBuffer(cmdBuf, m_materialData,
-                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | flag);
+  m_types.reserve(materials.size());
+  m_alphaTested.reserve(materials.size());
+  for (auto& material : materials) {
+    m_types.emplace_back(MaterialType(material.type));
+    m_alphaTested.push_back(material.opacityTextureId >= 0);
+  }
+  m_bMaterials = m_alloc.createBuffer(
+      cmdBuf, materials,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 }
 
-void MaterialAlloc::deinit(ContextAware* pContext) {
-  pContext->getAlloc().destroy(m_bMaterial);
+void MaterialsAlloc::deinit(ContextAware* pContext) {
+  pContext->getAlloc().destroy(m_bMaterials);
   intoReleased();
-}
\ No newline at end of file
+}
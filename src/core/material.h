@@ -41,15 +41,20 @@ private:
   GpuMaterial m_material;
 };
 
-class MaterialAlloc : public GpuAlloc {
+// All materials of the scene packed into one storage buffer, indexed by
+// material id
+class MaterialsAlloc : public GpuAlloc {
 public:
-  MaterialAlloc(ContextAware* pContext, Material* pMaterial,
-                const VkCommandBuffer& cmdBuf);
+  MaterialsAlloc(ContextAware* pContext, vector<GpuMaterial>& materials,
+                 const VkCommandBuffer& cmdBuf);
   void deinit(ContextAware* pContext);
-  VkBuffer getBuffer() { return m_bMaterial.buffer; }
-  MaterialType getType() { return m_type; }
+  VkBuffer getBuffer() { return m_bMaterials.buffer; }
+  MaterialType getType(uint materialId) { return m_types[materialId]; }
+  // Has an opacity texture, tested by the any-hit shader
+  bool isAlphaTested(uint materialId) { return m_alphaTested[materialId]; }
 
 private:
-  MaterialType m_type;
-  nvvk::Buffer m_bMaterial;
+  vector<MaterialType> m_types;
+  vector<bool> m_alphaTested;
+  nvvk::Buffer m_bMaterials;
 };
\ No newline at end of file
@@ -1,5 +1,12 @@
 #include "mesh.h"
 
+#include "thread_pool.h"
+
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
 #include <nvh/nvprint.hpp>
 #include <nvvk/buffers_vk.hpp>
 #include <nvvk/commands_vk.hpp>
@@ -51,34 +58,108 @@ Mesh::Mesh(Primitive& prim) {
 Mesh::Mesh(const std::string& meshPath, bool recomputeNormal, vec2 uvScale) {
   m_vertices.clear();
   m_indices.clear();
-  loadMesh(meshPath, m_vertices, m_indices);
-
-  for (size_t i = 0; i < m_indices.size(); i += 3) {
-    GpuVertex& v0 = m_vertices[m_indices[i + 0]];
-    GpuVertex& v1 = m_vertices[m_indices[i + 1]];
-    GpuVertex& v2 = m_vertices[m_indices[i + 2]];
-
-    if (recomputeNormal) {
-      nvmath::vec3f n = nvmath::normalize(
-          nvmath::cross((v1.pos - v0.pos), (v2.pos - v0.pos)));
-      v0.normal = n;
-      v1.normal = n;
-      v2.normal = n;
+  // Flat normals differ per face, so weld only after they have been assigned
+  loadMesh(meshPath, m_vertices, m_indices, !recomputeNormal);
+
+  auto& pool = ThreadPool::get();
+  if (recomputeNormal) {
+    // Vertices are not shared yet, every face owns its three corners
+    pool.parallelFor(
+        m_indices.size() / 3, 4096, [&](size_t faceBegin, size_t faceEnd) {
+          for (size_t i = 3 * faceBegin; i < 3 * faceEnd; i += 3) {
+            GpuVertex& v0 = m_vertices[m_indices[i + 0]];
+            GpuVertex& v1 = m_vertices[m_indices[i + 1]];
+            GpuVertex& v2 = m_vertices[m_indices[i + 2]];
+            nvmath::vec3f n = nvmath::normalize(
+                nvmath::cross((v1.pos - v0.pos), (v2.pos - v0.pos)));
+            v0.normal = n;
+            v1.normal = n;
+            v2.normal = n;
+          }
+        });
+    weldVertices(m_vertices, m_indices);
+  }
+
+  // Scale uv and compute bounds per vertex, each chunk reduces its own aabb
+  std::mutex aabbMutex;
+  pool.parallelFor(m_vertices.size(), 16384, [&](size_t begin, size_t end) {
+    float minX = BBOX_MAXF, minY = BBOX_MAXF, minZ = BBOX_MAXF;
+    float maxX = BBOX_MINF, maxY = BBOX_MINF, maxZ = BBOX_MINF;
+    GpuVertex* pVertices = m_vertices.data();
+    for (size_t i = begin; i < end; i++) {
+      GpuVertex& v = pVertices[i];
+      v.uv.x *= uvScale.x;
+      v.uv.y *= uvScale.y;
+      minX = v.pos.x < minX ? v.pos.x : minX;
+      minY = v.pos.y < minY ? v.pos.y : minY;
+      minZ = v.pos.z < minZ ? v.pos.z : minZ;
+      maxX = v.pos.x > maxX ? v.pos.x : maxX;
+      maxY = v.pos.y > maxY ? v.pos.y : maxY;
+      maxZ = v.pos.z > maxZ ? v.pos.z : maxZ;
     }
+    std::lock_guard<std::mutex> lock(aabbMutex);
+    GpuVertex corner;
+    corner.pos = vec3(minX, minY, minZ);
+    updateAabb(corner, m_posMin, m_posMax);
+    corner.pos = vec3(maxX, maxY, maxZ);
+    updateAabb(corner, m_posMin, m_posMax);
+  });
+}
 
-    v0.uv = uvScale * v0.uv;
-    v1.uv = uvScale * v1.uv;
-    v2.uv = uvScale * v2.uv;
+Mesh::Mesh(const GpuVertex* pVertices, uint numVertices, const uint* pIndices,
+           uint numIndices, vec3 posMin, vec3 posMax)
+    : m_vertices(pVertices, pVertices + numVertices),
+      m_indices(pIndices, pIndices + numIndices),
+      m_posMin(posMin),
+      m_posMax(posMax) {}
 
-    updateAabb(v0, m_posMin, m_posMax);
-    updateAabb(v1, m_posMin, m_posMax);
-    updateAabb(v2, m_posMin, m_posMax);
+// Octahedral mapping of a unit vector, quantized to snorm16x2
+static uint packOctahedral(const vec3& v) {
+  float l1 = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+  if (l1 == 0.f) return OCT_ZERO_VECTOR;
+  float x = v.x / l1, y = v.y / l1;
+  if (v.z < 0.f) {
+    float ox = (1.f - fabsf(y)) * (x >= 0.f ? 1.f : -1.f);
+    float oy = (1.f - fabsf(x)) * (y >= 0.f ? 1.f : -1.f);
+    x = ox, y = oy;
   }
+  auto snorm16 = [](float f) {
+    f = std::max(-1.f, std::min(1.f, f));
+    return uint(uint16_t(int16_t(roundf(f * 32767.f))));
+  };
+  return snorm16(x) | (snorm16(y) << 16);
+}
+
+// Round-to-nearest-even float to half conversion, matches packHalf2x16
+static uint16_t floatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000u;
+  uint32_t absx = x & 0x7fffffffu;
+  if (absx >= 0x7f800000u)  // inf or nan
+    return uint16_t(sign | 0x7c00u | (absx > 0x7f800000u ? 0x200u : 0u));
+  if (absx >= 0x477ff000u)  // overflow
+    return uint16_t(sign | 0x7c00u);
+  if (absx < 0x38800000u) {  // subnormal or zero
+    if (absx < 0x33000000u) return uint16_t(sign);
+    uint32_t mant = (absx & 0x7fffffu) | 0x800000u;
+    uint32_t shift = 126u - (absx >> 23);
+    uint32_t half = mant >> shift;
+    uint32_t rest = mant & ((1u << shift) - 1u);
+    uint32_t halfway = 1u << (shift - 1u);
+    if (rest > halfway || (rest == halfway && (half & 1u))) half++;
+    return uint16_t(sign | half);
+  }
+  uint32_t half = ((absx - 0x38000000u) >> 13);
+  uint32_t rest = absx & 0x1fffu;
+  if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) half++;
+  return uint16_t(sign | half);
 }
 
 MeshAlloc::MeshAlloc(ContextAware* pContext, Mesh* pMesh,
-                     const VkCommandBuffer& cmdBuf) {
+                     const VkCommandBuffer& cmdBuf, bool compact) {
   auto& m_alloc = pContext->getAlloc();
+  MemCategoryScope memScope(MemCategoryGeometry);
 
   m_posMin = pMesh->getPosMin();
   m_posMax = pMesh->getPosMax();
@@ -92,12 +173,52 @@ MeshAlloc::MeshAlloc(ContextAware* pContext, Mesh* pMesh,
       flag |
       VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-  m_bVertices =
-      m_alloc.createBuffer(cmdBuf, pMesh->getVertices(),
-                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rayTracingFlags);
-  m_bIndices =
-      m_alloc.createBuffer(cmdBuf, pMesh->getIndices(),
-                           VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags);
+
+  if (!compact) {
+    m_vertexFormat = VertexFormatFull;
+    m_bVertices = m_alloc.createBuffer(
+        cmdBuf, pMesh->getVertices(),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rayTracingFlags);
+    m_bIndices =
+        m_alloc.createBuffer(cmdBuf, pMesh->getIndices(),
+                             VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags);
+    return;
+  }
+
+  // Split positions (also read by the blas build) from quantized attributes
+  m_vertexFormat = VertexFormatCompact;
+  const auto& vertices = pMesh->getVertices();
+  vector<vec3> positions(vertices.size());
+  vector<GpuVertexAttrib> attribs(vertices.size());
+  ThreadPool::get().parallelFor(
+      vertices.size(), 16384, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          const GpuVertex& v = vertices[i];
+          positions[i] = v.pos;
+          attribs[i].normal = packOctahedral(v.normal);
+          attribs[i].tangent = packOctahedral(v.tangent);
+          attribs[i].uv = uint(floatToHalf(v.uv.x)) |
+                          (uint(floatToHalf(v.uv.y)) << 16);
+        }
+      });
+  m_bVertices = m_alloc.createBuffer(
+      cmdBuf, positions, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rayTracingFlags);
+  m_bAttribs = m_alloc.createBuffer(
+      cmdBuf, attribs, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | flag);
+
+  const auto& indices = pMesh->getIndices();
+  if (m_numVertices <= 65536) {
+    m_vertexFormat |= VertexFormatIndex16;
+    // Pad to whole uints, the shader fetches two indices per uint
+    vector<uint16_t> indices16((indices.size() + 1) / 2 * 2, 0);
+    for (size_t i = 0; i < indices.size(); i++)
+      indices16[i] = uint16_t(indices[i]);
+    m_bIndices = m_alloc.createBuffer(
+        cmdBuf, indices16, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags);
+  } else {
+    m_bIndices = m_alloc.createBuffer(
+        cmdBuf, indices, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags);
+  }
 }
 
 void MeshAlloc::deinit(ContextAware* pContext) {
@@ -105,12 +226,55 @@ void MeshAlloc::deinit(ContextAware* pContext) {
 
   m_alloc.destroy(m_bVertices);
   m_alloc.destroy(m_bIndices);
+  if (m_bAttribs.buffer != VK_NULL_HANDLE) m_alloc.destroy(m_bAttribs);
 
   intoReleased();
 }
 
+// Hashing and comparison of the attributes that make a vertex unique
+struct VertexKeyHash {
+  size_t operator()(const GpuVertex& v) const {
+    const float attribs[8] = {v.pos.x, v.pos.y,    v.pos.z,    v.uv.x,
+                              v.uv.y,  v.normal.x, v.normal.y, v.normal.z};
+    uint64_t hash = 14695981039346656037ull;
+    for (float attrib : attribs) {
+      uint32_t bits;
+      memcpy(&bits, &attrib, sizeof(bits));
+      hash = (hash ^ bits) * 1099511628211ull;
+    }
+    return size_t(hash);
+  }
+};
+struct VertexKeyEqual {
+  bool operator()(const GpuVertex& a, const GpuVertex& b) const {
+    return memcmp(&a.pos, &b.pos, sizeof(a.pos)) == 0 &&
+           memcmp(&a.uv, &b.uv, sizeof(a.uv)) == 0 &&
+           memcmp(&a.normal, &b.normal, sizeof(a.normal)) == 0;
+  }
+};
+using VertexTable =
+    std::unordered_map<GpuVertex, uint, VertexKeyHash, VertexKeyEqual>;
+
+static uint addUniqueVertex(VertexTable& table, vector<GpuVertex>& vertices,
+                            const GpuVertex& vertex) {
+  auto result = table.emplace(vertex, uint(vertices.size()));
+  if (result.second) vertices.push_back(vertex);
+  return result.first->second;
+}
+
+void weldVertices(vector<GpuVertex>& vertices, vector<uint>& indices) {
+  VertexTable table;
+  table.reserve(vertices.size());
+  vector<GpuVertex> welded;
+  welded.reserve(vertices.size());
+  for (auto& index : indices)
+    index = addUniqueVertex(table, welded, vertices[index]);
+  welded.shrink_to_fit();
+  vertices.swap(welded);
+}
+
 void loadMesh(const std::string& meshPath, vector<GpuVertex>& vertices,
-              vector<uint>& indices) {
+              vector<uint>& indices, bool weld) {
   tinyobj::ObjReader reader;
   reader.ParseFromFile(meshPath);
   if (!reader.Valid()) {
@@ -120,8 +284,11 @@ void loadMesh(const std::string& meshPath, vector<GpuVertex>& vertices,
   }
   const auto& shapes = reader.GetShapes();
   const auto& attrib = reader.GetAttrib();
+  VertexTable table;
+  if (weld) table.reserve(attrib.vertices.size() / 3);
   for (const auto& shape : shapes) {
-    vertices.reserve(vertices.size() + shape.mesh.indices.size());
+    if (!weld)
+      vertices.reserve(vertices.size() + shape.mesh.indices.size());
     indices.reserve(indices.size() + shape.mesh.indices.size());
     for (const auto& index : shape.mesh.indices) {
       GpuVertex vertex = {};
@@ -138,14 +305,19 @@ void loadMesh(const std::string& meshPath, vector<GpuVertex>& vertices,
         vertex.normal = {*(np + 0), *(np + 1), *(np + 2)};
       }
 
-      vertices.push_back(vertex);
-      indices.push_back(static_cast<int>(indices.size()));
+      if (weld) {
+        indices.push_back(addUniqueVertex(table, vertices, vertex));
+      } else {
+        vertices.push_back(vertex);
+        indices.push_back(static_cast<int>(indices.size()));
+      }
     }
   }
 }
 
 nvvk::RaytracingBuilderKHR::BlasInput MeshBufferToBlas(VkDevice device,
-                                                       MeshAlloc& meshAlloc) {
+                                                       MeshAlloc& meshAlloc,
+                                                       bool opaque) {
   // BLAS builder requires raw device addresses.
   VkDeviceAddress vertexAddress =
       nvvk::getBufferDeviceAddress(device, meshAlloc.getVerticesBuffer());
@@ -154,25 +326,31 @@ nvvk::RaytracingBuilderKHR::BlasInput MeshBufferToBlas(VkDevice device,
 
   uint maxPrimitiveCount = meshAlloc.getIndicesNum() / 3;
 
-  // Describe buffer as array of Vertex.
+  uint vertexFormat = meshAlloc.getVertexFormat();
+
+  // Describe buffer as array of Vertex, or of positions for compact meshes.
   VkAccelerationStructureGeometryTrianglesDataKHR triangles{
       VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR};
   triangles.vertexFormat =
       VK_FORMAT_R32G32B32_SFLOAT;  // vec3 vertex position data.
   triangles.vertexData.deviceAddress = vertexAddress;
-  triangles.vertexStride = sizeof(GpuVertex);
-  // Describe index data (32-bit unsigned int)
-  triangles.indexType = VK_INDEX_TYPE_UINT32;
+  triangles.vertexStride = (vertexFormat & VertexFormatCompact)
+                               ? sizeof(vec3)
+                               : sizeof(GpuVertex);
+  // Describe index data (32-bit or 16-bit unsigned int)
+  triangles.indexType = (vertexFormat & VertexFormatIndex16)
+                            ? VK_INDEX_TYPE_UINT16
+                            : VK_INDEX_TYPE_UINT32;
   triangles.indexData.deviceAddress = indexAddress;
   // Indicate identity transform by setting transformData to null device
   // pointer. triangles.transformData = {};
   triangles.maxVertex = meshAlloc.getVerticesNum();
 
-  // Identify the above data as containing opaque triangles.
+  // Identify the above data as containing opaque or alpha tested triangles.
   VkAccelerationStructureGeometryKHR asGeom{
       VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR};
   asGeom.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-  asGeom.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+  asGeom.flags = opaque ? VK_GEOMETRY_OPAQUE_BIT_KHR : 0;
   asGeom.geometry.triangles = triangles;
 
   // The entire array will be used to build the BLAS.
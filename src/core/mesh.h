@@ -11,14 +11,22 @@
 #include <string>
 #include <vector>
 
+// Load an obj file, identical (position, uv, normal) tuples are merged into one
+// vertex when weld is set
 void loadMesh(const std::string& meshPath, vector<GpuVertex>& vertices,
-              vector<uint>& indices);
+              vector<uint>& indices, bool weld = true);
+
+// Merge identical (position, uv, normal) tuples and remap indices accordingly
+void weldVertices(vector<GpuVertex>& vertices, vector<uint>& indices);
 
 class Mesh {
 public:
   Mesh(Primitive& prim);
   Mesh(const std::string& meshPath, bool recomputeNormal = false,
        vec2 uvScale = {1.f, 1.f});
+  // Preprocessed mesh, e.g. restored from scene cache
+  Mesh(const GpuVertex* pVertices, uint numVertices, const uint* pIndices,
+       uint numIndices, vec3 posMin, vec3 posMax);
   uint getVerticesNum() { return m_vertices.size(); }
   uint getIndicesNum() { return m_indices.size(); }
   const vector<GpuVertex>& getVertices() { return m_vertices; }
@@ -35,23 +43,32 @@ private:
 
 class MeshAlloc : public GpuAlloc {
 public:
-  MeshAlloc(ContextAware* pContext, Mesh* pMesh, const VkCommandBuffer& cmdBuf);
+  // With compact set, the mesh is uploaded as a tightly packed position
+  // stream plus quantized attributes, see VertexFormat
+  MeshAlloc(ContextAware* pContext, Mesh* pMesh, const VkCommandBuffer& cmdBuf,
+            bool compact = false);
   void deinit(ContextAware* pContext);
   VkBuffer getIndicesBuffer() { return m_bIndices.buffer; }
   VkBuffer getVerticesBuffer() { return m_bVertices.buffer; }
+  VkBuffer getAttribsBuffer() { return m_bAttribs.buffer; }
   uint getIndicesNum() { return m_numIndices; }
   uint getVerticesNum() { return m_numVertices; }
+  uint getVertexFormat() { return m_vertexFormat; }
   const vec3& getPosMin() { return m_posMin; }
   const vec3& getPosMax() { return m_posMax; }
 
 private:
   uint m_numIndices{0};
   uint m_numVertices{0};
+  uint m_vertexFormat{VertexFormatFull};
   vec3 m_posMin{0, 0, 0};
   vec3 m_posMax{0, 0, 0};
   nvvk::Buffer m_bIndices;   // Device buffer of the indices forming triangles
-  nvvk::Buffer m_bVertices;  // Device buffer of all 'Vertex'
+  nvvk::Buffer m_bVertices;  // Device buffer of all 'Vertex' or positions
+  nvvk::Buffer m_bAttribs;   // Device buffer of 'GpuVertexAttrib', if compact
 };
 
+// Opaque geometry never invokes the any-hit shader
 nvvk::RaytracingBuilderKHR::BlasInput MeshBufferToBlas(VkDevice device,
-                                                       MeshAlloc& meshAlloc);
\ No newline at end of file
+                                                       MeshAlloc& meshAlloc,
+                                                       bool opaque);
\ No newline at end of file
@@ -11,6 +11,19 @@ public:
   bool outputHdr;
   bool outputRenderResult;
   std::vector<bool> channelOutputLdr;
+  // Upload meshes with quantized vertices, see VertexFormat
+  bool compactVertex;
+  // Upload textures block-compressed with precomputed mip chains, cached as
+  // KTX2 files next to the scene
+  bool compressTextures;
+  // Offline mode: accumulation launches recorded into one submission
+  int launchesPerSubmit;
+  // Target gpu time of one launch, samples per launch are tuned to meet it.
+  // Negative picks a default for the mode, zero traces 1 spp per launch.
+  float launchBudgetMs;
+  // Trace in wavefront kernels sorted by material instead of the ray
+  // tracing pipeline, falls back to it without ray queries
+  bool wavefront;
 
   State() {
     graphicsState.placeholder = 0;
@@ -32,6 +45,10 @@ public:
     // rewrite by Loader::submit()
     rtxState.envMapResolution = vec2(0.f);
     // rewrite by Loader::parse()
+    rtxState.envMapAliasTable = 0;
+    // rewrite by Loader::parse()
+    rtxState.restirDI = 0;
+    // rewrite by Loader::parse()
     rtxState.bgColor = vec3(0.f);
     // rewrite by Loader::parse()
     rtxState.nMultiChannel = 0;
@@ -60,5 +77,10 @@ public:
     outputHdr = false;
     outputRenderResult = true;
     channelOutputLdr.clear();
+    compactVertex = false;
+    compressTextures = false;
+    launchesPerSubmit = 16;
+    launchBudgetMs = -1.f;
+    wavefront = false;
   }
 };
\ No newline at end of file
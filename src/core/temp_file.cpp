@@ -0,0 +1,31 @@
+#include "temp_file.h"
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+std::string makeTempPath(const std::string& filePath) {
+  static std::atomic<unsigned> counter{0};
+  size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+  return filePath + "." + std::to_string(getpid()) + "." +
+         std::to_string(thread % 100000) + "." + std::to_string(counter++) +
+         ".tmp";
+}
+
+bool replaceWithTemp(const std::string& tmpPath, const std::string& filePath) {
+#ifdef _WIN32
+  // Renaming onto an existing file fails on windows
+  std::remove(filePath.c_str());
+#endif
+  if (std::rename(tmpPath.c_str(), filePath.c_str()) == 0) return true;
+  std::remove(tmpPath.c_str());
+  return false;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+// Cache files are written next to their final path and renamed over it, so
+// readers never see a truncated file. The sibling is named after the process
+// and thread, concurrent writers of the same file never share one.
+std::string makeTempPath(const std::string& filePath);
+
+// Move a fully written sibling over filePath, removes it on failure
+bool replaceWithTemp(const std::string& tmpPath, const std::string& filePath);
@@ -1,7 +1,9 @@
 #include "texture.h"
+#include "thread_pool.h"
 
 #include <ImfRgba.h>
 #include <ImfRgbaFile.h>
+#include <ImfThreading.h>
 #include <shared/binding.h>
 #include <filesystem/path.h>
 using namespace filesystem;
@@ -13,10 +15,22 @@ using namespace filesystem;
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+#include <mutex>
+#include <thread>
+
+// Let OpenEXR decode the lines of one file in parallel as well
+static void initExrThreading() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    Imf::setGlobalThreadCount(int(std::thread::hardware_concurrency()));
+  });
+}
+
 static float* readImageEXR(const std::string& name, int* width, int* height) {
   using namespace Imf;
   using namespace Imath;
   try {
+    initExrThreading();
     RgbaInputFile file(name.c_str());
     Box2i dw = file.dataWindow();
     Box2i dispw = file.displayWindow();
@@ -47,6 +61,33 @@ static float* readImageEXR(const std::string& name, int* width, int* height) {
   return NULL;
 }
 
+// Half floats straight from OpenEXR
+static void* readImageEXRHalf(const std::string& name, int* width,
+                              int* height) {
+  using namespace Imf;
+  using namespace Imath;
+  try {
+    initExrThreading();
+    RgbaInputFile file(name.c_str());
+    Box2i dw = file.dataWindow();
+    *width = dw.max.x - dw.min.x + 1;
+    *height = dw.max.y - dw.min.y + 1;
+
+    // Rgba is four halfs, the layout of VK_FORMAT_R16G16B16A16_SFLOAT
+    auto pixels =
+        reinterpret_cast<Rgba*>(malloc(sizeof(Rgba) * *width * *height));
+    file.setFrameBuffer(pixels - dw.min.x - dw.min.y * *width, 1, *width);
+    file.readPixels(dw.min.y, dw.max.y);
+    return pixels;
+  } catch (const std::exception& e) {
+    LOGE("[x] %-20s: failed to read image file %s: %s", "Scene Error",
+         name.c_str(), e.what());
+    exit(1);
+  }
+
+  return NULL;
+}
+
 static void writeImageEXR(const std::string& name, const float* pixels,
                           int xRes, int yRes, int totalXRes, int totalYRes,
                           int xOffset, int yOffset) {
@@ -82,23 +123,67 @@ Texture::Texture() {
 
 Texture::Texture(const std::string& texturePath, float gamma) {
   int32_t width, height;
-  m_data = readImage(texturePath, width, height, gamma);
-  m_format = VK_FORMAT_R32G32B32A32_SFLOAT;
+  m_data = readImageNative(texturePath, width, height, m_format, gamma);
   m_shape = {(uint32_t)width, (uint32_t)height};
 }
 
+Texture::Texture(void* data, VkExtent2D shape, VkFormat format,
+                 uint32_t mipLevels, bool ownData)
+    : m_ownData(ownData),
+      m_data(data),
+      m_shape(shape),
+      m_format(format),
+      m_mipLevels(mipLevels) {}
+
 Texture::~Texture() {
   m_shape = {0};
   m_format = VK_FORMAT_UNDEFINED;
-  if (m_data) {
+  if (m_data && m_ownData) {
     float* pixels = reinterpret_cast<float*>(m_data);
     stbi_image_free(pixels);
   }
 }
 
+VkDeviceSize Texture::getDataSize() {
+  VkDeviceSize size = 0;
+  for (uint32_t level = 0; level < m_mipLevels; level++)
+    size += getLevelSize(m_format, m_shape, level);
+  return size;
+}
+
+// Upload every mip level stored in the texture instead of generating them
+static nvvk::Image createImageLevels(nvvk::ResourceAllocator& alloc,
+                                     const VkCommandBuffer& cmdBuf,
+                                     Texture* pTexture,
+                                     const VkImageCreateInfo& imageCreateInfo) {
+  nvvk::Image image = alloc.createImage(imageCreateInfo);
+  VkImageSubresourceRange range{VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                                imageCreateInfo.mipLevels, 0, 1};
+  nvvk::cmdBarrierImageLayout(cmdBuf, image.image, VK_IMAGE_LAYOUT_UNDEFINED,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, range);
+  auto data = static_cast<const uint8_t*>(pTexture->getData());
+  VkExtent2D shape = pTexture->getSize();
+  for (uint32_t level = 0; level < imageCreateInfo.mipLevels; level++) {
+    VkExtent3D extent{std::max(shape.width >> level, 1u),
+                      std::max(shape.height >> level, 1u), 1};
+    VkImageSubresourceLayers subresource{VK_IMAGE_ASPECT_COLOR_BIT, level, 0,
+                                         1};
+    VkDeviceSize levelSize =
+        getLevelSize(pTexture->getFormat(), shape, level);
+    alloc.getStaging()->cmdToImage(cmdBuf, image.image, {0, 0, 0}, extent,
+                                   subresource, levelSize, data);
+    data += levelSize;
+  }
+  nvvk::cmdBarrierImageLayout(cmdBuf, image.image,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, range);
+  return image;
+}
+
 TextureAlloc::TextureAlloc(ContextAware* pContext, Texture* pTexture,
                            const VkCommandBuffer& cmdBuf) {
   auto& m_alloc = pContext->getAlloc();
+  MemCategoryScope memScope(MemCategoryTextures);
 
   VkSamplerCreateInfo samplerCreateInfo{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
   samplerCreateInfo.minFilter = VK_FILTER_LINEAR;
@@ -107,24 +192,30 @@ TextureAlloc::TextureAlloc(ContextAware* pContext, Texture* pTexture,
   samplerCreateInfo.maxLod = FLT_MAX;
 
   VkExtent2D imgSize = pTexture->getSize();
-  VkDeviceSize bufferSize = 0;
+  VkDeviceSize bufferSize = pTexture->getDataSize();
   VkFormat format = pTexture->getFormat();
-  if (format == VK_FORMAT_R32G32B32A32_SFLOAT) {
-    bufferSize = static_cast<uint64_t>(imgSize.width) * imgSize.height * 4 *
-                 sizeof(float);
-  } else {
-    bufferSize = static_cast<uint64_t>(imgSize.width) * imgSize.height * 4 *
-                 sizeof(uint8_t);
-  }
   auto imageCreateInfo = nvvk::makeImage2DCreateInfo(
       imgSize, format, VK_IMAGE_USAGE_SAMPLED_BIT, true);
   {
-    nvvk::Image image = m_alloc.createImage(
-        cmdBuf, bufferSize, pTexture->getData(), imageCreateInfo);
-    nvvk::cmdGenerateMipmaps(cmdBuf, image.image, format, imgSize,
-                             imageCreateInfo.mipLevels);
+    nvvk::Image image;
+    if (pTexture->getMipLevels() > 1 || isBlockCompressed(format)) {
+      // Precomputed mip chain, e.g. from a ktx2 file
+      imageCreateInfo.mipLevels = pTexture->getMipLevels();
+      image = createImageLevels(m_alloc, cmdBuf, pTexture, imageCreateInfo);
+    } else {
+      image = m_alloc.createImage(cmdBuf, bufferSize, pTexture->getData(),
+                                  imageCreateInfo);
+      nvvk::cmdGenerateMipmaps(cmdBuf, image.image, format, imgSize,
+                               imageCreateInfo.mipLevels);
+    }
     VkImageViewCreateInfo ivInfo =
         nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
+    // Single channel maps read as grey with opaque alpha, exactly like the
+    // rgba expansion they replace
+    if (format == VK_FORMAT_R8_UNORM || format == VK_FORMAT_R16_SFLOAT ||
+        format == VK_FORMAT_BC4_UNORM_BLOCK)
+      ivInfo.components = {VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R,
+                           VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_ONE};
     m_texture = m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
   }
 }
@@ -136,98 +227,150 @@ void TextureAlloc::deinit(ContextAware* pContext) {
 
 EnvMap::EnvMap() {
   m_data = (void*)malloc(1 * 1 * 4 * sizeof(float));
-  m_marginal = (void*)malloc(1 * 1 * 4 * sizeof(float));
-  m_conditional = (void*)malloc(1 * 1 * 4 * sizeof(float));
+  m_marginal = (void*)malloc(1 * 2 * sizeof(float));
+  m_conditional = (void*)malloc(1 * 1 * 2 * sizeof(float));
   m_shape = {(uint32_t)1, (uint32_t)1};
 }
 
+// Index of the first value of a sorted array not less than value, starting
+// the search at lower since the values looked up are increasing
+static uint32_t advanceBound(const float* array, uint32_t lower, uint32_t upper,
+                             float value) {
+  while (lower < upper && array[lower] < value) lower++;
+  return lower;
+}
+
 EnvMap::EnvMap(const std::string& envmapPath) {
   int32_t width, height;
   m_data = readImage(envmapPath, width, height);
   m_shape = {uint32_t(width), uint32_t(height)};
 
   // build acceleration lookup table for importance sampling
-  vector<float> pdf2D(width * height);
-  vector<float> cdf2D(width * height);
-  vector<float> pdf1D(height);
-  vector<float> cdf1D(height);
-
-  m_marginal = malloc(sizeof(nvmath::vec4f) * width * height);
-  m_conditional = malloc(sizeof(nvmath::vec4f) * width * height);
+  m_marginal = malloc(getMarginalSize());
+  m_conditional = malloc(getConditionalSize());
 
   auto pixel = static_cast<nvmath::vec4f*>(m_data);
-  auto marginal = static_cast<nvmath::vec4f*>(m_marginal);
-  auto conditional = static_cast<nvmath::vec4f*>(m_conditional);
+  auto marginal = static_cast<nvmath::vec2f*>(m_marginal);
+  auto conditional = static_cast<nvmath::vec2f*>(m_conditional);
 
-  float weightSum = 0.0f;
-  for (int j = 0; j < height; j++) {
-    float rowWeightSum = 0.0f;
-    for (int i = 0; i < width; i++) {
-      // luminance
-      auto& color = pixel[j * width + i];
-      float weight = 0.3 * color.x + 0.6 * color.y + 0.1 * color.z;
-      rowWeightSum += weight;
-      pdf2D[j * width + i] = weight;
-      cdf2D[j * width + i] = rowWeightSum;
-
-      conditional[j * width + i] = nvmath::vec4f(0.f);
-      marginal[j * width + i] = nvmath::vec4f(0.f);
-    }
-
-    // Convert to range [0,1]
-    for (int i = 0; i < width; i++) {
-      pdf2D[j * width + i] /= (rowWeightSum + 1e-7);
-      cdf2D[j * width + i] /= (rowWeightSum + 1e-7);
+  // Rows are independent, each one runs its own prefix sum and inverts it.
+  // Precalculate row and col to avoid binary search during lookup in the
+  // shader.
+  vector<float> rowWeights(height);
+  ThreadPool::get().parallelFor(height, 16, [&](size_t begin, size_t end) {
+    vector<float> cdf(width);
+    for (size_t j = begin; j < end; j++) {
+      nvmath::vec4f* row = pixel + j * width;
+      nvmath::vec2f* rowConditional = conditional + j * width;
+      float rowWeightSum = 0.0f;
+      for (int i = 0; i < width; i++) {
+        // luminance
+        auto& color = row[i];
+        float weight = 0.3 * color.x + 0.6 * color.y + 0.1 * color.z;
+        rowWeightSum += weight;
+        cdf[i] = rowWeightSum;
+        rowConditional[i].y = weight;
+      }
+
+      // Convert to range [0,1]
+      for (int i = 0; i < width; i++) {
+        rowConditional[i].y /= (rowWeightSum + 1e-7);
+        cdf[i] /= (rowWeightSum + 1e-7);
+      }
+
+      uint32_t col = 0;
+      for (int i = 0; i < width; i++) {
+        float invWidth = static_cast<float>(i + 1) / width;
+        col = advanceBound(cdf.data(), col, width, invWidth);
+        rowConditional[i].x = col / static_cast<float>(width);
+      }
+      rowWeights[j] = rowWeightSum;
     }
+  });
 
-    weightSum += rowWeightSum;
-
-    pdf1D[j] = rowWeightSum;
+  // The marginal has one entry per row only
+  vector<float> cdf1D(height);
+  float weightSum = 0.0f;
+  for (int j = 0; j < height; j++) {
+    weightSum += rowWeights[j];
     cdf1D[j] = weightSum;
   }
-
-  // Convert to range [0,1]
   for (int j = 0; j < height; j++) {
     cdf1D[j] /= (weightSum + 1e-7);
-    pdf1D[j] /= (weightSum + 1e-7);
+    marginal[j].y = rowWeights[j] / (weightSum + 1e-7);
   }
-
-  auto lowerBound = [=](const float* array, int lower, int upper,
-                        const float value) {
-    while (lower < upper) {
-      int mid = (lower + upper) / 2;
-      if (array[mid] < value)
-        lower = mid + 1;
-      else
-        upper = mid;
-    }
-    return lower;
-  };
-
-  // Precalculate row and col to avoid binary search during lookup in the
-  // shader
+  uint32_t row = 0;
   for (int j = 0; j < height; j++) {
     float invHeight = static_cast<float>(j + 1) / height;
-    float row = lowerBound(cdf1D.data(), 0, height, invHeight);
-    marginal[j * width].x = row / static_cast<float>(height);
-    marginal[j * width].y = pdf1D[j];
+    row = advanceBound(cdf1D.data(), row, height, invHeight);
+    marginal[j].x = row / static_cast<float>(height);
   }
+}
 
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      float invWidth = static_cast<float>(i + 1) / width;
-      float col =
-          lowerBound(cdf2D.data(), j * width, (j + 1) * width, invWidth) -
-          j * width;
-      conditional[j * width + i].x = col / static_cast<float>(width);
-      conditional[j * width + i].y = pdf2D[j * width + i];
+// Vose's alias method over n cells whose probabilities are read with a
+// stride of two floats
+static void buildAlias(const float* pdf, uint32_t n, GpuEnvAlias* table,
+                       vector<float>& scaled, vector<uint32_t>& small,
+                       vector<uint32_t>& large) {
+  double sum = 0.0;
+  for (uint32_t i = 0; i < n; i++) sum += pdf[2 * i];
+  scaled.resize(n);
+  small.clear();
+  large.clear();
+  for (uint32_t i = 0; i < n; i++) {
+    // Rows without any energy are never picked, keep them uniform
+    float p = sum > 0.0 ? float(pdf[2 * i] / sum) : 1.f / n;
+    table[i].pdf = p;
+    scaled[i] = p * n;
+    (scaled[i] < 1.f ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back(), l = large.back();
+    small.pop_back();
+    table[s].prob = scaled[s];
+    table[s].alias = l;
+    scaled[l] -= 1.f - scaled[s];
+    if (scaled[l] < 1.f) {
+      large.pop_back();
+      small.push_back(l);
     }
   }
+  // Leftovers are one up to rounding
+  for (uint32_t i : small) table[i].prob = 1.f, table[i].alias = i;
+  for (uint32_t i : large) table[i].prob = 1.f, table[i].alias = i;
+}
+
+vector<GpuEnvAlias> EnvMap::buildAliasTable() {
+  uint32_t width = m_shape.width, height = m_shape.height;
+  vector<GpuEnvAlias> table(height + uint64_t(width) * height);
+  auto marginal = static_cast<const float*>(m_marginal);
+  auto conditional = static_cast<const float*>(m_conditional);
+
+  ThreadPool::get().parallelFor(height, 16, [&](size_t begin, size_t end) {
+    vector<float> scaled;
+    vector<uint32_t> small, large;
+    for (size_t j = begin; j < end; j++)
+      buildAlias(conditional + 2 * j * width + 1, width,
+                 table.data() + height + j * width, scaled, small, large);
+  });
+  vector<float> scaled;
+  vector<uint32_t> small, large;
+  buildAlias(marginal + 1, height, table.data(), scaled, small, large);
+  return table;
 }
 
+EnvMap::EnvMap(void* data, void* marginal, void* conditional,
+               VkExtent2D shape)
+    : m_ownData(false),
+      m_data(data),
+      m_marginal(marginal),
+      m_conditional(conditional),
+      m_shape(shape) {}
+
 EnvMap::~EnvMap() {
   m_shape = {0};
-  if (m_data) {
+  if (m_pRadiance) delete m_pRadiance;
+  if (m_data && m_ownData) {
     float* pixels = reinterpret_cast<float*>(m_data);
     stbi_image_free(pixels);
     float* marginal = reinterpret_cast<float*>(m_marginal);
@@ -238,8 +381,9 @@ EnvMap::~EnvMap() {
 }
 
 EnvMapAlloc::EnvMapAlloc(ContextAware* pContext, EnvMap* pEnvmap,
-                         const VkCommandBuffer& cmdBuf) {
+                         const VkCommandBuffer& cmdBuf, bool useAliasTable) {
   auto& m_alloc = pContext->getAlloc();
+  MemCategoryScope memScope(MemCategoryTextures);
 
   VkSamplerCreateInfo samplerCreateInfo{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
   samplerCreateInfo.minFilter = VK_FILTER_LINEAR;
@@ -251,7 +395,16 @@ EnvMapAlloc::EnvMapAlloc(ContextAware* pContext, EnvMap* pEnvmap,
   VkExtent2D imgSize = pEnvmap->getSize();
   VkDeviceSize bufferSize =
       static_cast<uint64_t>(imgSize.width) * imgSize.height * 4 * sizeof(float);
-  {
+  if (Texture* pRadiance = pEnvmap->getRadiance()) {
+    auto imageCreateInfo = nvvk::makeImage2DCreateInfo(
+        imgSize, pRadiance->getFormat(), VK_IMAGE_USAGE_SAMPLED_BIT, true);
+    imageCreateInfo.mipLevels = pRadiance->getMipLevels();
+    nvvk::Image image =
+        createImageLevels(m_alloc, cmdBuf, pRadiance, imageCreateInfo);
+    VkImageViewCreateInfo ivInfo =
+        nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
+    m_data = m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
+  } else {
     auto imageCreateInfo = nvvk::makeImage2DCreateInfo(
         imgSize, format, VK_IMAGE_USAGE_SAMPLED_BIT, true);
     nvvk::Image image = m_alloc.createImage(
@@ -265,33 +418,41 @@ EnvMapAlloc::EnvMapAlloc(ContextAware* pContext, EnvMap* pEnvmap,
 
     m_data = texture;
   }
+
+  // Lookup tables have neither mips nor wrapping
+  VkSamplerCreateInfo tableSamplerInfo = samplerCreateInfo;
+  tableSamplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  tableSamplerInfo.maxLod = 0.f;
+  tableSamplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  tableSamplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  tableSamplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  VkFormat tableFormat = VK_FORMAT_R32G32_SFLOAT;
   {
     auto imageCreateInfo = nvvk::makeImage2DCreateInfo(
-        imgSize, format, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-    nvvk::Image image = m_alloc.createImage(
-        cmdBuf, bufferSize, pEnvmap->getConditional(), imageCreateInfo);
-    nvvk::cmdGenerateMipmaps(cmdBuf, image.image, format, imgSize,
-                             imageCreateInfo.mipLevels);
+        imgSize, tableFormat, VK_IMAGE_USAGE_SAMPLED_BIT);
+    nvvk::Image image =
+        m_alloc.createImage(cmdBuf, pEnvmap->getConditionalSize(),
+                            pEnvmap->getConditional(), imageCreateInfo);
     VkImageViewCreateInfo ivInfo =
         nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
-    nvvk::Texture texture =
-        m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
-
-    m_conditional = texture;
+    m_conditional = m_alloc.createTexture(image, ivInfo, tableSamplerInfo);
   }
   {
+    // A single column, one texel per row
     auto imageCreateInfo = nvvk::makeImage2DCreateInfo(
-        imgSize, format, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-    nvvk::Image image = m_alloc.createImage(
-        cmdBuf, bufferSize, pEnvmap->getMarginal(), imageCreateInfo);
-    nvvk::cmdGenerateMipmaps(cmdBuf, image.image, format, imgSize,
-                             imageCreateInfo.mipLevels);
+        {1, imgSize.height}, tableFormat, VK_IMAGE_USAGE_SAMPLED_BIT);
+    nvvk::Image image =
+        m_alloc.createImage(cmdBuf, pEnvmap->getMarginalSize(),
+                            pEnvmap->getMarginal(), imageCreateInfo);
     VkImageViewCreateInfo ivInfo =
         nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
-    nvvk::Texture texture =
-        m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
-
-    m_marginal = texture;
+    m_marginal = m_alloc.createTexture(image, ivInfo, tableSamplerInfo);
+  }
+  {
+    vector<GpuEnvAlias> aliasTable =
+        useAliasTable ? pEnvmap->buildAliasTable() : vector<GpuEnvAlias>(1);
+    m_bAliasTable = m_alloc.createBuffer(cmdBuf, aliasTable,
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
   }
 }
 
@@ -300,6 +461,7 @@ void EnvMapAlloc::deinit(ContextAware* pContext) {
   m_alloc.destroy(m_data);
   m_alloc.destroy(m_conditional);
   m_alloc.destroy(m_marginal);
+  m_alloc.destroy(m_bAliasTable);
   intoReleased();
 }
 
@@ -324,10 +486,25 @@ float* readImage(const std::string& imagePath, int& width, int& height,
     pixels = readImageEXR(imagePath, &width, &height);
   // 32bit image
   else {
-    stbi_ldr_to_hdr_gamma(gamma);
-    pixels = (void*)stbi_loadf(imagePath.c_str(), &width, &height, nullptr,
-                               STBI_rgb_alpha);
-    stbi_ldr_to_hdr_gamma(stbi__l2h_gamma);
+    // Convert with a lookup table instead of stbi_ldr_to_hdr_gamma(), whose
+    // gamma is global state shared by all loading threads
+    stbi_uc* ldr =
+        stbi_load(imagePath.c_str(), &width, &height, nullptr, STBI_rgb_alpha);
+    if (ldr) {
+      float lut[256];
+      for (int i = 0; i < 256; i++) lut[i] = powf(i / 255.f, gamma);
+      size_t numTexels = size_t(width) * height;
+      auto hdr = reinterpret_cast<float*>(
+          STBI_MALLOC(numTexels * 4 * sizeof(float)));
+      for (size_t i = 0; i < numTexels; i++) {
+        hdr[4 * i + 0] = lut[ldr[4 * i + 0]];
+        hdr[4 * i + 1] = lut[ldr[4 * i + 1]];
+        hdr[4 * i + 2] = lut[ldr[4 * i + 2]];
+        hdr[4 * i + 3] = ldr[4 * i + 3] / 255.f;
+      }
+      stbi_image_free(ldr);
+      pixels = hdr;
+    }
   }
   // Handle failure
   if (!pixels) {
@@ -355,11 +532,15 @@ void writeImage(const std::string& imagePath, int width, int height,
   else if (ext == "exr")
     writeImageEXR(imagePath, data, width, height, width, height, 0, 0);
   else {
-    stbi_hdr_to_ldr_gamma(1.0);
-    auto autoDestroyData = reinterpret_cast<float*>(
-        STBI_MALLOC(width * height * 4 * sizeof(float)));
-    memcpy(autoDestroyData, data, width * height * 4 * sizeof(float));
-    auto ldrData = stbi__hdr_to_ldr(autoDestroyData, width, height, 4);
+    // Quantize here instead of stbi__hdr_to_ldr(), whose gamma is global
+    // state and images are written from several threads
+    size_t numValues = size_t(width) * height * 4;
+    std::vector<stbi_uc> ldr(numValues);
+    for (size_t i = 0; i < numValues; i++) {
+      float v = data[i] * 255.f + 0.5f;
+      ldr[i] = stbi_uc(v < 0.f ? 0.f : (v > 255.f ? 255.f : v));
+    }
+    auto ldrData = ldr.data();
     if (ext == "jpg")
       stbi_write_jpg(imagePath.c_str(), width, height, 4, ldrData, 0);
     else if (ext == "png")
@@ -368,6 +549,142 @@ void writeImage(const std::string& imagePath, int width, int height,
       stbi_write_tga(imagePath.c_str(), width, height, 4, ldrData);
     else if (ext == "bmp")
       stbi_write_bmp(imagePath.c_str(), width, height, 4, ldrData);
-    stbi_hdr_to_ldr_gamma(stbi__h2l_gamma_i);
   }
 }
+
+VkDeviceSize getTexelSize(VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_R8_UNORM:
+      return 1;
+    case VK_FORMAT_R16_SFLOAT:
+      return 2;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+      return 4;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+      return 8;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+      return 16;
+    default:
+      LOG_ERROR("{}: unsupported texture format {}", "Scene", int(format));
+      exit(1);
+  }
+  return 0;
+}
+
+bool isBlockCompressed(VkFormat format) {
+  return format >= VK_FORMAT_BC1_RGB_UNORM_BLOCK &&
+         format <= VK_FORMAT_BC7_SRGB_BLOCK;
+}
+
+VkDeviceSize getLevelSize(VkFormat format, VkExtent2D shape, uint32_t level) {
+  uint64_t width = std::max(shape.width >> level, 1u);
+  uint64_t height = std::max(shape.height >> level, 1u);
+  if (isBlockCompressed(format)) {
+    width = (width + 3) / 4;
+    height = (height + 3) / 4;
+  }
+  return width * height * getTexelSize(format);
+}
+
+void* readImageNative(const std::string& imagePath, int& width, int& height,
+                      VkFormat& format, float gamma) {
+  static std::set<std::string> supportExtensions = {"hdr", "exr", "jpg", "png"};
+  std::string ext = path(imagePath).extension();
+  if (!supportExtensions.count(ext)) {
+    LOG_ERROR(
+        "{}: textures only support extensions (hdr exr jpg png) "
+        "while [{}] "
+        "is passed in",
+        "Scene", ext);
+    exit(1);
+  }
+  const char* filename = imagePath.c_str();
+  // Gamma 2.2 content is left to the hardware srgb decoder
+  bool linear = (gamma == 1.f);
+  bool srgb = (fabsf(gamma - 2.2f) < 1e-3f);
+  void* pixels = nullptr;
+
+  if (ext == "exr") {
+    format = VK_FORMAT_R16G16B16A16_SFLOAT;
+    return readImageEXRHalf(imagePath, &width, &height);
+  }
+
+  int channels = 0;
+  stbi_info(filename, &width, &height, &channels);
+  bool grey = (channels == 1);
+  size_t numTexels = size_t(width) * height;
+
+  if (ext == "hdr") {
+    // Radiance files only store rgb, halfs keep their range
+    float* hdr = stbi_loadf(filename, &width, &height, nullptr, STBI_rgb_alpha);
+    if (hdr) {
+      numTexels = size_t(width) * height;
+      auto half4 =
+          reinterpret_cast<half*>(STBI_MALLOC(numTexels * 4 * sizeof(half)));
+      for (size_t i = 0; i < 4 * numTexels; i++) half4[i] = half(hdr[i]);
+      stbi_image_free(hdr);
+      pixels = half4;
+    }
+    format = VK_FORMAT_R16G16B16A16_SFLOAT;
+  } else if (stbi_is_16_bit(filename) || (grey && !linear)) {
+    // 16 bit sources, and grey maps that need a gamma curve, are kept as
+    // halfs
+    int comp = grey ? 1 : 4;
+    stbi_us* ldr16 = stbi_load_16(filename, &width, &height, nullptr, comp);
+    if (ldr16) {
+      numTexels = size_t(width) * height;
+      auto out =
+          reinterpret_cast<half*>(STBI_MALLOC(numTexels * comp * sizeof(half)));
+      for (size_t i = 0; i < numTexels * comp; i++) {
+        float v = ldr16[i] / 65535.f;
+        // Alpha is always linear
+        bool alpha = (comp == 4 && i % 4 == 3);
+        out[i] = half(alpha ? v : powf(v, gamma));
+      }
+      stbi_image_free(ldr16);
+      pixels = out;
+    }
+    format = grey ? VK_FORMAT_R16_SFLOAT : VK_FORMAT_R16G16B16A16_SFLOAT;
+  } else if (grey) {
+    pixels = stbi_load(filename, &width, &height, nullptr, STBI_grey);
+    format = VK_FORMAT_R8_UNORM;
+  } else if (linear || srgb) {
+    pixels = stbi_load(filename, &width, &height, nullptr, STBI_rgb_alpha);
+    format = srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+  } else {
+    // Other gamma curves are applied here, halfs keep the dark end precise
+    stbi_uc* ldr =
+        stbi_load(filename, &width, &height, nullptr, STBI_rgb_alpha);
+    if (ldr) {
+      half lut[256];
+      for (int i = 0; i < 256; i++) lut[i] = half(powf(i / 255.f, gamma));
+      numTexels = size_t(width) * height;
+      auto out =
+          reinterpret_cast<half*>(STBI_MALLOC(numTexels * 4 * sizeof(half)));
+      for (size_t i = 0; i < numTexels; i++) {
+        out[4 * i + 0] = lut[ldr[4 * i + 0]];
+        out[4 * i + 1] = lut[ldr[4 * i + 1]];
+        out[4 * i + 2] = lut[ldr[4 * i + 2]];
+        out[4 * i + 3] = half(ldr[4 * i + 3] / 255.f);
+      }
+      stbi_image_free(ldr);
+      pixels = out;
+    }
+    format = VK_FORMAT_R16G16B16A16_SFLOAT;
+  }
+
+  // Handle failure
+  if (!pixels) {
+    LOGE("[x] %-20s: failed to load %s", "Scene Error", imagePath.c_str());
+    exit(1);
+  }
+  return pixels;
+}
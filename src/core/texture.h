@@ -4,10 +4,21 @@
 #include <nvvk/images_vk.hpp>
 #include <nvvk/resourceallocator_vk.hpp>
 #include <context/context.h>
+#include <shared/envmap.h>
 #include "alloc.h"
 
 float* readImage(const std::string& imagePath, int& width, int& height,
                  float gamma = 1.0);
+// Decode an image keeping its precision and channel count, the returned
+// texels are laid out in the returned format
+void* readImageNative(const std::string& imagePath, int& width, int& height,
+                      VkFormat& format, float gamma = 1.0);
+// Size in bytes of one texel of the formats used by textures, or of one 4x4
+// block for block-compressed formats
+VkDeviceSize getTexelSize(VkFormat format);
+bool isBlockCompressed(VkFormat format);
+// Size in bytes of one mip level of an image
+VkDeviceSize getLevelSize(VkFormat format, VkExtent2D shape, uint32_t level);
 void writeImage(const std::string& imagePath, int width, int height,
                 float* data);
 
@@ -16,15 +27,24 @@ public:
   // Add default texture (size of 1x1) when no texture exists in scene
   Texture();
   Texture(const std::string& texturePath, float gamma = 1.0);
+  // Wrap texels, e.g. from scene cache. With more than one mip level the
+  // levels follow each other from the largest one on.
+  Texture(void* data, VkExtent2D shape, VkFormat format,
+          uint32_t mipLevels = 1, bool ownData = false);
   ~Texture();
   VkExtent2D getSize() { return m_shape; }
   VkFormat getFormat() { return m_format; }
+  uint32_t getMipLevels() { return m_mipLevels; }
   void* getData() { return m_data; }
+  // Size of all mip levels
+  VkDeviceSize getDataSize();
 
 private:
+  bool m_ownData{true};
   void* m_data{nullptr};
   VkExtent2D m_shape{0};
   VkFormat m_format{VK_FORMAT_UNDEFINED};
+  uint32_t m_mipLevels{1};
 };
 
 class TextureAlloc : public GpuAlloc {
@@ -43,31 +63,51 @@ public:
   // Add default texture (size of 1x1) when no envmap exists in scene
   EnvMap();
   EnvMap(const std::string& envmapPath);
+  // Wrap prebuilt sampling tables without taking ownership
+  EnvMap(void* data, void* marginal, void* conditional, VkExtent2D shape);
   ~EnvMap();
   VkExtent2D getSize() { return m_shape; }
   VkFormat getFormat() { return VK_FORMAT_R32G32B32A32_SFLOAT; }
   void* getData() { return m_data; }
+  // Marginal: height texels, conditional: width * height texels. Both are
+  // rg32f holding the inverted cdf and the pdf.
+  VkDeviceSize getMarginalSize() { return sizeof(vec2) * m_shape.height; }
+  VkDeviceSize getConditionalSize() {
+    return sizeof(vec2) * uint64_t(m_shape.width) * m_shape.height;
+  }
+  // Alias tables built from the pdfs of the sampling tables
+  vector<GpuEnvAlias> buildAliasTable();
+  // Compressed radiance with its mip chain, uploaded instead of the rgba32f
+  // data when set. The envmap takes ownership.
+  void setRadiance(Texture* pRadiance) { m_pRadiance = pRadiance; }
+  Texture* getRadiance() { return m_pRadiance; }
   void* getMarginal() { return m_marginal; }
   void* getConditional() { return m_conditional; }
 
 private:
+  bool m_ownData{true};
   void* m_data{nullptr};         // rgba32f
-  void* m_marginal{nullptr};     // rgba32f
-  void* m_conditional{nullptr};  // rgba32f
+  void* m_marginal{nullptr};     // rg32f, one texel per row
+  void* m_conditional{nullptr};  // rg32f
+  Texture* m_pRadiance{nullptr};
   VkExtent2D m_shape{0};
 };
 
 class EnvMapAlloc : public GpuAlloc {
 public:
+  // The alias tables are only built with useAliasTable, otherwise a dummy
+  // buffer keeps the descriptor valid
   EnvMapAlloc(ContextAware* pContext, EnvMap* pEnvmap,
-              const VkCommandBuffer& cmdBuf);
+              const VkCommandBuffer& cmdBuf, bool useAliasTable = false);
   void deinit(ContextAware* pContext);
   VkDescriptorImageInfo getEnvMap() { return m_data.descriptor; }
   VkDescriptorImageInfo getMarginal() { return m_marginal.descriptor; }
   VkDescriptorImageInfo getConditional() { return m_conditional.descriptor; }
+  VkBuffer getAliasTable() { return m_bAliasTable.buffer; }
 
 private:
   nvvk::Texture m_data;
   nvvk::Texture m_marginal;
   nvvk::Texture m_conditional;
+  nvvk::Buffer m_bAliasTable;
 };
\ No newline at end of file
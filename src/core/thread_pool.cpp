@@ -0,0 +1,89 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool& ThreadPool::get() {
+  // Intentionally leaked: tasks report fatal errors with exit(), which must
+  // not end up joining the worker it was called from
+  static ThreadPool* pPool =
+      new ThreadPool(std::max(1u, std::thread::hardware_concurrency()));
+  return *pPool;
+}
+
+ThreadPool::ThreadPool(uint32_t numThreads) {
+  for (uint32_t i = 0; i < numThreads; i++)
+    m_workers.emplace_back([this] { workerLoop(); });
+}
+
+void ThreadPool::run(TaskGroup& group, std::function<void()> task) {
+  group.m_pending++;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks.push_back({std::move(task), &group});
+  }
+  m_taskAvailable.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+  while (!group.done()) {
+    if (tryRunOne()) continue;
+    // Nothing left to help with, sleep until some task finishes
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_taskFinished.wait(lock,
+                        [&] { return group.done() || !m_tasks.empty(); });
+  }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grainSize,
+                             const std::function<void(size_t, size_t)>& fn) {
+  if (count == 0) return;
+  size_t numChunks = std::min(count / std::max(grainSize, size_t(1)),
+                              size_t(4 * getThreadsNum()));
+  if (numChunks <= 1) {
+    fn(0, count);
+    return;
+  }
+  size_t chunkSize = (count + numChunks - 1) / numChunks;
+  TaskGroup group;
+  for (size_t begin = chunkSize; begin < count; begin += chunkSize) {
+    size_t end = std::min(begin + chunkSize, count);
+    run(group, [&fn, begin, end] { fn(begin, end); });
+  }
+  fn(0, chunkSize);
+  wait(group);
+}
+
+bool ThreadPool::tryRunOne() {
+  Task task;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_tasks.empty()) return false;
+    task = std::move(m_tasks.front());
+    m_tasks.pop_front();
+  }
+  execute(task);
+  return true;
+}
+
+void ThreadPool::execute(Task& task) {
+  task.fn();
+  {
+    // Decrement under the lock so that a waiter can not miss the wake up
+    std::lock_guard<std::mutex> lock(m_mutex);
+    task.pGroup->m_pending--;
+  }
+  m_taskFinished.notify_all();
+}
+
+void ThreadPool::workerLoop() {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_taskAvailable.wait(lock, [&] { return !m_tasks.empty(); });
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+    execute(task);
+  }
+}
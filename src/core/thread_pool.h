@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tracks completion of a batch of tasks submitted to the thread pool
+class TaskGroup {
+public:
+  bool done() { return m_pending.load() == 0; }
+
+private:
+  friend class ThreadPool;
+  std::atomic<int> m_pending{0};
+};
+
+// Process-wide pool of worker threads, one per hardware thread. Waiting on a
+// task group executes queued tasks on the calling thread, so tasks may submit
+// and wait on nested work (e.g. a mesh task running a parallel loop) without
+// starving the pool.
+class ThreadPool {
+public:
+  static ThreadPool& get();
+  uint32_t getThreadsNum() { return uint32_t(m_workers.size()); }
+
+  // Queue a task, it will be executed by any worker or a waiting thread
+  void run(TaskGroup& group, std::function<void()> task);
+
+  // Block until every task of the group has finished
+  void wait(TaskGroup& group);
+
+  // Split [0, count) into chunks of at least grainSize elements, call
+  // fn(begin, end) for every chunk in parallel and wait for them
+  void parallelFor(size_t count, size_t grainSize,
+                   const std::function<void(size_t, size_t)>& fn);
+
+private:
+  ThreadPool(uint32_t numThreads);
+  struct Task {
+    std::function<void()> fn;
+    TaskGroup* pGroup;
+  };
+  bool tryRunOne();
+  void execute(Task& task);
+  void workerLoop();
+
+private:
+  std::vector<std::thread> m_workers;
+  std::deque<Task> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_taskAvailable;
+  std::condition_variable m_taskFinished;
+};
@@ -84,6 +84,7 @@ void Loader::loadSceneFromJson(std::string sceneFilePath,
 
   m_pScene = pScene;
   m_pScene->reset();
+  m_pScene->openCache(sceneFilePath + ".cache");
   parse(sceneFileJson);
   submit();
 }
@@ -160,6 +161,12 @@ static void parseState(const nlohmann::json& stateJson, State& pipelineState) {
       rtxState.bgColor = Json2Vec3(ptJson["background_color"]);
     if (ptJson.contains("envmap_intensity"))
       rtxState.envMapIntensity = ptJson["envmap_intensity"];
+    if (ptJson.contains("envmap_alias_table"))
+      rtxState.envMapAliasTable = ptJson["envmap_alias_table"] ? 1 : 0;
+    if (ptJson.contains("restir_di"))
+      rtxState.restirDI = ptJson["restir_di"] ? 1 : 0;
+    if (ptJson.contains("wavefront"))
+      pipelineState.wavefront = ptJson["wavefront"];
     if (ptJson.contains("multi_channel")) {
       auto& multiChannel = ptJson["multi_channel"];
       uint nMultiChannel = multiChannel.size();
@@ -231,6 +238,15 @@ static void parseState(const nlohmann::json& stateJson, State& pipelineState) {
     pipelineState.outputRenderResult = stateJson["output_render_result"];
   if (stateJson.contains("output_hdr"))
     pipelineState.outputHdr = stateJson["output_hdr"];
+  if (stateJson.contains("compact_vertex"))
+    pipelineState.compactVertex = stateJson["compact_vertex"];
+  if (stateJson.contains("compress_textures"))
+    pipelineState.compressTextures = stateJson["compress_textures"];
+  if (stateJson.contains("launch_budget_ms"))
+    pipelineState.launchBudgetMs = stateJson["launch_budget_ms"];
+  if (stateJson.contains("launches_per_submit"))
+    pipelineState.launchesPerSubmit =
+        std::max(1, int(stateJson["launches_per_submit"]));
 }
 
 void Loader::addState(const nlohmann::json& stateJson) {
@@ -279,6 +295,7 @@ void Loader::addLight(const nlohmann::json& lightJson) {
       0.0,                 // radius
       0.0,                 // area
       0,                   // double side
+      -1,                  // bvh leaf
   };
   light.radiance = Json2Vec3(lightJson["radiance"]);
   if (lightJson["type"] == "rect" || lightJson["type"] == "triangle") {
@@ -49,4 +49,53 @@ void PipelineAware::deinit() {
 void PipelineAware::bind(uint bindPoint, DescriptorSetWrapper* bindSet) {
   m_bindSetWrappers[bindPoint] = bindSet;
   m_bindSets[bindPoint] = bindSet->getDescriptorSet();
-}
\ No newline at end of file
+}
+
+SpecKey makeSpecKey(Scene* pScene) {
+  auto& pc = pScene->getPipelineState().rtxState;
+  SpecKey key{};
+  auto set = [&](uint id, uint32_t value) {
+    key[id - SpecConstantFirst] = value;
+  };
+  set(SpecConstantHasEnvMap, pc.hasEnvMap);
+  set(SpecConstantUseSunsky, pScene->getSunsky().in_use);
+  set(SpecConstantNumMultiChannel, pc.nMultiChannel);
+  // Channel indices are ints, -1 for no output
+  set(SpecConstantDiffuseOutChannel, uint32_t(pc.diffuseOutChannel));
+  set(SpecConstantSpecularOutChannel, uint32_t(pc.specularOutChannel));
+  set(SpecConstantRoughnessOutChannel, uint32_t(pc.roughnessOutChannel));
+  set(SpecConstantNormalOutChannel, uint32_t(pc.normalOutChannel));
+  set(SpecConstantPositionOutChannel, uint32_t(pc.positionOutChannel));
+  set(SpecConstantTangentOutChannel, uint32_t(pc.tangentOutChannel));
+  set(SpecConstantUvOutChannel, uint32_t(pc.uvOutChannel));
+  set(SpecConstantUseFaceNormal, pc.useFaceNormal);
+  set(SpecConstantCameraType, pScene->getCameraType());
+  return key;
+}
+
+std::string specKeyString(const SpecKey& key) {
+  static const array<const char*, SpecConstantNum> names = {
+      "envmap", "sunsky",   "channels", "diffuse", "specular",   "roughness",
+      "normal", "position", "tangent",  "uv",      "faceNormal", "camera",
+  };
+  std::string str;
+  for (uint i = 0; i < SpecConstantNum; i++) {
+    // Channels without output are left out
+    int value = int(key[i]);
+    uint id = SpecConstantFirst + i;
+    if (id >= SpecConstantDiffuseOutChannel &&
+        id <= SpecConstantUvOutChannel && value < 0)
+      continue;
+    if (!str.empty()) str += " ";
+    str += std::string(names[i]) + "=" + std::to_string(value);
+  }
+  return str;
+}
+
+void appendSpecEntries(vector<VkSpecializationMapEntry>& entries,
+                       uint32_t offset) {
+  for (uint i = 0; i < SpecConstantNum; i++)
+    entries.push_back({SpecConstantFirst + i,
+                       offset + i * uint32_t(sizeof(uint32_t)),
+                       sizeof(uint32_t)});
+}
@@ -2,8 +2,10 @@
 
 #include <context/context.h>
 #include <scene/scene.h>
+#include <shared/specialization.h>
 #include <nvvk/descriptorsets_vk.hpp>
 #include <array>
+#include <string>
 
 class DescriptorSetWrapper {
 public:
@@ -22,6 +24,15 @@ private:
   nvvk::DescriptorSetBindings m_dstBind{};
 };
 
+// Values of the SpecConstant ids, from SpecConstantFirst on, the integrator
+// shaders are built with. Pipeline variants are cached by them.
+using SpecKey = array<uint32_t, SpecConstantNum>;
+SpecKey makeSpecKey(Scene* pScene);
+std::string specKeyString(const SpecKey& key);  // For the logs
+// Map entries of a key placed at offset of the specialization data
+void appendSpecEntries(vector<VkSpecializationMapEntry>& entries,
+                       uint32_t offset = 0);
+
 // All it needs to create a pipeline
 class PipelineAware {
 public:
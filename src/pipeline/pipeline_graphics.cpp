@@ -1,6 +1,7 @@
 #include "pipeline_graphics.h"
 #include <shared/camera.h>
 #include <shared/pushconstant.h>
+#include <shared/restir.h>
 #include <shared/vertex.h>
 
 #include <nvh/fileoperations.hpp>
@@ -12,6 +13,7 @@
 #include "nvvk/renderpasses_vk.hpp"
 
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
 void PipelineGraphics::init(ContextAware* pContext, Scene* pScene) {
@@ -23,6 +25,7 @@ void PipelineGraphics::init(ContextAware* pContext, Scene* pScene) {
   createOffscreenResources();
   createGraphicsDescriptorSetLayout();
   createCameraBuffer();
+  createSunskyBake();
   updateGraphicsDescriptorSet();
 }
 
@@ -38,7 +41,15 @@ void PipelineGraphics::deinit() {
 
   for (auto& m_tColor : m_tColors) m_alloc.destroy(m_tColor);
   m_alloc.destroy(m_tDepth);
+  for (auto& bReservoirs : m_bReservoirs) m_alloc.destroy(bReservoirs);
   m_alloc.destroy(m_bCamera);
+  for (auto& tSunsky : m_tSunsky) m_alloc.destroy(tSunsky);
+  vkDestroyPipeline(m_device, m_sunskyBakePipeline, nullptr);
+  vkDestroyPipelineLayout(m_device, m_sunskyBakeLayout, nullptr);
+  m_sunskyBakePipeline = VK_NULL_HANDLE;
+  m_sunskyBakeLayout = VK_NULL_HANDLE;
+  m_sunskyBakeSet.deinit(m_pContext);
+  m_sunskyBaked = false;
   vkDestroyRenderPass(m_device, m_offscreenRenderPass, nullptr);
   vkDestroyFramebuffer(m_device, m_offscreenFramebuffer, nullptr);
   m_offscreenRenderPass = VK_NULL_HANDLE;
@@ -62,10 +73,12 @@ void PipelineGraphics::updateCameraBuffer(const VkCommandBuffer& cmdBuf) {
   // UBO on the device, and what stages access it.
   VkBuffer deviceUBO = m_bCamera.buffer;
   auto uboUsageStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
-                        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+                        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
 
-  if (!m_pContext->getOfflineMode()) {
-    // Ensure that the modified UBO is not visible to previous frames.
+  // Ensure that the modified UBO is not visible to previous frames, offline
+  // mode records the next shot while the previous one may still run
+  {
     VkBufferMemoryBarrier beforeBarrier{
         VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
     beforeBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -83,8 +96,8 @@ void PipelineGraphics::updateCameraBuffer(const VkCommandBuffer& cmdBuf) {
   vkCmdUpdateBuffer(cmdBuf, m_bCamera.buffer, 0, sizeof(GpuCamera),
                     &hostCamera);
 
-  if (!m_pContext->getOfflineMode()) {
-    // Making sure the updated UBO will be visible.
+  // Making sure the updated UBO will be visible
+  {
     VkBufferMemoryBarrier afterBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
     afterBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
     afterBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -98,12 +111,80 @@ void PipelineGraphics::updateCameraBuffer(const VkCommandBuffer& cmdBuf) {
 }
 
 void PipelineGraphics::updateSunAndSky(const VkCommandBuffer& cmdBuf) {
+  // Upload and bake only when the parameters changed
+  auto& sunAndSky = m_pScene->getSunsky();
+  if (m_sunskyBaked &&
+      memcmp(&sunAndSky, &m_bakedSunAndSky, sizeof(GpuSunAndSky)) == 0)
+    return;
+
+  // Same hazards as the camera buffer
+  VkMemoryBarrier beforeBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  beforeBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  beforeBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuf,
+                       VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &beforeBarrier, 0,
+                       nullptr, 0, nullptr);
+
   vkCmdUpdateBuffer(cmdBuf, m_pScene->getSunskyDescriptor(), 0,
-                    sizeof(GpuSunAndSky), &m_pScene->getSunsky());
+                    sizeof(GpuSunAndSky), &sunAndSky);
+
+  VkMemoryBarrier afterBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  afterBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  afterBarrier.dstAccessMask = VK_ACCESS_UNIFORM_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 1, &afterBarrier, 0, nullptr, 0, nullptr);
+
+  // The maps are only sampled while the sun and sky is in use
+  if (sunAndSky.in_use == 1) bakeSunAndSky(cmdBuf);
+  m_bakedSunAndSky = sunAndSky;
+  m_sunskyBaked = true;
+}
+
+void PipelineGraphics::bakeSunAndSky(const VkCommandBuffer& cmdBuf) {
+  // Previous frames may still read the maps
+  VkMemoryBarrier beforeBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  beforeBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  beforeBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuf,
+                       VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                       &beforeBarrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    m_sunskyBakePipeline);
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          m_sunskyBakeLayout, 0, 1,
+                          &m_sunskyBakeSet.getDescriptorSet(), 0, nullptr);
+
+  // Every stage reads what the previous one wrote
+  auto dispatch = [&](uint stage, uint groupsX, uint groupsY) {
+    vkCmdPushConstants(cmdBuf, m_sunskyBakeLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(uint), &stage);
+    vkCmdDispatch(cmdBuf, groupsX, groupsY, 1);
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                             VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+  };
+  // 16x16 texels per group, then 256 rows per group
+  dispatch(SunskyBakeRadiance, (SUNSKY_BAKE_WIDTH + 15) / 16,
+           (SUNSKY_BAKE_HEIGHT + 15) / 16);
+  dispatch(SunskyBakeRows, (SUNSKY_BAKE_HEIGHT + 255) / 256, 1);
+  dispatch(SunskyBakeMarginal, 1, 1);
 }
 
 void PipelineGraphics::createOffscreenResources() {
   auto& m_alloc = m_pContext->getAlloc();
+  MemCategoryScope memScope(MemCategoryFilm);
   auto& m_debug = m_pContext->getDebug();
   auto m_device = m_pContext->getDevice();
   auto m_physicalDevice = m_pContext->getPhysicalDevice();
@@ -113,6 +194,7 @@ void PipelineGraphics::createOffscreenResources() {
   for (auto& m_tColor : m_tColors) m_alloc.destroy(m_tColor);
   m_tColors.clear();
   m_alloc.destroy(m_tDepth);
+  for (auto& bReservoirs : m_bReservoirs) m_alloc.destroy(bReservoirs);
   vkDestroyRenderPass(m_device, m_offscreenRenderPass, nullptr);
   vkDestroyFramebuffer(m_device, m_offscreenFramebuffer, nullptr);
   m_offscreenRenderPass = VK_NULL_HANDLE;
@@ -155,6 +237,20 @@ void PipelineGraphics::createOffscreenResources() {
     m_tDepth = m_alloc.createTexture(image, depthStencilView);
   }
 
+  // Creating the reservoirs, a placeholder one if ReSTIR DI is off
+  {
+    bool restirDI = m_pScene->getPipelineState().rtxState.restirDI == 1;
+    VkDeviceSize numReservoirs =
+        restirDI ? VkDeviceSize(m_size.width) * m_size.height : 1;
+    for (auto& bReservoirs : m_bReservoirs) {
+      bReservoirs =
+          m_alloc.createBuffer(numReservoirs * sizeof(GpuReservoir),
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      NAME2_VK(bReservoirs.buffer, "Reservoirs");
+    }
+  }
+
   // Setting the image layout for both color and depth
   {
     auto& qGCT1 = m_pContext->getParallelQueues()[0];
@@ -195,6 +291,106 @@ void PipelineGraphics::createOffscreenResources() {
   NAME2_VK(m_offscreenFramebuffer, "Offscreen FrameBuffer");
 }
 
+void PipelineGraphics::createSunskyBake() {
+  auto& m_alloc = m_pContext->getAlloc();
+  MemCategoryScope memScope(MemCategoryTextures);
+  auto& m_debug = m_pContext->getDebug();
+  auto m_device = m_pContext->getDevice();
+
+  // Same layout and samplers as the envmap and its tables
+  VkSamplerCreateInfo samplerCreateInfo{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+  samplerCreateInfo.minFilter = VK_FILTER_LINEAR;
+  samplerCreateInfo.magFilter = VK_FILTER_LINEAR;
+  samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerCreateInfo.maxLod = 0.f;
+  VkSamplerCreateInfo tableSamplerInfo = samplerCreateInfo;
+  tableSamplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  tableSamplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  tableSamplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+
+  VkExtent2D mapSize{SUNSKY_BAKE_WIDTH, SUNSKY_BAKE_HEIGHT};
+  array<VkExtent2D, 3> sizes{mapSize, VkExtent2D{1, mapSize.height}, mapSize};
+  array<VkFormat, 3> formats{VK_FORMAT_R32G32B32A32_SFLOAT,
+                             VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32_SFLOAT};
+  for (uint mapId = 0; mapId < 3; mapId++) {
+    auto imageCreateInfo = nvvk::makeImage2DCreateInfo(
+        sizes[mapId], formats[mapId],
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+    nvvk::Image image = m_alloc.createImage(imageCreateInfo);
+    VkImageViewCreateInfo ivInfo =
+        nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
+    m_tSunsky[mapId] = m_alloc.createTexture(
+        image, ivInfo, mapId == 0 ? samplerCreateInfo : tableSamplerInfo);
+    m_tSunsky[mapId].descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  }
+  m_debug.setObjectName(m_tSunsky[0].image, "Sunsky Radiance");
+  {
+    auto& qGCT1 = m_pContext->getParallelQueues()[0];
+    nvvk::CommandPool cmdBufGet(m_pContext->getDevice(), qGCT1.familyIndex,
+                                VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                                qGCT1.queue);
+    auto cmdBuf = cmdBufGet.createCommandBuffer();
+    for (auto& tSunsky : m_tSunsky)
+      nvvk::cmdBarrierImageLayout(cmdBuf, tSunsky.image,
+                                  VK_IMAGE_LAYOUT_UNDEFINED,
+                                  VK_IMAGE_LAYOUT_GENERAL);
+    cmdBufGet.submitAndWait(cmdBuf);
+  }
+
+  // Descriptor set of the bake
+  auto& bakeBind = m_sunskyBakeSet.getDescriptorSetBindings();
+  auto& bakePool = m_sunskyBakeSet.getDescriptorPool();
+  auto& bakeSet = m_sunskyBakeSet.getDescriptorSet();
+  auto& bakeLayout = m_sunskyBakeSet.getDescriptorSetLayout();
+  bakeBind.addBinding(SunskyBakeBindings::SunskyBakeParams,
+                      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
+                      VK_SHADER_STAGE_COMPUTE_BIT);
+  for (uint mapId = 0; mapId < 3; mapId++)
+    bakeBind.addBinding(SunskyBakeBindings::SunskyBakeMaps + mapId,
+                        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+                        VK_SHADER_STAGE_COMPUTE_BIT);
+  bakeLayout = bakeBind.createLayout(m_device);
+  bakePool = bakeBind.createPool(m_device, 1);
+  bakeSet = nvvk::allocateDescriptorSet(m_device, bakePool, bakeLayout);
+
+  vector<VkWriteDescriptorSet> writes;
+  VkDescriptorBufferInfo dbiSunAndSky{m_pScene->getSunskyDescriptor(), 0,
+                                      VK_WHOLE_SIZE};
+  writes.emplace_back(bakeBind.makeWrite(
+      bakeSet, SunskyBakeBindings::SunskyBakeParams, &dbiSunAndSky));
+  for (uint mapId = 0; mapId < 3; mapId++)
+    writes.emplace_back(
+        bakeBind.makeWrite(bakeSet, SunskyBakeBindings::SunskyBakeMaps + mapId,
+                           &m_tSunsky[mapId].descriptor));
+  vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()),
+                         writes.data(), 0, nullptr);
+
+  // Compute pipeline, the stage is pushed per dispatch
+  VkPushConstantRange pushConstantRange{VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                        sizeof(uint)};
+  VkPipelineLayoutCreateInfo layoutInfo{
+      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  layoutInfo.setLayoutCount = 1;
+  layoutInfo.pSetLayouts = &bakeLayout;
+  layoutInfo.pushConstantRangeCount = 1;
+  layoutInfo.pPushConstantRanges = &pushConstantRange;
+  vkCreatePipelineLayout(m_device, &layoutInfo, nullptr, &m_sunskyBakeLayout);
+
+  VkPipelineShaderStageCreateInfo stageInfo{
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
+  stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  stageInfo.module = nvvk::createShaderModule(
+      m_device, m_pContext->loadShader("shaders/env.sunsky.comp.spv"));
+  stageInfo.pName = "main";
+  VkComputePipelineCreateInfo compInfo{
+      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+  compInfo.layout = m_sunskyBakeLayout;
+  compInfo.stage = stageInfo;
+  vkCreateComputePipelines(m_device, m_pContext->getPipelineCache(), 1,
+                           &compInfo, nullptr, &m_sunskyBakePipeline);
+  vkDestroyShaderModule(m_device, stageInfo.module, nullptr);
+}
+
 void PipelineGraphics::createGraphicsDescriptorSetLayout() {
   auto m_device = m_pContext->getDevice();
 
@@ -208,11 +404,20 @@ void PipelineGraphics::createGraphicsDescriptorSetLayout() {
   outBind.addBinding(OutputBindings::OutputStore,
                      VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, NUM_OUTPUT_IMAGES,
                      VK_SHADER_STAGE_ALL);
+  // ReSTIR DI reservoirs
+  outBind.addBinding(OutputBindings::OutputReservoirs,
+                     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, VK_SHADER_STAGE_ALL);
   // Creation
   outLayout = outBind.createLayout(m_device);
   outPool = outBind.createPool(m_device, 1);
   outSet = nvvk::allocateDescriptorSet(m_device, outPool, outLayout);
 
+  // Closest hit shaders also run as wavefront shading kernels, the alpha
+  // test reads instances, materials and textures during traversal
+  const VkShaderStageFlags hitStages = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR |
+                                       VK_SHADER_STAGE_ANY_HIT_BIT_KHR |
+                                       VK_SHADER_STAGE_COMPUTE_BIT;
+
   // Scene Set: S_SCENE
   auto& sceneWrap = m_holdSetWrappers[uint(HoldSet::Scene)];
   auto& sceneBind = sceneWrap.getDescriptorSetBindings();
@@ -223,21 +428,29 @@ void PipelineGraphics::createGraphicsDescriptorSetLayout() {
   sceneBind.addBinding(
       SceneBindings::SceneCamera, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
       VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR |
-          VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR);
+          hitStages | VK_SHADER_STAGE_MISS_BIT_KHR);
   // Instance description
   sceneBind.addBinding(
       SceneBindings::SceneInstances, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
-      VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT |
-          VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+      VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT | hitStages);
   // Textures
   sceneBind.addBinding(
       SceneBindings::SceneTextures, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
       m_pScene->getTexturesNum(),
-      VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+      VK_SHADER_STAGE_FRAGMENT_BIT | hitStages);
   // Lights
   sceneBind.addBinding(
       SceneBindings::SceneLights, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
-      VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+      VK_SHADER_STAGE_FRAGMENT_BIT | hitStages);
+  // Emitter table
+  sceneBind.addBinding(SceneBindings::SceneEmitters,
+                       VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, hitStages);
+  // Material table
+  sceneBind.addBinding(SceneBindings::SceneMaterials,
+                       VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, hitStages);
+  // Light bvh
+  sceneBind.addBinding(SceneBindings::SceneLightBvh,
+                       VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, hitStages);
   // Creation
   sceneLayout = sceneBind.createLayout(m_device);
   scenePool = sceneBind.createPool(m_device, 1);
@@ -252,13 +465,19 @@ void PipelineGraphics::createGraphicsDescriptorSetLayout() {
   // SunAndSky
   envBind.addBinding(
       EnvBindings::EnvSunsky, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
-      VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR |
-          VK_SHADER_STAGE_MISS_BIT_KHR);
+      VK_SHADER_STAGE_FRAGMENT_BIT | hitStages | VK_SHADER_STAGE_MISS_BIT_KHR);
   // Envmap Acceleration
   envBind.addBinding(
       EnvBindings::EnvAccelMap, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3,
-      VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR |
-          VK_SHADER_STAGE_MISS_BIT_KHR);
+      VK_SHADER_STAGE_FRAGMENT_BIT | hitStages | VK_SHADER_STAGE_MISS_BIT_KHR);
+  // Envmap alias tables
+  envBind.addBinding(
+      EnvBindings::EnvAliasTable, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+      VK_SHADER_STAGE_FRAGMENT_BIT | hitStages | VK_SHADER_STAGE_MISS_BIT_KHR);
+  // Baked SunAndSky with its sampling tables
+  envBind.addBinding(
+      EnvBindings::EnvSunskyMap, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3,
+      VK_SHADER_STAGE_FRAGMENT_BIT | hitStages | VK_SHADER_STAGE_MISS_BIT_KHR);
   // Creation
   envLayout = envBind.createLayout(m_device);
   envPool = envBind.createPool(m_device, 1);
@@ -307,6 +526,21 @@ void PipelineGraphics::updateGraphicsDescriptorSet() {
                                       VK_WHOLE_SIZE};
   writesScene.emplace_back(
       sceneBind.makeWrite(sceneSet, SceneBindings::SceneLights, &emittersInfo));
+  // Emitter table
+  VkDescriptorBufferInfo emitterTableInfo{m_pScene->getEmittersDescriptor(), 0,
+                                          VK_WHOLE_SIZE};
+  writesScene.emplace_back(sceneBind.makeWrite(
+      sceneSet, SceneBindings::SceneEmitters, &emitterTableInfo));
+  // Material table
+  VkDescriptorBufferInfo materialsInfo{m_pScene->getMaterialsDescriptor(), 0,
+                                       VK_WHOLE_SIZE};
+  writesScene.emplace_back(sceneBind.makeWrite(
+      sceneSet, SceneBindings::SceneMaterials, &materialsInfo));
+  // Light bvh
+  VkDescriptorBufferInfo lightBvhInfo{m_pScene->getLightBvhDescriptor(), 0,
+                                      VK_WHOLE_SIZE};
+  writesScene.emplace_back(sceneBind.makeWrite(
+      sceneSet, SceneBindings::SceneLightBvh, &lightBvhInfo));
   // Writing the information
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writesScene.size()),
                          writesScene.data(), 0, nullptr);
@@ -325,6 +559,15 @@ void PipelineGraphics::updateGraphicsDescriptorSet() {
   auto envmapDescInfos = m_pScene->getEnvMapDescriptor();
   writesEnv.emplace_back(envBind.makeWriteArray(
       envSet, EnvBindings::EnvAccelMap, envmapDescInfos.data()));
+  VkDescriptorBufferInfo dbiAliasTable{m_pScene->getEnvMapAliasDescriptor(),
+                                       0, VK_WHOLE_SIZE};
+  writesEnv.emplace_back(envBind.makeWrite(
+      envSet, EnvBindings::EnvAliasTable, &dbiAliasTable));
+  array<VkDescriptorImageInfo, 3> sunskyInfos{};
+  for (uint mapId = 0; mapId < 3; mapId++)
+    sunskyInfos[mapId] = m_tSunsky[mapId].descriptor;
+  writesEnv.emplace_back(envBind.makeWriteArray(
+      envSet, EnvBindings::EnvSunskyMap, sunskyInfos.data()));
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writesEnv.size()),
                          writesEnv.data(), 0, nullptr);
 
@@ -343,6 +586,12 @@ void PipelineGraphics::updateGraphicsDescriptorSet() {
   }
   writesOut.push_back(outBind.makeWriteArray(
       outSet, OutputBindings::OutputStore, imageInfos.data()));
+  array<VkDescriptorBufferInfo, 2> reservoirInfos{};
+  for (uint bufferId = 0; bufferId < 2; bufferId++)
+    reservoirInfos[bufferId] = {m_bReservoirs[bufferId].buffer, 0,
+                                VK_WHOLE_SIZE};
+  writesOut.push_back(outBind.makeWriteArray(
+      outSet, OutputBindings::OutputReservoirs, reservoirInfos.data()));
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writesOut.size()),
                          writesOut.data(), 0, nullptr);
 }
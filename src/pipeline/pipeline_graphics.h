@@ -46,6 +46,17 @@ private:
   VkRenderPass m_offscreenRenderPass{VK_NULL_HANDLE};
   VkFramebuffer m_offscreenFramebuffer{VK_NULL_HANDLE};
   nvvk::Buffer m_bCamera;
+  // ReSTIR DI reservoirs, frames alternate between writing one and reading
+  // the other
+  array<nvvk::Buffer, 2> m_bReservoirs{};
+  // Sun and sky baked into an envmap with its sampling tables whenever its
+  // parameters change
+  array<nvvk::Texture, 3> m_tSunsky{};  // radiance, marginal, conditional
+  DescriptorSetWrapper m_sunskyBakeSet{};
+  VkPipelineLayout m_sunskyBakeLayout{VK_NULL_HANDLE};
+  VkPipeline m_sunskyBakePipeline{VK_NULL_HANDLE};
+  GpuSunAndSky m_bakedSunAndSky{};
+  bool m_sunskyBaked{false};
 
 private:
   void createOffscreenResources();  // Creating an offscreen frame buffer and
@@ -56,4 +67,7 @@ private:
                               // matrices
   void updateGraphicsDescriptorSet();  // Setting up the buffers in the
                                        // descriptor set
+  void createSunskyBake();  // Creating the baked sun and sky maps and the
+                            // compute pipeline filling them
+  void bakeSunAndSky(const VkCommandBuffer& cmdBuf);
 };
\ No newline at end of file
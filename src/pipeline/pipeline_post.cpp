@@ -93,18 +93,17 @@ void PipelinePost::createPostPipeline() {
   vkCreatePipelineLayout(m_device, &createInfo, nullptr, &m_pipelineLayout);
 
   // Pipeline: completely generic, no vertices
-  auto& root = m_pContext->getRoot();
   nvvk::GraphicsPipelineGeneratorCombined pipelineGenerator(
       m_device, m_pipelineLayout, m_pContext->getRenderPass());
   pipelineGenerator.addShader(
-      nvh::loadFile("../shaders/post.idle.vert.spv", true, {root}),
+      m_pContext->loadShader("shaders/post.idle.vert.spv"),
       VK_SHADER_STAGE_VERTEX_BIT);
   pipelineGenerator.addShader(
-      nvh::loadFile("../shaders/post.idle.frag.spv", true, {root}),
+      m_pContext->loadShader("shaders/post.idle.frag.spv"),
       VK_SHADER_STAGE_FRAGMENT_BIT);
   pipelineGenerator.rasterizationState.cullMode = VK_CULL_MODE_NONE;
 
-  m_pipeline = pipelineGenerator.createPipeline();
+  m_pipeline = pipelineGenerator.createPipeline(m_pContext->getPipelineCache());
   NAME2_VK(m_pipeline, "Post");
 }
 
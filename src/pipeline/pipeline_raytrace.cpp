@@ -4,6 +4,27 @@
 #include <nvvk/buffers_vk.hpp>
 #include "nvvk/shaders_vk.hpp"
 
+#include <algorithm>
+
+// Upper bound of the samples per launch controller
+static const int maxSppPerLaunch = 256;
+
+// Closest hit shaders, by material type
+static const array<const char*, MaterialTypeNum> hitShaderFiles = {
+    "shaders/raytrace.brdf_lambertian.rchit.spv",
+    "shaders/raytrace.brdf_kang18.rchit.spv",
+    "shaders/raytrace.brdf_emissive.rchit.spv",
+    "shaders/raytrace.brdf_pbr_metalness_roughness.rchit.spv",
+    "shaders/raytrace.brdf_plastic.rchit.spv",
+    "shaders/raytrace.brdf_rough_plastic.rchit.spv",
+    "shaders/raytrace.brdf_conductor.rchit.spv",
+    "shaders/raytrace.brdf_rough_conductor.rchit.spv",
+    "shaders/raytrace.brdf_mirror.rchit.spv",
+    "shaders/raytrace.brdf_disney.rchit.spv",
+    "shaders/raytrace.bsdf_dielectric.rchit.spv",
+    "shaders/raytrace.brdf_phong.rchit.spv",
+};
+
 void PipelineRaytrace::init(ContextAware* pContext, Scene* pScene,
                             PipelineRaytraceInitSetting& pis) {
   LOG_INFO("{}: creating raytrace pipeline", "Pipeline");
@@ -11,6 +32,7 @@ void PipelineRaytrace::init(ContextAware* pContext, Scene* pScene,
   m_pScene = pScene;
   // Ray tracing
   initRayTracing();
+  collectHitGroups();
   createBottomLevelAS();
   createTopLevelAS();
   createRtDescriptorSetLayout();
@@ -20,6 +42,14 @@ void PipelineRaytrace::init(ContextAware* pContext, Scene* pScene,
   bind(RtBindSet::RtScene, pis.pDswScene);
   createRtPipeline();
   updateRtDescriptorSet();
+  createTimestampQueries();
+  initWavefront(pis);
+
+  // Interactive launches must stay well below the driver watchdog
+  float budget = m_pScene->getPipelineState().launchBudgetMs;
+  if (budget < 0.f) budget = m_pContext->getOfflineMode() ? 200.f : 50.f;
+  m_launchBudgetMs = budget;
+  m_sppPerLaunch = 1;
 }
 
 void PipelineRaytrace::deinit() {
@@ -28,7 +58,20 @@ void PipelineRaytrace::deinit() {
   // m_pushconstant = {0};
 
   m_rtBuilder.destroy();
-  m_sbt.destroy();
+  auto m_device = m_pContext->getDevice();
+  for (auto& keyVariant : m_variants) {
+    vkDestroyPipeline(m_device, keyVariant.second.pipeline, nullptr);
+    keyVariant.second.sbt.destroy();
+  }
+  m_variants.clear();
+  for (auto& s : m_stages) vkDestroyShaderModule(m_device, s.module, nullptr);
+  m_stages.clear();
+  m_shaderGroups.clear();
+  vkDestroyQueryPool(m_device, m_timestampPool, nullptr);
+  m_timestampPool = VK_NULL_HANDLE;
+  m_querySpp.fill(0);
+  if (m_hasWavefront) m_wavefront.deinit();
+  m_hasWavefront = m_useWavefront = false;
 
   PipelineAware::deinit();
 }
@@ -48,29 +91,151 @@ void PipelineRaytrace::run(const VkCommandBuffer& cmdBuf) {
     refCamMatrix = m;
     refFov = fov;
   }
-  incrementFrame();
+  runBatch(cmdBuf, 1);
+}
 
+int PipelineRaytrace::runBatch(const VkCommandBuffer& cmdBuf, int numLaunches,
+                               int maxSpp) {
+  // The slot was last used FRAMES_IN_FLIGHT submissions ago
+  updateSppPerLaunch();
+  uint32_t firstQuery = 2 * m_querySlot;
+  vkCmdResetQueryPool(cmdBuf, m_timestampPool, firstQuery, 2);
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                      m_timestampPool, firstQuery);
+
+  int traced = 0;
+  if (m_hasWavefront && m_useWavefront) {
+    // Earlier launches of the ray tracing pipeline may still write the
+    // output
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier,
+                         0, nullptr, 0, nullptr);
+    // One sample per frame, the queues hold a single path per pixel. Queue
+    // sizes and kernel times come from the first sample of the batch.
+    for (int i = 0; i < numLaunches && traced < maxSpp; i++) {
+      int spp = std::min(m_sppPerLaunch, maxSpp - traced);
+      for (int s = 0; s < spp; s++) {
+        setSpp(1);
+        incrementFrame();
+        m_wavefront.run(cmdBuf, i == 0 && s == 0);
+      }
+      traced += spp;
+    }
+  } else {
+    traced = traceRays(cmdBuf, numLaunches, maxSpp);
+  }
+
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      m_timestampPool, firstQuery + 1);
+  m_querySpp[m_querySlot] = traced;
+  m_querySlot = (m_querySlot + 1) % FRAMES_IN_FLIGHT;
+  return traced;
+}
+
+// Launches of the ray tracing pipeline, see runBatch
+int PipelineRaytrace::traceRays(const VkCommandBuffer& cmdBuf, int numLaunches,
+                                int maxSpp) {
   // Do ray tracing
-  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_pipeline);
+  Variant& variant = getVariant();
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+                    variant.pipeline);
   vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
                           m_pipelineLayout, 0, (uint32_t)m_bindSets.size(),
                           m_bindSets.data(), 0, nullptr);
-  vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_ALL, 0,
-                     sizeof(GpuPushConstantRaytrace),
-                     &(m_pScene->getPipelineState().rtxState));
 
-  const auto& regions = m_sbt.getRegions();
+  const auto& regions = variant.sbt.getRegions();
   auto size = m_pContext->getSize();
 
-  // Run the ray tracing pipeline and trace rays
-  vkCmdTraceRaysKHR(cmdBuf,       // Command buffer
-                    &regions[0],  // Region of memory with ray generation groups
-                    &regions[1],  // Region of memory with miss groups
-                    &regions[2],  // Region of memory with hit groups
-                    &regions[3],  // Region of memory with callable groups
-                    size.width,   // Width of dispatch
-                    size.height,  // Height of dispatch
-                    1);           // Depth of dispatch
+  int traced = 0;
+  for (int i = 0; i < numLaunches && traced < maxSpp; i++) {
+    // Each launch accumulates into the output images and reservoirs of the
+    // previous one, which may be the last of a batch still in flight
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1,
+                         &barrier, 0, nullptr, 0, nullptr);
+    // Never trace more than requested, so spp totals are met exactly
+    int spp = std::min(m_sppPerLaunch, maxSpp - traced);
+    setSpp(spp);
+    traced += spp;
+    incrementFrame();
+    vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_ALL, 0,
+                       sizeof(GpuPushConstantRaytrace),
+                       &(m_pScene->getPipelineState().rtxState));
+
+    // Run the ray tracing pipeline and trace rays
+    vkCmdTraceRaysKHR(
+        cmdBuf,       // Command buffer
+        &regions[0],  // Region of memory with ray generation groups
+        &regions[1],  // Region of memory with miss groups
+        &regions[2],  // Region of memory with hit groups
+        &regions[3],  // Region of memory with callable groups
+        size.width,   // Width of dispatch
+        size.height,  // Height of dispatch
+        1);           // Depth of dispatch
+  }
+  return traced;
+}
+
+void PipelineRaytrace::initWavefront(PipelineRaytraceInitSetting& pis) {
+  if (!m_pScene->getPipelineState().wavefront) return;
+  if (!m_pContext->hasRayQuery()) {
+    LOG_WARN("{}: wavefront mode needs ray queries, use ray tracing pipeline",
+             "Pipeline");
+    return;
+  }
+  PipelineWavefrontInitSetting wis;
+  wis.pDswAccel = &m_holdSetWrappers[uint(HoldSet::Accel)];
+  wis.pDswOut = pis.pDswOut;
+  wis.pDswScene = pis.pDswScene;
+  wis.pDswEnv = pis.pDswEnv;
+  wis.hitGroupTypes = m_hitGroupTypes;
+  m_wavefront.init(m_pContext, m_pScene, wis);
+  m_hasWavefront = m_useWavefront = true;
+}
+
+void PipelineRaytrace::createTimestampQueries() {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(m_pContext->getPhysicalDevice(), &props);
+  m_timestampPeriod = props.limits.timestampPeriod;
+
+  VkQueryPoolCreateInfo queryInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+  queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryInfo.queryCount = 2 * FRAMES_IN_FLIGHT;
+  vkCreateQueryPool(m_pContext->getDevice(), &queryInfo, nullptr,
+                    &m_timestampPool);
+  m_querySlot = 0;
+  m_querySpp.fill(0);
+}
+
+void PipelineRaytrace::updateSppPerLaunch() {
+  int spp = m_querySpp[m_querySlot];
+  m_querySpp[m_querySlot] = 0;
+  if (spp == 0 || m_launchBudgetMs <= 0.f) return;
+
+  // {timestamp, availability} for the begin and end query
+  uint64_t results[4];
+  VkResult res = vkGetQueryPoolResults(
+      m_pContext->getDevice(), m_timestampPool, 2 * m_querySlot, 2,
+      sizeof(results), results, 2 * sizeof(uint64_t),
+      VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  if (res != VK_SUCCESS || !results[1] || !results[3]) return;
+
+  // Samples fitting in the budget, changing by 2x at most per measurement
+  // to ride out noisy timings
+  double batchMs = double(results[2] - results[0]) * m_timestampPeriod * 1e-6;
+  double msPerSample = std::max(batchMs / spp, 1e-4);
+  int lo = std::max(1, m_sppPerLaunch / 2);
+  int hi = std::min(maxSppPerLaunch, 2 * m_sppPerLaunch);
+  int target = int(m_launchBudgetMs / msPerSample);
+  m_sppPerLaunch = std::max(lo, std::min(hi, target));
 }
 
 void PipelineRaytrace::setSpp(int spp) {
@@ -90,22 +255,40 @@ void PipelineRaytrace::initRayTracing() {
   auto m_device = m_pContext->getDevice();
   auto m_physicalDevice = m_pContext->getPhysicalDevice();
 
-  VkPhysicalDeviceRayTracingPipelinePropertiesKHR prop = {
-      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR};
-
-  // Requesting ray tracing properties
+  // Requesting ray tracing properties, the shader binding tables of the
+  // variants are laid out by them
   VkPhysicalDeviceProperties2 prop2 = nvvk::make<VkPhysicalDeviceProperties2>();
-  prop2.pNext = &prop;
+  prop2.pNext = &m_rtProperties;
   vkGetPhysicalDeviceProperties2(m_physicalDevice, &prop2);
 
   auto& qC = m_pContext->getParallelQueues()[1];
   m_rtBuilder.setup(m_device, &m_alloc, qC.familyIndex);
-  auto& qT = m_pContext->getParallelQueues()[2];
-  m_sbt.setup(m_device, qT.familyIndex, &m_alloc, prop);
+}
+
+void PipelineRaytrace::collectHitGroups() {
+  array<bool, MaterialTypeNum> used{};
+  auto& instances = m_pScene->getInstances();
+  for (auto& inst : instances) {
+    // Emitters are shaded as lambertian
+    bool isLight = (inst.getEmitterOffset() >= 0);
+    used[isLight ? MaterialTypeBrdfLambertian
+                 : m_pScene->getMaterialType(inst.getMaterialIndex())] = true;
+  }
+  m_hitGroupTypes.clear();
+  m_hitGroupOfType.fill(0);
+  for (uint materialTypeId = 0; materialTypeId < MaterialTypeNum;
+       materialTypeId++) {
+    if (!used[materialTypeId]) continue;
+    m_hitGroupOfType[materialTypeId] = uint32_t(m_hitGroupTypes.size());
+    m_hitGroupTypes.push_back(MaterialType(materialTypeId));
+  }
+  LOG_INFO("{}: {} of {} material types in use", "Pipeline",
+           m_hitGroupTypes.size(), uint(MaterialTypeNum));
 }
 
 void PipelineRaytrace::createBottomLevelAS() {
   auto m_device = m_pContext->getDevice();
+  MemCategoryScope memScope(MemCategoryAccel);
   // BLAS - Storing each primitive in a geometry
   m_blas.reserve(m_pScene->getMeshesNum());
   for (uint32_t meshId = 0; meshId < m_pScene->getMeshesNum(); meshId++) {
@@ -118,26 +301,27 @@ void PipelineRaytrace::createBottomLevelAS() {
 }
 
 void PipelineRaytrace::createTopLevelAS() {
+  MemCategoryScope memScope(MemCategoryAccel);
   m_tlas.reserve(m_pScene->getInstancesNum());
   auto& instances = m_pScene->getInstances();
   for (uint32_t instId = 0; instId < m_pScene->getInstancesNum(); instId++) {
     auto& inst = instances[instId];
     uint matId = inst.getMaterialIndex();
-    bool isLight = (inst.getLightIndex() >= 0);
+    bool isLight = (inst.getEmitterOffset() >= 0);
     VkAccelerationStructureInstanceKHR rayInst{};
     rayInst.transform = nvvk::toTransformMatrixKHR(inst.getTransform());
     rayInst.instanceCustomIndex = 0;  // gl_InstanceCustomIndexEXT
     rayInst.accelerationStructureReference =
         m_rtBuilder.getBlasDeviceAddress(inst.getMeshIndex());
     rayInst.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+    // A mesh may be alpha tested through another instance only
+    if (isLight || !m_pScene->isMaterialAlphaTested(matId))
+      rayInst.flags |= VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR;
     rayInst.mask = 0xFF;  // Only be hit if rayMask & instance.mask != 0
-    if (!isLight)
-      rayInst.instanceShaderBindingTableRecordOffset =
-          m_pScene->getMaterialType(
-              matId);  // material type determines closet hit shader
-    else
-      rayInst.instanceShaderBindingTableRecordOffset =
-          MaterialTypeBrdfLambertian;
+    // Material type determines closet hit shader, emitters are lambertian
+    MaterialType type = isLight ? MaterialTypeBrdfLambertian
+                                : m_pScene->getMaterialType(matId);
+    rayInst.instanceShaderBindingTableRecordOffset = m_hitGroupOfType[type];
     m_tlas.emplace_back(rayInst);
   }
 
@@ -169,124 +353,52 @@ void PipelineRaytrace::createRtPipeline() {
   auto m_device = m_pContext->getDevice();
 
   // Creating all shaders
-  enum StageIndices { RayGen, RayMiss, ShadowMiss, NumStages };
-  array<VkPipelineShaderStageCreateInfo, NumStages + MaterialTypeNum> stages{};
+  enum StageIndices { RayGen, RayMiss, ShadowMiss, AnyHit, NumStages };
+  auto& stages = m_stages;
+  stages.resize(NumStages + m_hitGroupTypes.size());
   // Raygen
-  auto root = m_pContext->getRoot();
   auto stage = nvvk::make<VkPipelineShaderStageCreateInfo>();
   stage.pName = "main";  // All the same entry point
   stage.module = nvvk::createShaderModule(
       m_device,
-      nvh::loadFile("../shaders/raytrace.projective.rgen.spv", true, {root}));
+      m_pContext->loadShader("shaders/raytrace.projective.rgen.spv"));
   stage.stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
   stages[RayGen] = stage;
   NAME2_VK(stage.module, "RayGen");
   // Miss
   stage.module = nvvk::createShaderModule(
       m_device,
-      nvh::loadFile("../shaders/raytrace.default.rmiss.spv", true, {root}));
+      m_pContext->loadShader("shaders/raytrace.default.rmiss.spv"));
   stage.stage = VK_SHADER_STAGE_MISS_BIT_KHR;
   stages[RayMiss] = stage;
   NAME2_VK(stage.module, "RayMiss");
   // Shadow miss
   stage.module = nvvk::createShaderModule(
       m_device,
-      nvh::loadFile("../shaders/raytrace.shadow.rmiss.spv", true, {root}));
+      m_pContext->loadShader("shaders/raytrace.shadow.rmiss.spv"));
   stage.stage = VK_SHADER_STAGE_MISS_BIT_KHR;
   stages[ShadowMiss] = stage;
   NAME2_VK(stage.module, "Shadowmiss");
-  // ClosetHit:BrdfLambertian
-  stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.brdf_lambertian.rchit.spv",
-                              true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfLambertian] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfLambertian");
-  // ClosetHit:BrdfEmissive
-  stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.brdf_emissive.rchit.spv",
-                              true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfEmissive] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfEmissive");
-  // ClosetHit:BrdfPbrMetalnessRoughness
-  stage.module = nvvk::createShaderModule(
-      m_device,
-      nvh::loadFile(
-          "../shaders/raytrace.brdf_pbr_metalness_roughness.rchit.spv", true,
-          {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfPbrMetalnessRoughness] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfPbrMetalnessRoughness");
-  // ClosetHit:BrdfKang18
-  stage.module = nvvk::createShaderModule(
-      m_device,
-      nvh::loadFile("../shaders/raytrace.brdf_kang18.rchit.spv", true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfKang18] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfKang18");
-  // ClosetHit:BrdfPlastic
-  stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.brdf_plastic.rchit.spv",
-                              true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfPlastic] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfPlastic");
-  // ClosetHit:BrdfRoughPlastic
-  stage.module = nvvk::createShaderModule(
-      m_device,
-      nvh::loadFile("../shaders/raytrace.brdf_rough_plastic.rchit.spv", true,
-                    {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfRoughPlastic] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfPlastic");
-  // ClosetHit:BrdfMirror
-  stage.module = nvvk::createShaderModule(
-      m_device,
-      nvh::loadFile("../shaders/raytrace.brdf_mirror.rchit.spv", true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfMirror] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfMirror");
-  // ClosetHit:BrdfConductor
-  stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.brdf_conductor.rchit.spv",
-                              true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfConductor] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfConductor");
-  // ClosetHit:BrdfRoughConductor
-  stage.module = nvvk::createShaderModule(
-      m_device,
-      nvh::loadFile("../shaders/raytrace.brdf_rough_conductor.rchit.spv", true,
-                    {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfRoughConductor] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfRoughConductor");
-  // ClosetHit:BrdfDisney
+  // Any hit: alpha test of non-opaque geometry
   stage.module = nvvk::createShaderModule(
       m_device,
-      nvh::loadFile("../shaders/raytrace.brdf_disney.rchit.spv", true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfDisney] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfDisney");
-  // ClosetHit:BsdfDielectric
-  stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.bsdf_dielectric.rchit.spv",
-                              true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBsdfDielectric] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BsdfDielectric");
-  // ClosetHit:BrdfPhong
-  stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.brdf_phong.rchit.spv",
-                              true, {root}));
-  stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-  stages[NumStages + MaterialTypeBrdfPhong] = stage;
-  NAME2_VK(stage.module, "ClosetHit:BrdfPhong");
+      m_pContext->loadShader("shaders/raytrace.alpha.rahit.spv"));
+  stage.stage = VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
+  stages[AnyHit] = stage;
+  NAME2_VK(stage.module, "AnyHit");
+  // Closest hits, by hit group
+  for (size_t group = 0; group < m_hitGroupTypes.size(); group++) {
+    const char* file = hitShaderFiles[m_hitGroupTypes[group]];
+    stage.module =
+        nvvk::createShaderModule(m_device, m_pContext->loadShader(file));
+    stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
+    stages[NumStages + group] = stage;
+    NAME2_VK(stage.module, file);
+  }
   // Shader groups
   VkRayTracingShaderGroupCreateInfoKHR group =
       nvvk::make<VkRayTracingShaderGroupCreateInfoKHR>();
-  std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups{};
+  auto& shaderGroups = m_shaderGroups;
 
   group.anyHitShader = VK_SHADER_UNUSED_KHR;
   group.closestHitShader = VK_SHADER_UNUSED_KHR;
@@ -308,12 +420,12 @@ void PipelineRaytrace::createRtPipeline() {
   group.generalShader = ShadowMiss;
   shaderGroups.push_back(group);
 
-  // closest hit shader
+  // closest hit shader, all sharing the alpha test
   group.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
   group.generalShader = VK_SHADER_UNUSED_KHR;
-  for (uint materialTypeId = 0; materialTypeId < MaterialTypeNum;
-       materialTypeId++) {
-    group.closestHitShader = NumStages + materialTypeId;
+  group.anyHitShader = AnyHit;
+  for (size_t hitGroup = 0; hitGroup < m_hitGroupTypes.size(); hitGroup++) {
+    group.closestHitShader = uint32_t(NumStages + hitGroup);
     shaderGroups.push_back(group);
   }
 
@@ -336,6 +448,31 @@ void PipelineRaytrace::createRtPipeline() {
   vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo, nullptr,
                          &m_pipelineLayout);
 
+  // Variant of the scene as loaded, the modules stay for later ones
+  getVariant();
+}
+
+PipelineRaytrace::Variant& PipelineRaytrace::getVariant() {
+  SpecKey key = makeSpecKey(m_pScene);
+  auto it = m_variants.find(key);
+  if (it != m_variants.end()) return it->second;
+
+  auto& m_alloc = m_pContext->getAlloc();
+  auto m_device = m_pContext->getDevice();
+  LOG_INFO("{}: building ray tracing variant [{}]", "Pipeline",
+           specKeyString(key));
+
+  // All stages get the same constants, those not declaring one ignore it
+  vector<VkSpecializationMapEntry> entries;
+  appendSpecEntries(entries);
+  VkSpecializationInfo specialization{};
+  specialization.mapEntryCount = static_cast<uint32_t>(entries.size());
+  specialization.pMapEntries = entries.data();
+  specialization.dataSize = sizeof(key);
+  specialization.pData = key.data();
+  vector<VkPipelineShaderStageCreateInfo> stages = m_stages;
+  for (auto& stage : stages) stage.pSpecializationInfo = &specialization;
+
   // Assemble the shader stages and recursion depth info into the ray tracing
   // pipeline
   VkRayTracingPipelineCreateInfoKHR rayPipelineInfo{
@@ -343,18 +480,20 @@ void PipelineRaytrace::createRtPipeline() {
   rayPipelineInfo.stageCount =
       static_cast<uint32_t>(stages.size());  // Stages are shaders
   rayPipelineInfo.pStages = stages.data();
-  rayPipelineInfo.groupCount = static_cast<uint32_t>(shaderGroups.size());
-  rayPipelineInfo.pGroups = shaderGroups.data();
+  rayPipelineInfo.groupCount = static_cast<uint32_t>(m_shaderGroups.size());
+  rayPipelineInfo.pGroups = m_shaderGroups.data();
   rayPipelineInfo.maxPipelineRayRecursionDepth = 4;  // Ray depth
   rayPipelineInfo.layout = m_pipelineLayout;
-  vkCreateRayTracingPipelinesKHR(m_device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1,
-                                 &rayPipelineInfo, nullptr, &m_pipeline);
+  Variant& variant = m_variants[key];
+  vkCreateRayTracingPipelinesKHR(m_device, VK_NULL_HANDLE,
+                                 m_pContext->getPipelineCache(), 1,
+                                 &rayPipelineInfo, nullptr, &variant.pipeline);
 
   // Creating the SBT
-  m_sbt.create(m_pipeline, rayPipelineInfo);
-
-  // Removing temp modules
-  for (auto& s : stages) vkDestroyShaderModule(m_device, s.module, nullptr);
+  auto& qT = m_pContext->getParallelQueues()[2];
+  variant.sbt.setup(m_device, qT.familyIndex, &m_alloc, m_rtProperties);
+  variant.sbt.create(variant.pipeline, rayPipelineInfo);
+  return variant;
 }
 
 void PipelineRaytrace::updateRtDescriptorSet() {
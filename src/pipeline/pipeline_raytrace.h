@@ -3,9 +3,13 @@
 #include <shared/pushconstant.h>
 #include "pipeline.h"
 #include "pipeline_graphics.h"
+#include "pipeline_wavefront.h"
 #include <nvvk/raytraceKHR_vk.hpp>
 #include <nvvk/sbtwrapper_vk.hpp>
 
+#include <climits>
+#include <map>
+
 struct PipelineRaytraceInitSetting {
   DescriptorSetWrapper* pDswOut = nullptr;
   DescriptorSetWrapper* pDswScene = nullptr;
@@ -23,29 +27,70 @@ public:
                     PipelineRaytraceInitSetting& pis);
   virtual void deinit();
   virtual void run(const VkCommandBuffer& cmdBuf);
+  // Record up to numLaunches accumulation launches tracing at most maxSpp
+  // samples in total, curFrame advances between them. Returns the number of
+  // samples per pixel recorded.
+  int runBatch(const VkCommandBuffer& cmdBuf, int numLaunches,
+               int maxSpp = INT_MAX);
   GpuPushConstantRaytrace& getPushconstant() {
     return m_pScene->getPipelineState().rtxState;
   }
   void setSpp(int spp = 1);
+  int getSppPerLaunch() { return m_sppPerLaunch; }
   void resetFrame();
   void incrementFrame();
   int getFrame() { return getPushconstant().curFrame; }
+  // Samples are traced by the wavefront kernels while this is set
+  bool hasWavefront() { return m_hasWavefront; }
+  bool& useWavefront() { return m_useWavefront; }
+  const WavefrontStats& getWavefrontStats() { return m_wavefront.getStats(); }
 
 private:
   void initRayTracing();       // Request ray tracing pipeline properties
+  void collectHitGroups();     // Material types the instances shade with
   void createBottomLevelAS();  // Create bottom level acceleration structures
   void createTopLevelAS();     // Create top level acceleration structures
   void createRtDescriptorSetLayout();  // Create descriptor sets
   void createRtPipeline();             // Create ray tracing pipeline
   void updateRtDescriptorSet();        // Update the descriptor pointer
+  void createTimestampQueries();
+  void updateSppPerLaunch();  // Tune samples per launch from timestamps
+  void initWavefront(PipelineRaytraceInitSetting& pis);
+  int traceRays(const VkCommandBuffer& cmdBuf, int numLaunches, int maxSpp);
+
+private:
+  // Ray tracing pipeline with its shading binding table, built per SpecKey
+  struct Variant {
+    VkPipeline pipeline{VK_NULL_HANDLE};
+    nvvk::SBTWrapper sbt;
+  };
+  Variant& getVariant();  // Of the current state, built on first use
 
 private:
-  // Shading binding table wrapper
-  nvvk::SBTWrapper m_sbt;
+  VkPhysicalDeviceRayTracingPipelinePropertiesKHR m_rtProperties{
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR};
+  // Shader stages and groups, kept to build the variants
+  vector<VkPipelineShaderStageCreateInfo> m_stages{};
+  vector<VkRayTracingShaderGroupCreateInfoKHR> m_shaderGroups{};
+  std::map<SpecKey, Variant> m_variants{};
+  // Only material types of the scene get a hit group, in type order
+  vector<MaterialType> m_hitGroupTypes{};
+  array<uint32_t, MaterialTypeNum> m_hitGroupOfType{};
   // Pipeline builder
   nvvk::RaytracingBuilderKHR m_rtBuilder;
   // Top level acceleration structures
   vector<VkAccelerationStructureInstanceKHR> m_tlas{};
   // Bottom level acceleration structures
   vector<nvvk::RaytracingBuilderKHR::BlasInput> m_blas{};
+  // Samples per launch controller, a pair of timestamps brackets every batch
+  VkQueryPool m_timestampPool{VK_NULL_HANDLE};
+  float m_timestampPeriod{1.f};  // nanoseconds per tick
+  uint32_t m_querySlot{0};
+  std::array<int, FRAMES_IN_FLIGHT> m_querySpp{};  // 0: slot not in flight
+  float m_launchBudgetMs{0.f};
+  int m_sppPerLaunch{1};
+  // Compute kernels sharing the acceleration structure and the output
+  PipelineWavefront m_wavefront;
+  bool m_hasWavefront{false};
+  bool m_useWavefront{false};
 };
\ No newline at end of file
@@ -0,0 +1,421 @@
+#include "pipeline_wavefront.h"
+#include <nvh/fileoperations.hpp>
+#include "nvvk/shaders_vk.hpp"
+
+#include <algorithm>
+#include <cstddef>
+
+// Timestamps recorded for a sample, kernels past it are not timed
+static const uint32_t maxQueriesPerSample = 512;
+// Depths whose queue sizes are read back
+static const uint32_t maxStatDepth = 64;
+
+// Closest hit shaders built as shading kernels, by hit group
+static const array<const char*, MaterialTypeNum> shadeKernelFiles = {
+    "shaders/wavefront/raytrace.brdf_lambertian.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_kang18.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_emissive.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_pbr_metalness_roughness.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_plastic.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_rough_plastic.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_conductor.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_rough_conductor.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_mirror.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_disney.rchit.spv",
+    "shaders/wavefront/raytrace.bsdf_dielectric.rchit.spv",
+    "shaders/wavefront/raytrace.brdf_phong.rchit.spv",
+};
+
+void PipelineWavefront::init(ContextAware* pContext, Scene* pScene,
+                             PipelineWavefrontInitSetting& pis) {
+  LOG_INFO("{}: creating wavefront pipeline", "Pipeline");
+  m_pContext = pContext;
+  m_pScene = pScene;
+  m_size = m_pContext->getSize();
+  m_hitGroupTypes = pis.hitGroupTypes;
+  createQueueBuffers();
+  createDescriptorSetLayout();
+  bind(RtBindSet::RtAccel, pis.pDswAccel);
+  bind(RtBindSet::RtOut, pis.pDswOut);
+  bind(RtBindSet::RtScene, pis.pDswScene);
+  bind(RtBindSet::RtEnv, pis.pDswEnv);
+  bind(WfBindSet::WfQueues, &m_holdSetWrappers[uint(HoldSet::Queues)]);
+  createPipelines();
+  updateDescriptorSet();
+  createStatQueries();
+}
+
+void PipelineWavefront::deinit() {
+  auto& m_alloc = m_pContext->getAlloc();
+  auto m_device = m_pContext->getDevice();
+
+  m_alloc.destroy(m_bCounters);
+  m_alloc.destroy(m_bPaths);
+  m_alloc.destroy(m_bHits);
+  m_alloc.destroy(m_bRayQueue);
+  m_alloc.destroy(m_bShadeQueue);
+  m_alloc.destroy(m_bShadowQueue);
+  m_alloc.unmap(m_bStats);
+  m_alloc.destroy(m_bStats);
+  m_pStats = nullptr;
+
+  for (auto& keyKernels : m_variants) {
+    auto& kernels = keyKernels.second;
+    for (auto& pipeline : kernels.stages)
+      vkDestroyPipeline(m_device, pipeline, nullptr);
+    for (auto& pipeline : kernels.schedules)
+      vkDestroyPipeline(m_device, pipeline, nullptr);
+    for (auto& pipeline : kernels.shades)
+      vkDestroyPipeline(m_device, pipeline, nullptr);
+  }
+  m_variants.clear();
+  vkDestroyShaderModule(m_device, m_integrator, nullptr);
+  m_integrator = VK_NULL_HANDLE;
+  for (auto& module : m_shadeModules)
+    vkDestroyShaderModule(m_device, module, nullptr);
+  m_shadeModules.clear();
+
+  vkDestroyQueryPool(m_device, m_timestampPool, nullptr);
+  m_timestampPool = VK_NULL_HANDLE;
+  for (auto& stages : m_queryStages) stages.clear();
+
+  PipelineAware::deinit();
+}
+
+void PipelineWavefront::run(const VkCommandBuffer& cmdBuf, bool gatherStats) {
+  auto& pc = m_pScene->getPipelineState().rtxState;
+  m_timing = gatherStats;
+  if (m_timing) {
+    // The slot was last used FRAMES_IN_FLIGHT timed samples ago
+    readStats();
+    uint32_t firstQuery = m_querySlot * maxQueriesPerSample;
+    vkCmdResetQueryPool(cmdBuf, m_timestampPool, firstQuery,
+                        maxQueriesPerSample);
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        m_timestampPool, firstQuery);
+    m_queryStages[m_querySlot].clear();
+    m_queryDepths[m_querySlot] = 0;
+  }
+
+  Kernels& kernels = getKernels();
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          m_pipelineLayout, 0, (uint32_t)m_bindSets.size(),
+                          m_bindSets.data(), 0, nullptr);
+  vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_ALL, 0,
+                     sizeof(GpuPushConstantRaytrace), &pc);
+
+  uint32_t pathGroups =
+      (m_size.width * m_size.height + WAVEFRONT_GROUP_SIZE - 1) /
+      WAVEFRONT_GROUP_SIZE;
+  VkDeviceSize intersectArgs = offsetof(GpuWavefrontCounters, intersectArgs);
+  VkDeviceSize shadeArgs = offsetof(GpuWavefrontCounters, shadeArgs);
+  VkDeviceSize shadowArgs = offsetof(GpuWavefrontCounters, shadowArgs);
+
+  dispatch(cmdBuf, kernels.stages[WavefrontStageGenerate],
+           WavefrontStageGenerate, pathGroups);
+  // Kernels of a finished path find empty queues, the depth is not read
+  // back to stop early
+  for (int depth = 1; depth <= pc.maxPathDepth; depth++) {
+    dispatch(cmdBuf, kernels.stages[WavefrontStageIntersect],
+             WavefrontStageIntersect, 0, intersectArgs);
+    dispatch(cmdBuf, kernels.schedules[WavefrontScheduleShade],
+             WavefrontStageSchedule, 1);
+    dispatch(cmdBuf, kernels.stages[WavefrontStageSort], WavefrontStageSort,
+             0, intersectArgs);
+    for (uint32_t group = 0; group < m_hitGroupTypes.size(); group++)
+      dispatch(cmdBuf, kernels.shades[group], WavefrontStageShade, 0,
+               shadeArgs + 3 * sizeof(uint32_t) * group);
+    dispatch(cmdBuf, kernels.schedules[WavefrontScheduleShadow],
+             WavefrontStageSchedule, 1);
+    if (m_timing) copyCounters(cmdBuf, depth - 1);
+    dispatch(cmdBuf, kernels.stages[WavefrontStageShadow],
+             WavefrontStageShadow, 0, shadowArgs);
+    dispatch(cmdBuf, kernels.schedules[WavefrontScheduleNext],
+             WavefrontStageSchedule, 1);
+  }
+  dispatch(cmdBuf, kernels.stages[WavefrontStageResolve],
+           WavefrontStageResolve, pathGroups);
+
+  // The rest of the frame waits for the ray tracing stage
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  VkPipelineStageFlags srcStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  VkPipelineStageFlags dstStages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+  if (m_timing) {
+    // Counters copied for the host
+    barrier.srcAccessMask |= VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask |= VK_ACCESS_HOST_READ_BIT;
+    srcStages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dstStages |= VK_PIPELINE_STAGE_HOST_BIT;
+    m_querySlot = (m_querySlot + 1) % FRAMES_IN_FLIGHT;
+  }
+  vkCmdPipelineBarrier(cmdBuf, srcStages, dstStages, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+}
+
+void PipelineWavefront::dispatch(const VkCommandBuffer& cmdBuf,
+                                 VkPipeline pipeline, WavefrontStage stage,
+                                 uint32_t numGroups, VkDeviceSize argsOffset) {
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  if (numGroups > 0)
+    vkCmdDispatch(cmdBuf, numGroups, 1, 1);
+  else
+    vkCmdDispatchIndirect(cmdBuf, m_bCounters.buffer, argsOffset);
+
+  // Every kernel reads the paths and queues the previous one wrote, the
+  // schedule kernels also write dispatch arguments
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                          VK_ACCESS_SHADER_WRITE_BIT |
+                          VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  auto& stages = m_queryStages[m_querySlot];
+  if (!m_timing || stages.size() + 1 >= maxQueriesPerSample) return;
+  stages.push_back(stage);
+  vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                      m_timestampPool,
+                      m_querySlot * maxQueriesPerSample + stages.size());
+}
+
+void PipelineWavefront::copyCounters(const VkCommandBuffer& cmdBuf,
+                                     uint32_t depth) {
+  if (depth >= maxStatDepth) return;
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0,
+                       nullptr, 0, nullptr);
+
+  VkBufferCopy region{};
+  region.size = sizeof(GpuWavefrontCounters);
+  region.dstOffset =
+      (m_querySlot * maxStatDepth + depth) * sizeof(GpuWavefrontCounters);
+  vkCmdCopyBuffer(cmdBuf, m_bCounters.buffer, m_bStats.buffer, 1, &region);
+  m_queryDepths[m_querySlot] = depth + 1;
+
+  // The next kernels update the counters again
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 0, nullptr);
+}
+
+void PipelineWavefront::readStats() {
+  auto& stages = m_queryStages[m_querySlot];
+  if (stages.empty()) return;
+
+  // {timestamp, availability} of every query
+  vector<uint64_t> results(2 * (stages.size() + 1));
+  VkResult res = vkGetQueryPoolResults(
+      m_pContext->getDevice(), m_timestampPool,
+      m_querySlot * maxQueriesPerSample, uint32_t(stages.size() + 1),
+      results.size() * sizeof(uint64_t), results.data(),
+      2 * sizeof(uint64_t),
+      VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  if (res != VK_SUCCESS || !results.back()) return;
+
+  m_stats.stageMs.fill(0.f);
+  for (size_t i = 0; i < stages.size(); i++) {
+    uint64_t ticks = results[2 * (i + 1)] - results[2 * i];
+    m_stats.stageMs[stages[i]] += float(ticks * m_timestampPeriod * 1e-6);
+  }
+
+  // Counters were copied before the one that wrote the last timestamp
+  uint32_t numDepths = m_queryDepths[m_querySlot];
+  const GpuWavefrontCounters* pCounters = m_pStats + m_querySlot * maxStatDepth;
+  m_stats.numHits.fill(0);
+  m_stats.numRays.resize(numDepths);
+  m_stats.numShadowRays.resize(numDepths);
+  for (uint32_t depth = 0; depth < numDepths; depth++) {
+    m_stats.numRays[depth] = pCounters[depth].numRays;
+    m_stats.numShadowRays[depth] = pCounters[depth].numShadowRays;
+    for (uint32_t group = 0; group < MaterialTypeNum; group++)
+      m_stats.numHits[group] += pCounters[depth].numHits[group];
+  }
+}
+
+void PipelineWavefront::createQueueBuffers() {
+  auto& m_alloc = m_pContext->getAlloc();
+  auto& m_debug = m_pContext->getDebug();
+  MemCategoryScope memScope(MemCategoryFilm);
+
+  // One path per pixel
+  VkDeviceSize numPaths = VkDeviceSize(m_size.width) * m_size.height;
+  VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  m_bCounters = m_alloc.createBuffer(
+      sizeof(GpuWavefrontCounters),
+      usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+          VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+  m_bPaths = m_alloc.createBuffer(numPaths * WAVEFRONT_PATH_SIZE, usage);
+  m_bHits = m_alloc.createBuffer(numPaths * sizeof(GpuWavefrontHit), usage);
+  m_bRayQueue = m_alloc.createBuffer(2 * numPaths * sizeof(uint32_t), usage);
+  m_bShadeQueue = m_alloc.createBuffer(numPaths * sizeof(uint32_t), usage);
+  m_bShadowQueue = m_alloc.createBuffer(numPaths * sizeof(uint32_t), usage);
+  m_debug.setObjectName(m_bCounters.buffer, "Wavefront counters");
+  m_debug.setObjectName(m_bPaths.buffer, "Wavefront paths");
+  m_debug.setObjectName(m_bHits.buffer, "Wavefront hits");
+  m_debug.setObjectName(m_bRayQueue.buffer, "Wavefront ray queue");
+  m_debug.setObjectName(m_bShadeQueue.buffer, "Wavefront shade queue");
+  m_debug.setObjectName(m_bShadowQueue.buffer, "Wavefront shadow queue");
+}
+
+void PipelineWavefront::createDescriptorSetLayout() {
+  auto m_device = m_pContext->getDevice();
+  auto& queuesDsw = m_holdSetWrappers[uint(HoldSet::Queues)];
+  auto& bind = queuesDsw.getDescriptorSetBindings();
+  auto& layout = queuesDsw.getDescriptorSetLayout();
+  auto& set = queuesDsw.getDescriptorSet();
+  auto& pool = queuesDsw.getDescriptorPool();
+
+  for (uint binding = WavefrontCounters; binding <= WavefrontShadowQueue;
+       binding++)
+    bind.addBinding(binding, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                    VK_SHADER_STAGE_COMPUTE_BIT);
+  pool = bind.createPool(m_device);
+  layout = bind.createLayout(m_device);
+  set = nvvk::allocateDescriptorSet(m_device, pool, layout);
+}
+
+void PipelineWavefront::createPipelines() {
+  auto& m_debug = m_pContext->getDebug();
+  auto m_device = m_pContext->getDevice();
+
+  // Push constant: the same as the ray tracing pipeline
+  VkPushConstantRange pushConstant{VK_SHADER_STAGE_ALL, 0,
+                                   sizeof(GpuPushConstantRaytrace)};
+
+  VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{
+      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+  pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstant;
+
+  array<VkDescriptorSetLayout, WfBindSet::WfNum> wfDescSetLayouts{};
+  for (uint setId = 0; setId < WfBindSet::WfNum; setId++)
+    wfDescSetLayouts[setId] =
+        m_bindSetWrappers[setId]->getDescriptorSetLayout();
+  pipelineLayoutCreateInfo.setLayoutCount =
+      static_cast<uint32_t>(wfDescSetLayouts.size());
+  pipelineLayoutCreateInfo.pSetLayouts = wfDescSetLayouts.data();
+  vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo, nullptr,
+                         &m_pipelineLayout);
+
+  m_integrator = nvvk::createShaderModule(
+      m_device,
+      m_pContext->loadShader("shaders/wavefront.integrator.comp.spv"));
+  NAME2_VK(m_integrator, "Wavefront:Integrator");
+  for (MaterialType type : m_hitGroupTypes) {
+    VkShaderModule shade = nvvk::createShaderModule(
+        m_device, m_pContext->loadShader(shadeKernelFiles[type]));
+    NAME2_VK(shade, "Wavefront:Shade");
+    m_shadeModules.push_back(shade);
+  }
+
+  // Kernels of the scene as loaded, the modules stay for later variants
+  getKernels();
+}
+
+PipelineWavefront::Kernels& PipelineWavefront::getKernels() {
+  SpecKey key = makeSpecKey(m_pScene);
+  auto it = m_variants.find(key);
+  if (it != m_variants.end()) return it->second;
+
+  auto m_device = m_pContext->getDevice();
+  LOG_INFO("{}: building wavefront variant [{}]", "Pipeline",
+           specKeyString(key));
+
+  // Kernels are told apart by the first two specialization constants, the
+  // scene features follow
+  vector<VkSpecializationMapEntry> entries{};
+  entries.push_back({0, 0, sizeof(uint32_t)});
+  entries.push_back({1, sizeof(uint32_t), sizeof(uint32_t)});
+  appendSpecEntries(entries, 2 * sizeof(uint32_t));
+  auto createKernel = [&](VkShaderModule module, uint32_t constant0,
+                          uint32_t constant1) {
+    array<uint32_t, 2 + SpecConstantNum> constants{constant0, constant1};
+    std::copy(key.begin(), key.end(), constants.begin() + 2);
+    VkSpecializationInfo specialization{};
+    specialization.mapEntryCount = static_cast<uint32_t>(entries.size());
+    specialization.pMapEntries = entries.data();
+    specialization.dataSize = sizeof(constants);
+    specialization.pData = constants.data();
+
+    VkComputePipelineCreateInfo info{
+        VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+    info.layout = m_pipelineLayout;
+    info.stage = nvvk::make<VkPipelineShaderStageCreateInfo>();
+    info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    info.stage.module = module;
+    info.stage.pName = "main";
+    info.stage.pSpecializationInfo = &specialization;
+    VkPipeline pipeline{VK_NULL_HANDLE};
+    vkCreateComputePipelines(m_device, m_pContext->getPipelineCache(), 1,
+                             &info, nullptr, &pipeline);
+    return pipeline;
+  };
+
+  Kernels& kernels = m_variants[key];
+  for (uint stage : {WavefrontStageGenerate, WavefrontStageIntersect,
+                     WavefrontStageSort, WavefrontStageShadow,
+                     WavefrontStageResolve})
+    kernels.stages[stage] = createKernel(m_integrator, stage, 0);
+  for (uint schedule = 0; schedule < kernels.schedules.size(); schedule++)
+    kernels.schedules[schedule] =
+        createKernel(m_integrator, WavefrontStageSchedule, schedule);
+  // The hit group is a specialization constant of the shading kernels
+  for (uint group = 0; group < m_shadeModules.size(); group++)
+    kernels.shades[group] = createKernel(m_shadeModules[group], group, 0);
+  return kernels;
+}
+
+void PipelineWavefront::updateDescriptorSet() {
+  auto m_device = m_pContext->getDevice();
+
+  auto& queuesDsw = m_holdSetWrappers[uint(HoldSet::Queues)];
+  auto& bind = queuesDsw.getDescriptorSetBindings();
+  auto& set = queuesDsw.getDescriptorSet();
+
+  array<VkDescriptorBufferInfo, WavefrontShadowQueue + 1> infos{};
+  infos[WavefrontCounters] = {m_bCounters.buffer, 0, VK_WHOLE_SIZE};
+  infos[WavefrontPaths] = {m_bPaths.buffer, 0, VK_WHOLE_SIZE};
+  infos[WavefrontHits] = {m_bHits.buffer, 0, VK_WHOLE_SIZE};
+  infos[WavefrontRayQueue] = {m_bRayQueue.buffer, 0, VK_WHOLE_SIZE};
+  infos[WavefrontShadeQueue] = {m_bShadeQueue.buffer, 0, VK_WHOLE_SIZE};
+  infos[WavefrontShadowQueue] = {m_bShadowQueue.buffer, 0, VK_WHOLE_SIZE};
+
+  std::vector<VkWriteDescriptorSet> writes;
+  for (uint binding = 0; binding < infos.size(); binding++)
+    writes.emplace_back(bind.makeWrite(set, binding, &infos[binding]));
+  vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()),
+                         writes.data(), 0, nullptr);
+}
+
+void PipelineWavefront::createStatQueries() {
+  auto& m_alloc = m_pContext->getAlloc();
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(m_pContext->getPhysicalDevice(), &props);
+  m_timestampPeriod = props.limits.timestampPeriod;
+
+  VkQueryPoolCreateInfo queryInfo{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+  queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryInfo.queryCount = maxQueriesPerSample * FRAMES_IN_FLIGHT;
+  vkCreateQueryPool(m_pContext->getDevice(), &queryInfo, nullptr,
+                    &m_timestampPool);
+  m_querySlot = 0;
+  for (auto& stages : m_queryStages) stages.clear();
+  m_queryDepths.fill(0);
+
+  MemCategoryScope memScope(MemCategoryFilm);
+  m_bStats = m_alloc.createBuffer(
+      FRAMES_IN_FLIGHT * maxStatDepth * sizeof(GpuWavefrontCounters),
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  m_pStats = reinterpret_cast<GpuWavefrontCounters*>(m_alloc.map(m_bStats));
+}
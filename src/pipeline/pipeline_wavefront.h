@@ -0,0 +1,96 @@
+#pragma once
+
+#include <shared/pushconstant.h>
+#include <shared/wavefront.h>
+#include "pipeline.h"
+
+#include <map>
+
+struct PipelineWavefrontInitSetting {
+  DescriptorSetWrapper* pDswAccel = nullptr;
+  DescriptorSetWrapper* pDswOut = nullptr;
+  DescriptorSetWrapper* pDswScene = nullptr;
+  DescriptorSetWrapper* pDswEnv = nullptr;
+  // Material type of each hit group of the ray tracing pipeline
+  vector<MaterialType> hitGroupTypes;
+};
+
+// Queue sizes and kernel times of one sample, read back FRAMES_IN_FLIGHT
+// batches after it was recorded
+struct WavefrontStats {
+  array<float, WavefrontStageNum> stageMs{};
+  array<uint32_t, MaterialTypeNum> numHits{};  // over all depths
+  vector<uint32_t> numRays;                     // per depth
+  vector<uint32_t> numShadowRays;               // per depth
+};
+
+// Path tracing in compute kernels with ray queries, see
+// wavefront.integrator.comp. Shading is sorted by material, each closest
+// hit shader is also built as a kernel over the hits of its hit group.
+class PipelineWavefront : public PipelineAware {
+public:
+  enum class HoldSet {
+    Queues = 0,
+    Num = 1,
+  };
+  PipelineWavefront() : PipelineAware(uint(HoldSet::Num), WfBindSet::WfNum) {}
+  void init(ContextAware* pContext, Scene* pScene,
+            PipelineWavefrontInitSetting& pis);
+  void deinit();
+  // Record one sample of every pixel, optionally timed and counted
+  void run(const VkCommandBuffer& cmdBuf, bool gatherStats);
+  const WavefrontStats& getStats() { return m_stats; }
+
+private:
+  void createQueueBuffers();
+  void createDescriptorSetLayout();
+  void createPipelines();
+  void updateDescriptorSet();
+  void createStatQueries();
+  void readStats();  // Stats of the batch last recorded into the slot
+  // Bind, dispatch and wait for the kernel before the next one. The
+  // indirect arguments are at argsOffset of the counters if numGroups is 0.
+  void dispatch(const VkCommandBuffer& cmdBuf, VkPipeline pipeline,
+                WavefrontStage stage, uint32_t numGroups,
+                VkDeviceSize argsOffset = 0);
+  void copyCounters(const VkCommandBuffer& cmdBuf, uint32_t depth);
+
+private:
+  // Kernels built per SpecKey
+  struct Kernels {
+    // Generate, intersect, sort, shadow and resolve kernels
+    array<VkPipeline, WavefrontStageNum> stages{};
+    // Schedule kernels, by WavefrontSchedule
+    array<VkPipeline, 3> schedules{};
+    // Shading kernels, by hit group, null past the groups in use
+    array<VkPipeline, MaterialTypeNum> shades{};
+  };
+  Kernels& getKernels();  // Of the current state, built on first use
+
+private:
+  VkExtent2D m_size{};
+  nvvk::Buffer m_bCounters;
+  nvvk::Buffer m_bPaths;
+  nvvk::Buffer m_bHits;
+  nvvk::Buffer m_bRayQueue;
+  nvvk::Buffer m_bShadeQueue;
+  nvvk::Buffer m_bShadowQueue;
+  vector<MaterialType> m_hitGroupTypes;
+  // Modules of the integrator and of the shading kernels by hit group, kept
+  // to build the variants
+  VkShaderModule m_integrator{VK_NULL_HANDLE};
+  vector<VkShaderModule> m_shadeModules;
+  std::map<SpecKey, Kernels> m_variants;
+
+  // A timestamp after every kernel of a sample, the stage of the kernel is
+  // kept on the host. Queue sizes are copied after each depth is shaded.
+  VkQueryPool m_timestampPool{VK_NULL_HANDLE};
+  float m_timestampPeriod{1.f};  // nanoseconds per tick
+  uint32_t m_querySlot{0};
+  array<vector<WavefrontStage>, FRAMES_IN_FLIGHT> m_queryStages{};
+  array<uint32_t, FRAMES_IN_FLIGHT> m_queryDepths{};
+  bool m_timing{false};
+  nvvk::Buffer m_bStats;
+  GpuWavefrontCounters* m_pStats{nullptr};
+  WavefrontStats m_stats;
+};
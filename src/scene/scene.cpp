@@ -19,11 +19,21 @@ void Scene::deinit() {
     LOG_ERROR("{}: failed to find belonging context when deinit.", "Scene");
     exit(1);
   }
+  ThreadPool::get().wait(m_loading);
+  ThreadPool::get().wait(m_envMapLoading);
+  m_cache.close();
   freeRawData();
   freeAllocData();
 }
 
 void Scene::submit() {
+  ThreadPool::get().wait(m_loading);
+  ThreadPool::get().wait(m_envMapLoading);
+  if (m_pipelineState.rtxState.hasEnvMap) {
+    auto size = m_pEnvMap->getSize();
+    m_pipelineState.rtxState.envMapResolution = vec2(size.width, size.height);
+  }
+
   LOG_INFO("{}: submitting resources to gpu", "Scene");
   LOG_INFO("{}: {} light(s), {} textures(s), {} material(s), {} mesh(es)",
            "Scene", getLightsNum() - 1, getTexturesNum() - 1,
@@ -40,21 +50,28 @@ void Scene::submit() {
 
   allocLights(m_pContext, cmdBuf);
 
-  m_pTexturesAlloc.resize(getTexturesNum());
+  // Resolve shared textures, aliases may point at textures that are aliased
+  // themselves
+  m_textureSlots.resize(getTexturesNum());
+  for (uint textureId = 0; textureId < m_textureSlots.size(); textureId++) {
+    uint slot = textureId;
+    while (m_textureAliases.count(slot)) slot = m_textureAliases[slot];
+    m_textureSlots[textureId] = slot;
+  }
+  if (!m_textureAliases.empty())
+    LOG_INFO("{}: {} texture(s) share the data of another one", "Scene",
+             m_textureAliases.size());
+
+  m_pTexturesAlloc.assign(getTexturesNum(), nullptr);
   for (auto& record : m_pTextures) {
     const auto& textureName = record.first;
     auto pTexture = record.second.first;
     auto textureId = record.second.second;
-    allocTexture(m_pContext, textureId, textureName, pTexture, cmdBuf);
+    if (m_textureSlots[textureId] == textureId)
+      allocTexture(m_pContext, textureId, textureName, pTexture, cmdBuf);
   }
 
-  m_pMaterialsAlloc.resize(getMaterialsNum());
-  for (auto& record : m_pMaterials) {
-    const auto& materialName = record.first;
-    auto pMaterial = record.second.first;
-    auto materialId = record.second.second;
-    allocMaterial(m_pContext, materialId, materialName, pMaterial, cmdBuf);
-  }
+  allocMaterials(m_pContext, cmdBuf);
 
   m_pMeshesAlloc.resize(getMeshesNum());
   for (auto& record : m_pMeshes) {
@@ -64,6 +81,13 @@ void Scene::submit() {
     allocMesh(m_pContext, meshId, meshName, pMesh, cmdBuf);
   }
 
+  // Only meshes with an alpha tested instance need the any-hit shader
+  m_alphaTestedMeshes.assign(getMeshesNum(), false);
+  for (auto& inst : m_instances)
+    if (inst.getEmitterOffset() < 0 &&
+        isMaterialAlphaTested(inst.getMaterialIndex()))
+      m_alphaTestedMeshes[inst.getMeshIndex()] = true;
+
   allocEnvMap(m_pContext, cmdBuf);
 
   // Keeping the mesh description at host and device
@@ -74,6 +98,9 @@ void Scene::submit() {
   cmdBufGet.submitAndWait(cmdBuf);
   m_pContext->getAlloc().finalizeAndReleaseStaging();
 
+  // Cached assets have been uploaded, the mapping is no longer needed
+  m_cache.close();
+
   // autofit
   if (m_shots.empty()) {
     computeSceneDimensions();
@@ -86,6 +113,9 @@ void Scene::submit() {
 
 void Scene::reset() {
   if (m_hasScene) freeAllocData();
+  ThreadPool::get().wait(m_loading);
+  ThreadPool::get().wait(m_envMapLoading);
+  m_cache.close();
   freeRawData();
   m_hasScene = false;
   // Add dummy envmap, texture, material and light so that pipeline
@@ -107,6 +137,7 @@ void Scene::reset() {
       0.f,                   // radius
       0.f,                   // area
       1,                     // double side
+      -1,                    // bvh leaf
   };
   addLight(defaultLight);
   m_sunAndSky = {
@@ -140,7 +171,7 @@ void Scene::freeAllocData() {
 
   // free textures alloc data
   for (auto& pTextureAlloc : m_pTexturesAlloc) {
-    pTextureAlloc->deinit(m_pContext);
+    if (pTextureAlloc) pTextureAlloc->deinit(m_pContext);
   }
 
   // free meshes alloc data
@@ -148,10 +179,10 @@ void Scene::freeAllocData() {
     pMeshAlloc->deinit(m_pContext);
   }
 
-  // free meshes alloc data
-  for (auto& pMaterialAlloc : m_pMaterialsAlloc) {
-    pMaterialAlloc->deinit(m_pContext);
-  }
+  // free materials alloc data
+  m_pMaterialsAlloc->deinit(m_pContext);
+  delete m_pMaterialsAlloc;
+  m_pMaterialsAlloc = nullptr;
 
   // free scene desc alloc data
   m_pInstancesAlloc->deinit(m_pContext);
@@ -170,6 +201,7 @@ void Scene::freeRawData() {
   delete m_pEnvMap;
   m_pEnvMap = nullptr;
   m_lights.clear();
+  m_emitters.clear();
   m_shots.clear();
   m_instances.clear();
 
@@ -179,6 +211,11 @@ void Scene::freeRawData() {
     delete pTexture;
   }
   m_pTextures.clear();
+  m_texturePaths.clear();
+  m_textureKeys.clear();
+  m_textureAliases.clear();
+  m_textureSlots.clear();
+  m_alphaTestedMeshes.clear();
 
   for (auto& record : m_pMeshes) {
     const auto& valuePair = record.second;
@@ -195,8 +232,19 @@ void Scene::freeRawData() {
   m_pMaterials.clear();
 }
 
+void Scene::openCache(const std::string& cachePath) {
+  m_cache.open(cachePath);
+}
+
 void Scene::addState(const State& piplineState) {
   m_pipelineState = piplineState;
+  if (m_pipelineState.compressTextures &&
+      !m_pContext->hasTextureCompressionBC()) {
+    LOG_WARN("{}: device lacks bc texture compression, textures are kept in "
+             "their native formats",
+             "Scene");
+    m_pipelineState.compressTextures = false;
+  }
 }
 
 // void Scene::addIntegrator(int spp, int maxRecur, ToneMappingType tmType, uint
@@ -236,64 +284,96 @@ void Scene::addLight(const GpuLight& light) {
     auto meshId = m_pMeshes.size();
     m_pMeshes[std::string(lightMeshName)] = std::make_pair(pMesh, meshId);
     m_mesh2light[meshId] = std::make_pair(true, lightId);
-    // add instance
-    m_instances.emplace_back(Instance(meshId, lightId));
+    // add instance, both triangles of the rect share one light
+    m_instances.emplace_back(Instance(meshId, m_emitters.size()));
+    m_emitters.insert(m_emitters.end(), pMesh->getIndicesNum() / 3, lightId);
   }
   // add light
   m_lights.emplace_back(light);
 }
 
 void Scene::addLight(const GpuLight& light, const std::string& lightMeshPath) {
-  vector<GpuVertex> m_vertices{};
-  vector<uint> m_indices{};
-
-  loadMesh(lightMeshPath, m_vertices, m_indices);
+  // The whole mesh becomes one blas and one instance, every facet of it is
+  // registered as a triangle light for sampling
+  Mesh* pMesh = m_cache.loadMesh(lightMeshPath, false, {1.f, 1.f});
+  const auto& vertices = pMesh->getVertices();
+  const auto& indices = pMesh->getIndices();
 
-  // Add every facet of mesh as a triangle light
   static char lightMeshName[40];
-  Primitive prim;
-  prim.type = PrimitiveTypeTriangle;
+  int firstLightId = getLightsNum();
+  auto meshId = m_pMeshes.size();
+  sprintf(lightMeshName, "__meshLight:%d", firstLightId);
+  m_pMeshes[std::string(lightMeshName)] = std::make_pair(pMesh, meshId);
+  m_mesh2light[meshId] = std::make_pair(true, firstLightId);
+
+  // Add instance, gl_PrimitiveID indexes the emitter table from its offset
+  m_instances.emplace_back(Instance(meshId, m_emitters.size()));
+
   GpuLight light_ = light;
   light_.type = LightTypeTriangle;
-  for (size_t i = 0; i < m_indices.size(); i += 3) {
-    GpuVertex& v0 = m_vertices[m_indices[i + 0]];
-    GpuVertex& v1 = m_vertices[m_indices[i + 1]];
-    GpuVertex& v2 = m_vertices[m_indices[i + 2]];
-
-    light_.position = prim.position = v0.pos;
-    light_.u = prim.u = v1.pos - v0.pos;
-    light_.v = prim.v = v2.pos - v0.pos;
+  light_.doubleSide = 0;
+  m_lights.reserve(m_lights.size() + indices.size() / 3);
+  m_emitters.reserve(m_emitters.size() + indices.size() / 3);
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    const GpuVertex& v0 = vertices[indices[i + 0]];
+    const GpuVertex& v1 = vertices[indices[i + 1]];
+    const GpuVertex& v2 = vertices[indices[i + 2]];
+
+    light_.position = v0.pos;
+    light_.u = v1.pos - v0.pos;
+    light_.v = v2.pos - v0.pos;
     light_.area = nvmath::length(nvmath::cross(light_.u, light_.v)) * 0.5f;
-    light_.doubleSide = 0;
-
-    // Add mesh
-    Mesh* pMesh = new Mesh(prim);
-    int lightId = getLightsNum();
-    auto meshId = m_pMeshes.size();
-    sprintf(lightMeshName, "__meshLight:%d", lightId);
-    m_pMeshes[std::string(lightMeshName)] = std::make_pair(pMesh, meshId);
-    m_mesh2light[meshId] = std::make_pair(true, lightId);
-
-    // Add instance
-    m_instances.emplace_back(Instance(meshId, lightId));
 
     // add light
+    m_emitters.emplace_back(getLightsNum());
     m_lights.emplace_back(light_);
   }
 }
 
 void Scene::addEnvMap(const std::string& envmapPath) {
+  ThreadPool::get().wait(m_envMapLoading);
   if (m_pEnvMap) delete m_pEnvMap;
-  m_pEnvMap = new EnvMap(envmapPath);
-  auto size = m_pEnvMap->getSize();
+  m_pEnvMap = nullptr;
+  // Resolution is filled in by submit() once the envmap has been loaded
   m_pipelineState.rtxState.hasEnvMap = 1;
-  m_pipelineState.rtxState.envMapResolution = vec2(size.width, size.height);
+  bool compress = m_pipelineState.compressTextures;
+  ThreadPool::get().run(m_envMapLoading, [this, envmapPath, compress] {
+    m_pEnvMap = m_cache.loadEnvMap(envmapPath, compress);
+  });
 }
 
 void Scene::addTexture(const std::string& textureName,
                        const std::string& texturePath, float gamma) {
-  Texture* pTexture = new Texture(texturePath, gamma);
-  m_pTextures[textureName] = std::make_pair(pTexture, m_pTextures.size());
+  uint textureId = m_pTextures.size();
+  auto& record = m_pTextures[textureName];
+  record = std::make_pair(nullptr, textureId);
+
+  // The same file under another name is not even hashed again
+  auto pathKey = std::make_pair(texturePath, gamma);
+  if (m_texturePaths.count(pathKey)) {
+    std::lock_guard<std::mutex> lock(m_texturesMutex);
+    m_textureAliases[textureId] = m_texturePaths[pathKey];
+    return;
+  }
+  m_texturePaths[pathKey] = textureId;
+
+  // References to map elements stay valid while other names are inserted
+  Texture** ppTexture = &record.first;
+  bool compress = m_pipelineState.compressTextures;
+  ThreadPool::get().run(m_loading, [this, ppTexture, textureId, texturePath,
+                                    gamma, compress] {
+    uint64_t key = m_cache.getTextureKey(texturePath, gamma);
+    {
+      // The first texture with this content loads it, the others share it
+      std::lock_guard<std::mutex> lock(m_texturesMutex);
+      auto result = m_textureKeys.emplace(key, textureId);
+      if (!result.second) {
+        m_textureAliases[textureId] = result.first->second;
+        return;
+      }
+    }
+    *ppTexture = m_cache.loadTexture(key, texturePath, gamma, compress);
+  });
 }
 
 void Scene::addMaterial(const std::string& materialName,
@@ -304,8 +384,15 @@ void Scene::addMaterial(const std::string& materialName,
 
 void Scene::addMesh(const std::string& meshName, const std::string& meshPath,
                     bool recomputeNormal, vec2 uvScale) {
-  Mesh* pMesh = new Mesh(meshPath, recomputeNormal, uvScale);
-  m_pMeshes[meshName] = std::make_pair(pMesh, m_pMeshes.size());
+  uint meshId = m_pMeshes.size();
+  auto& record = m_pMeshes[meshName];
+  record = std::make_pair(nullptr, meshId);
+  Mesh** ppMesh = &record.first;
+  ThreadPool::get().run(m_loading,
+                        [this, ppMesh, meshPath, recomputeNormal, uvScale] {
+                          *ppMesh = m_cache.loadMesh(meshPath, recomputeNormal,
+                                                     uvScale);
+                        });
 }
 
 void Scene::addInstance(const nvmath::mat4f& transform,
@@ -370,7 +457,7 @@ int Scene::getSpp()
 }
 */
 
-void Scene::setSpp(int spp) { m_pipelineState.rtxState.spp = 1; }
+void Scene::setSpp(int spp) { m_sppOverride = spp; }
 
 /*
 int Scene::getMaxPathDepth()
@@ -402,12 +489,17 @@ Camera& Scene::getCamera() { return *m_pCamera; }
 CameraType Scene::getCameraType() { return m_pCamera->getType(); }
 
 MaterialType Scene::getMaterialType(uint matId) {
-  return m_pMaterialsAlloc[matId]->getType();
+  return m_pMaterialsAlloc->getType(matId);
+}
+
+bool Scene::isMaterialAlphaTested(uint matId) {
+  return m_pMaterialsAlloc->isAlphaTested(matId);
 }
 
 nvvk::RaytracingBuilderKHR::BlasInput Scene::getBlas(VkDevice device,
                                                      int meshId) {
-  return MeshBufferToBlas(device, *m_pMeshesAlloc[meshId]);
+  bool opaque = !m_alphaTestedMeshes[meshId];
+  return MeshBufferToBlas(device, *m_pMeshesAlloc[meshId], opaque);
 }
 
 vector<Instance>& Scene::getInstances() { return m_instances; }
@@ -422,7 +514,7 @@ VkBuffer Scene::getInstancesDescriptor() {
 }
 
 VkDescriptorImageInfo Scene::getTextureDescriptor(int textureId) {
-  return m_pTexturesAlloc[textureId]->getTexture();
+  return m_pTexturesAlloc[m_textureSlots[textureId]]->getTexture();
 }
 
 vector<VkDescriptorImageInfo> Scene::getEnvMapDescriptor() {
@@ -430,8 +522,24 @@ vector<VkDescriptorImageInfo> Scene::getEnvMapDescriptor() {
           m_pEnvMapAlloc->getConditional()};
 }
 
+VkBuffer Scene::getEnvMapAliasDescriptor() {
+  return m_pEnvMapAlloc->getAliasTable();
+}
+
 VkBuffer Scene::getLightsDescriptor() { return m_pLightsAlloc->getBuffer(); }
 
+VkBuffer Scene::getLightBvhDescriptor() {
+  return m_pLightsAlloc->getLightBvhBuffer();
+}
+
+VkBuffer Scene::getEmittersDescriptor() {
+  return m_pLightsAlloc->getEmittersBuffer();
+}
+
+VkBuffer Scene::getMaterialsDescriptor() {
+  return m_pMaterialsAlloc->getBuffer();
+}
+
 VkBuffer Scene::getSunskyDescriptor() { return m_bSunAndSky.buffer; }
 
 GpuSunAndSky& Scene::getSunsky() { return m_sunAndSky; }
@@ -440,7 +548,8 @@ void Scene::setShot(int shotId) {
   m_pCamera->setToWorld(m_shots[shotId]);
   auto& state = m_shots[shotId].state;
   // m_pipelineState.rtxState.curFrame         = state.rtxState.curFrame;
-  m_pipelineState.rtxState.spp = state.rtxState.spp;
+  m_pipelineState.rtxState.spp =
+      m_sppOverride > 0 ? m_sppOverride : state.rtxState.spp;
   m_pipelineState.rtxState.maxPathDepth = state.rtxState.maxPathDepth;
   // m_pipelineState.rtxState.numLights        = state.rtxState.numLights;
   m_pipelineState.rtxState.useFaceNormal = state.rtxState.useFaceNormal;
@@ -453,7 +562,7 @@ void Scene::setShot(int shotId) {
 }
 
 void Scene::allocLights(ContextAware* pContext, const VkCommandBuffer& cmdBuf) {
-  m_pLightsAlloc = new LightsAlloc(pContext, m_lights, cmdBuf);
+  m_pLightsAlloc = new LightsAlloc(pContext, m_lights, m_emitters, cmdBuf);
 }
 
 void Scene::allocTexture(ContextAware* pContext, uint32_t textureId,
@@ -466,18 +575,19 @@ void Scene::allocTexture(ContextAware* pContext, uint32_t textureId,
   m_pTexturesAlloc[textureId] = pTextureAlloc;
 }
 
-void Scene::allocMaterial(ContextAware* pContext, uint32_t materialId,
-                          const std::string& materialName, Material* pMaterial,
-                          const VkCommandBuffer& cmdBuf) {
+void Scene::allocMaterials(ContextAware* pContext,
+                           const VkCommandBuffer& cmdBuf) {
   auto& m_debug = pContext->getDebug();
-  auto m_device = pContext->getDevice();
 
-  MaterialAlloc* pMaterialAlloc =
-      new MaterialAlloc(pContext, pMaterial, cmdBuf);
-  m_pMaterialsAlloc[materialId] = pMaterialAlloc;
+  vector<GpuMaterial> materials(getMaterialsNum());
+  for (auto& record : m_pMaterials) {
+    auto pMaterial = record.second.first;
+    auto materialId = record.second.second;
+    materials[materialId] = pMaterial->getMaterial();
+  }
+  m_pMaterialsAlloc = new MaterialsAlloc(pContext, materials, cmdBuf);
 
-  m_debug.setObjectName(pMaterialAlloc->getBuffer(),
-                        std::string(materialName + "_materialBuffer"));
+  m_debug.setObjectName(m_pMaterialsAlloc->getBuffer(), "materialBuffer");
 }
 
 void Scene::allocMesh(ContextAware* pContext, uint32_t meshId,
@@ -486,7 +596,8 @@ void Scene::allocMesh(ContextAware* pContext, uint32_t meshId,
   auto& m_debug = pContext->getDebug();
   auto m_device = pContext->getDevice();
 
-  MeshAlloc* pMeshAlloc = new MeshAlloc(pContext, pMesh, cmdBuf);
+  MeshAlloc* pMeshAlloc =
+      new MeshAlloc(pContext, pMesh, cmdBuf, m_pipelineState.compactVertex);
   m_pMeshesAlloc[meshId] = pMeshAlloc;
 
   NAME2_VK(pMeshAlloc->getVerticesBuffer(),
@@ -498,12 +609,14 @@ void Scene::allocMesh(ContextAware* pContext, uint32_t meshId,
 void Scene::allocInstances(ContextAware* pContext,
                            const VkCommandBuffer& cmdBuf) {
   // Keeping the obj host model and device description
-  m_pInstancesAlloc = new InstancesAlloc(pContext, m_instances, m_pMeshesAlloc,
-                                         m_pMaterialsAlloc, cmdBuf);
+  m_pInstancesAlloc =
+      new InstancesAlloc(pContext, m_instances, m_pMeshesAlloc, cmdBuf);
 }
 
 void Scene::allocEnvMap(ContextAware* pContext, const VkCommandBuffer& cmdBuf) {
-  m_pEnvMapAlloc = new EnvMapAlloc(pContext, m_pEnvMap, cmdBuf);
+  m_pEnvMapAlloc =
+      new EnvMapAlloc(pContext, m_pEnvMap, cmdBuf,
+                      m_pipelineState.rtxState.envMapAliasTable == 1);
 }
 
 void Scene::allocSunAndSky(ContextAware* pContext,
@@ -5,6 +5,7 @@
 #include <shared/sun_and_sky.h>
 #include <shared/pushconstant.h>
 #include <context/context.h>
+#include <core/cache.h>
 #include <core/light.h>
 #include <core/instance.h>
 #include <core/integrator.h>
@@ -12,9 +13,11 @@
 #include <core/material.h>
 #include <core/mesh.h>
 #include <core/texture.h>
+#include <core/thread_pool.h>
 #include <ext/json.hpp>
 
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -26,6 +29,8 @@ public:
   void reset();
   void freeAllocData();
   void freeRawData();
+  // Reuse preprocessed assets from (and write new ones to) this cache file
+  void openCache(const std::string& cachePath);
 
 public:
   void addState(const State& piplineState);
@@ -61,13 +66,18 @@ public:
   Camera& getCamera();
   CameraType getCameraType();
   MaterialType getMaterialType(uint matId);
+  bool isMaterialAlphaTested(uint matId);
   nvvk::RaytracingBuilderKHR::BlasInput getBlas(VkDevice device, int meshId);
   vector<Instance>& getInstances();
   VkExtent2D getSize();
   VkBuffer getInstancesDescriptor();
   VkDescriptorImageInfo getTextureDescriptor(int textureId);
   vector<VkDescriptorImageInfo> getEnvMapDescriptor();
+  VkBuffer getEnvMapAliasDescriptor();
   VkBuffer getLightsDescriptor();
+  VkBuffer getLightBvhDescriptor();
+  VkBuffer getEmittersDescriptor();
+  VkBuffer getMaterialsDescriptor();
   VkBuffer getSunskyDescriptor();
   GpuSunAndSky& getSunsky();
   void setShot(int shotId);
@@ -84,9 +94,12 @@ private:
   // ---------------- CPU resources ----------------
   // Integrator         m_integrator   = {};
   State m_pipelineState = {};
+  // Total spp given on the command line, overrides the spp of every shot
+  int m_sppOverride = 0;
   Camera* m_pCamera = nullptr;
   EnvMap* m_pEnvMap = nullptr;
   vector<GpuLight> m_lights = {};
+  vector<int> m_emitters = {};  // light id of every emissive primitive
   TextureTable m_pTextures = {};
   MeshTable m_pMeshes = {};
   MaterialTable m_pMaterials = {};
@@ -94,11 +107,27 @@ private:
   vector<CameraShot> m_shots = {};
   GpuSunAndSky m_sunAndSky = {};
   MeshPropTable m_mesh2light = {};
+  SceneCache m_cache;
+  // Meshes, textures and envmap are decoded on the thread pool, their ids are
+  // handed out up front in declaration order
+  TaskGroup m_loading;
+  // The envmap task writes m_pEnvMap, a scene declaring another envmap waits
+  // for it first
+  TaskGroup m_envMapLoading;
+  // Textures of the same file, or of byte-identical content, are loaded once.
+  // Every texture id maps to the id owning its TextureAlloc (a slot).
+  std::map<std::pair<string, float>, uint> m_texturePaths = {};
+  std::map<uint64_t, uint> m_textureKeys = {};
+  std::map<uint, uint> m_textureAliases = {};
+  std::mutex m_texturesMutex;
+  vector<uint> m_textureSlots = {};
+  // Meshes with an alpha tested instance, their blas is not opaque
+  vector<bool> m_alphaTestedMeshes = {};
   // ---------------- GPU resources ----------------
   EnvMapAlloc* m_pEnvMapAlloc = nullptr;
   LightsAlloc* m_pLightsAlloc = nullptr;
   vector<TextureAlloc*> m_pTexturesAlloc = {};
-  vector<MaterialAlloc*> m_pMaterialsAlloc = {};
+  MaterialsAlloc* m_pMaterialsAlloc = nullptr;
   vector<MeshAlloc*> m_pMeshesAlloc = {};
   InstancesAlloc* m_pInstancesAlloc = nullptr;
   nvvk::Buffer m_bSunAndSky;
@@ -110,9 +139,7 @@ private:
   void allocTexture(ContextAware* pContext, uint32_t textureId,
                     const std::string& textureName, Texture* pTexture,
                     const VkCommandBuffer& cmdBuf);
-  void allocMaterial(ContextAware* pContext, uint32_t materialId,
-                     const std::string& materialName, Material* pMaterial,
-                     const VkCommandBuffer& cmdBuf);
+  void allocMaterials(ContextAware* pContext, const VkCommandBuffer& cmdBuf);
   void allocMesh(ContextAware* pContext, uint32_t meshId,
                  const std::string& meshName, Mesh* pMesh,
                  const VkCommandBuffer& cmdBuf);
@@ -0,0 +1,38 @@
+#ifndef ALPHA_TEST_GLSL
+#define ALPHA_TEST_GLSL
+
+#include "math.glsl"
+#include "mesh_fetch.glsl"
+
+// Alpha test of candidate hits during traversal, for the any-hit shader and
+// the ray queries of the wavefront integrator. The includer declares
+// instances, materials, textureSamplers and pc.
+//
+// The opacity texture holds the probability of passing through the
+// surface, as the closest hit shaders treated it. The random number hashes
+// the ray and the candidate, so no payload is needed and repeated
+// invocations for one candidate agree. Camera rays of a pixel may share
+// their origin, their directions tell the samples apart.
+bool alphaTestHit(int instanceId, int primitiveId, vec2 bary, vec3 rayOrigin,
+                  vec3 rayDir, uvec2 pixel) {
+  GpuInstance inst = instances.i[instanceId];
+  int texId = materials.m[inst.materialId].opacityTextureId;
+  if (texId < 0) return true;
+
+  ivec3 id = fetchTriangle(inst, primitiveId);
+  vec3 ba = vec3(1.0 - bary.x - bary.y, bary.x, bary.y);
+  vec2 uv = barymix2(fetchUv(inst, id.x), fetchUv(inst, id.y),
+                     fetchUv(inst, id.z), ba);
+  float opacity =
+      textureLod(textureSamplers[nonuniformEXT(texId)], uv, 0.0).r;
+
+  uvec3 o = floatBitsToUint(rayOrigin);
+  uvec3 d = floatBitsToUint(rayDir);
+  uint seed = xxhash32Seed(
+      uvec3(pixel.x ^ o.x ^ d.x, pixel.y ^ o.y ^ o.z ^ d.y,
+            uint(pc.curFrame) ^ d.z ^
+                (uint(primitiveId) * 9781u + uint(instanceId) * 6271u)));
+  return rand(seed) >= opacity;
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef FILM_GLSL
+#define FILM_GLSL
+
+#include "math.glsl"
+#include "specialization.glsl"
+
+// Camera rays and the accumulation of their samples, shared by the raygen
+// shader and the wavefront integrator. The includer declares cameraInfo,
+// the output images and the push constant.
+
+const bool useGaussianFilter = true;
+
+// Ray through a point of the film, pixel is in raster space. Returns the
+// spread angle of the ray cone.
+float generateCameraRay(vec2 pixel, inout uint seed, out vec3 rayOrigin,
+                        out vec3 rayDir) {
+  vec3 origin = transformPoint(cameraInfo.cameraToWorld, vec3(0.f));
+  float coneSpread = 0.f;
+  rayOrigin = origin;
+  rayDir = vec3(0.f, 0.f, 1.f);
+
+  if (specCameraType == CameraTypePerspective) {
+    // Compute raster and camera sample positions
+    vec3 pFilm = vec3(pixel, 0.f);
+    vec3 pCamera = transformPoint(cameraInfo.rasterToCamera, pFilm);
+    // Angle between the rays of neighbouring pixels opens the ray cone
+    vec3 pCameraNext = transformPoint(cameraInfo.rasterToCamera,
+                                      pFilm + vec3(1.f, 0.f, 0.f));
+    coneSpread = length(pCameraNext - pCamera) / length(pCamera);
+
+    // Treat point as direction since camera origin is at (0,0,0)
+    vec3 r = makeNormal(pCamera);
+
+    // Modify ray for depth of field
+    if (cameraInfo.aperture > 0.f) {
+      // Sample point on lens
+      vec2 uLens = rand2(seed);
+      vec2 pLens = cameraInfo.aperture * concentricSampleDisk(uLens);
+
+      // Compute point on plane of focus
+      float ft = cameraInfo.focalDistance / r.z;
+      vec3 pFocus = ft * r;
+
+      // Update ray for effect of lens
+      vec3 o = vec3(pLens, 0.f);
+      rayOrigin = transformPoint(cameraInfo.cameraToWorld, o);
+      r = pFocus - o;
+    }
+
+    // Transform ray to world space
+    rayDir = transformDirection(cameraInfo.cameraToWorld, r);
+  }
+
+  else if (specCameraType == CameraTypeOpencv) {
+    vec4 fxfycxcy = cameraInfo.fxfycxcy;
+    vec2 pRaster;
+    pRaster.x = (pixel.x - fxfycxcy.z) / fxfycxcy.x;
+    pRaster.y = (pixel.y - fxfycxcy.w) / fxfycxcy.y;
+
+    vec3 r = vec3(pRaster, 1.f);
+    coneSpread = 1.f / min(fxfycxcy.x, fxfycxcy.y);
+
+    // Transform ray to world space
+    rayDir = transformDirection(cameraInfo.cameraToWorld, r);
+  }
+
+  return coneSpread;
+}
+
+// Reconstruction filter weight of a sample jittered inside its pixel
+float pixelFilterWeight(vec2 jitter) {
+  if (!useGaussianFilter) return 1.0f;
+  // https://github.com/mitsuba-renderer/mitsuba/blob/master/src/rfilters/gaussian.cpp
+  // https://pbr-book.org/4ed/Sampling_and_Reconstruction/Image_Reconstruction
+  const float stddev = 0.5f;
+  const float radius = 4 * stddev;
+  const float alpha = -1.0f / (2.0f * stddev * stddev);
+  const float expXY = exp(alpha * radius * radius);
+  vec2 offset = jitter - vec2(0.5);
+  return max(0.0f, exp(alpha * offset.x * offset.x) - expXY) *
+         max(0.0f, exp(alpha * offset.y * offset.y) - expXY);
+}
+
+// Add filtered samples to the running average of a pixel, the first ones
+// of the first frame replace it
+void accumulateRadiance(ivec2 pixel, vec3 radianceWeightSum,
+                        float filterWeightSum, bool replace) {
+  if (replace) {
+    vec3 radiance = radianceWeightSum / filterWeightSum;
+    imageStore(images[0], pixel, vec4(radiance, 1.f));
+    imageStore(images[8], pixel, vec4(filterWeightSum));
+    return;
+  }
+  vec3 oldRadiance = imageLoad(images[0], pixel).xyz;
+  float oldFilterWeightSum = imageLoad(images[8], pixel).x;
+  vec3 oldRadianceWeightSum = oldRadiance * oldFilterWeightSum;
+  float newFilterWeightSum = oldFilterWeightSum + filterWeightSum;
+  vec3 newRadianceWeightSum = oldRadianceWeightSum + radianceWeightSum;
+  vec3 newRadiance = newRadianceWeightSum / newFilterWeightSum;
+  imageStore(images[0], pixel, vec4(newRadiance, 1.f));
+  imageStore(images[8], pixel, vec4(newFilterWeightSum));
+}
+
+#endif
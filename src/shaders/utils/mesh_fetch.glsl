@@ -0,0 +1,61 @@
+#ifndef MESH_FETCH_GLSL
+#define MESH_FETCH_GLSL
+
+#include "../../shared/instance.h"
+#include "../../shared/vertex.h"
+
+// Vertex and index fetches through the buffer addresses of an instance, in
+// any of the formats of MeshAlloc
+
+// clang-format off
+layout(buffer_reference, scalar) buffer Vertices  { GpuVertex v[];   };
+layout(buffer_reference, scalar) buffer Positions { vec3 p[];        };
+layout(buffer_reference, scalar) buffer Attribs   { GpuVertexAttrib a[]; };
+layout(buffer_reference, scalar) buffer Indices   { ivec3 i[];       };
+layout(buffer_reference, scalar) buffer Indices16 { uint i[];        };
+
+// Inverse of the octahedral mapping in MeshAlloc, OCT_ZERO_VECTOR maps to zero
+vec3 unpackOctahedral(uint packed) {
+  if (packed == OCT_ZERO_VECTOR) return vec3(0);
+  vec2 f = unpackSnorm2x16(packed);
+  vec3 n = vec3(f.x, f.y, 1.0 - abs(f.x) - abs(f.y));
+  float t = max(-n.z, 0.0);
+  n.x += n.x >= 0.0 ? -t : t;
+  n.y += n.y >= 0.0 ? -t : t;
+  return normalize(n);
+}
+
+ivec3 fetchTriangle(GpuInstance inst, int primId) {
+  if ((inst.vertexFormat & VertexFormatIndex16) == 0)
+    return Indices(inst.indexAddress).i[primId];
+  Indices16 _indices16 = Indices16(inst.indexAddress);
+  ivec3 id;
+  for (int k = 0; k < 3; k++) {
+    int  index = 3 * primId + k;
+    uint word  = _indices16.i[index >> 1];
+    id[k]      = int((index & 1) == 0 ? word & 0xffffu : word >> 16);
+  }
+  return id;
+}
+
+GpuVertex fetchVertex(GpuInstance inst, int vertexId) {
+  if ((inst.vertexFormat & VertexFormatCompact) == 0)
+    return Vertices(inst.vertexAddress).v[vertexId];
+  GpuVertexAttrib attrib = Attribs(inst.attribAddress).a[vertexId];
+  GpuVertex       v;
+  v.pos     = Positions(inst.vertexAddress).p[vertexId];
+  v.uv      = unpackHalf2x16(attrib.uv);
+  v.normal  = unpackOctahedral(attrib.normal);
+  v.tangent = unpackOctahedral(attrib.tangent);
+  return v;
+}
+
+// Texture coordinates alone, for the alpha test during traversal
+vec2 fetchUv(GpuInstance inst, int vertexId) {
+  if ((inst.vertexFormat & VertexFormatCompact) == 0)
+    return Vertices(inst.vertexAddress).v[vertexId].uv;
+  return unpackHalf2x16(Attribs(inst.attribAddress).a[vertexId].uv);
+}
+// clang-format on
+
+#endif
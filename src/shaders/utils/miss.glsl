@@ -0,0 +1,45 @@
+#ifndef MISS_GLSL
+#define MISS_GLSL
+
+#include "specialization.glsl"
+
+// Environment seen by a path leaving the scene. The includer declares the
+// payload, the push constant and the environment bindings.
+void missShade() {
+  // Stop ray if it does not hit anything
+  payload.pRec.stop = true;
+
+  // Evaluate environment light and only do mis when depth > 1.
+  vec3 env = vec3(0), d = payload.pRec.ray.d;
+  if (specUseSunsky == 1)
+    env = evalEnvmap(sunskySamplers, mat4(1), 1.0, d);
+  else if (specHasEnvMap == 1)
+    env = evalEnvmap(envmapSamplers, cameraInfo.envTransform,
+                     pc.envMapIntensity, d);
+  else
+    env = pc.bgColor;
+
+  float misWeight = 1.0;
+#if USE_MIS
+  // Multiple importance sampling
+  float envPdf = 0.0;
+  if (payload.pRec.depth != 1 && isNonSpecular(payload.bRec.flags)) {
+    if (specUseSunsky == 1)
+      envPdf =
+          pdfEnvmap(sunskySamplers, mat4(1), SUNSKY_BAKE_RESOLUTION, 0, d);
+    else if (specHasEnvMap == 1)
+      envPdf = pdfEnvmap(envmapSamplers, cameraInfo.envTransform,
+                         pc.envMapResolution, pc.envMapAliasTable, d);
+    else
+      envPdf = uniformSpherePdf();
+
+    misWeight = powerHeuristic(payload.bRec.pdf, envPdf);
+    // ReSTIR DI alone lights the primary hit
+    if (pc.restirDI == 1 && payload.pRec.depth == 2) misWeight = 0.0;
+  }
+#endif
+
+  payload.pRec.radiance += payload.pRec.throughput * env * misWeight;
+}
+
+#endif
@@ -13,25 +13,64 @@
 #include "math.glsl"
 #include "sample_light.glsl"
 #include "sun_and_sky.glsl"
+#include "mesh_fetch.glsl"
+#include "specialization.glsl"
+#ifdef WAVEFRONT_SHADE
+#include "wavefront.glsl"
+#endif
 
 // clang-format off
-layout(buffer_reference, scalar) buffer Vertices  { GpuVertex v[];   };
-layout(buffer_reference, scalar) buffer Indices   { ivec3 i[];       };
-layout(buffer_reference, scalar) buffer Materials { GpuMaterial m[1]; };
-//
 layout(set = RtAccel, binding = AccelTlas)              uniform accelerationStructureEXT tlas;
+layout(set = RtOut,   binding = OutputStore, rgba32f)   uniform image2D    images[NUM_OUTPUT_IMAGES];
 layout(set = RtScene, binding = SceneTextures)          uniform sampler2D  textureSamplers[];
 layout(set = RtScene, binding = SceneInstances, scalar) buffer  _Instances { GpuInstance i[];        } instances;
 layout(set = RtScene, binding = SceneLights, scalar)    buffer  _Lights    { GpuLight l[];           } lights;
+layout(set = RtScene, binding = SceneEmitters, scalar)  buffer  _Emitters  { int e[];                } emitters;
+layout(set = RtScene, binding = SceneMaterials, scalar) buffer  _Materials { GpuMaterial m[];        } materials;
+layout(set = RtScene, binding = SceneLightBvh, scalar)  buffer  _LightBvh  { GpuLightBvhNode n[];    } lightBvh;
 layout(set = RtScene, binding = SceneCamera)            uniform _Camera    { GpuCamera cameraInfo; };
 layout(set = RtEnv,   binding = EnvSunsky, scalar)      uniform _SunAndSky { GpuSunAndSky sunAndSky; };
 layout(set = RtEnv,   binding = EnvAccelMap)            uniform sampler2D  envmapSamplers[3];
+layout(set = RtEnv,   binding = EnvSunskyMap)           uniform sampler2D  sunskySamplers[3];
 //
 layout(push_constant)                                   uniform _RtxState  { GpuPushConstantRaytrace pc; };
 //
+MultiChannelRecord mRec;
+//
+#ifdef WAVEFRONT_SHADE
+// Stand-ins for the payload and the hit shader builtins, the shading kernel
+// fills them from the queues
+RayPayload payload;
+vec2       _bary;
+mat4x3     wfObjectToWorld;
+mat4x3     wfWorldToObject;
+vec3       wfRayDirection;
+float      wfHitT;
+int        wfInstanceId;
+int        wfPrimitiveId;
+uvec3      wfLaunchId;
+uvec3      wfLaunchSize;
+#define HIT_INSTANCE_ID     wfInstanceId
+#define HIT_PRIMITIVE_ID    wfPrimitiveId
+#define HIT_OBJECT_TO_WORLD wfObjectToWorld
+#define HIT_WORLD_TO_OBJECT wfWorldToObject
+#define HIT_RAY_DIRECTION   wfRayDirection
+#define HIT_T               wfHitT
+#define LAUNCH_ID           wfLaunchId
+#define LAUNCH_SIZE         wfLaunchSize
+#else
 layout(location = 0) rayPayloadInEXT RayPayload payload;
 //
 hitAttributeEXT vec2 _bary;
+#define HIT_INSTANCE_ID     gl_InstanceID
+#define HIT_PRIMITIVE_ID    gl_PrimitiveID
+#define HIT_OBJECT_TO_WORLD gl_ObjectToWorldEXT
+#define HIT_WORLD_TO_OBJECT gl_WorldToObjectEXT
+#define HIT_RAY_DIRECTION   gl_WorldRayDirectionEXT
+#define HIT_T               gl_HitTEXT
+#define LAUNCH_ID           gl_LaunchIDEXT
+#define LAUNCH_SIZE         gl_LaunchSizeEXT
+#endif
 // clang-format on
 
 struct HitState {
@@ -55,11 +94,13 @@ struct HitState {
   vec3 Y;
   // material
   GpuMaterial mat;
+  // ray cone lod of the hit, without the texture resolution term
+  float lod;
 };
 
 // clang-format off
 void configureShadingFrame(inout HitState state) {
-  if (pc.useFaceNormal == 1) state.N = state.geoN;
+  if (specUseFaceNormal == 1) state.N = state.geoN;
   basis(state.N, state.X, state.Y);
   state.ffN = dot(state.N, state.V) > 0 ? state.N : -state.N;
 }
@@ -67,27 +108,37 @@ void configureShadingFrame(inout HitState state) {
 HitState getHitState() {
   HitState state;
 
-  GpuInstance _inst     = instances.i[gl_InstanceID];
-  Indices     _indices  = Indices(_inst.indexAddress);
-  Vertices    _vertices = Vertices(_inst.vertexAddress);
+  GpuInstance _inst = instances.i[HIT_INSTANCE_ID];
 
-  ivec3     id = _indices.i[gl_PrimitiveID];
-  GpuVertex v0 = _vertices.v[id.x];
-  GpuVertex v1 = _vertices.v[id.y];
-  GpuVertex v2 = _vertices.v[id.z];
+  ivec3     id = fetchTriangle(_inst, HIT_PRIMITIVE_ID);
+  GpuVertex v0 = fetchVertex(_inst, id.x);
+  GpuVertex v1 = fetchVertex(_inst, id.y);
+  GpuVertex v2 = fetchVertex(_inst, id.z);
   vec3      ba = vec3(1.0 - _bary.x - _bary.y, _bary.x, _bary.y);
 
-  state.lightId = _inst.lightId;
+  state.lightId = _inst.emitterOffset < 0 ? -1 : emitters.e[_inst.emitterOffset + HIT_PRIMITIVE_ID];
   state.uv      = barymix2(v0.uv, v1.uv, v2.uv, ba);
-  state.pos     = gl_ObjectToWorldEXT * vec4(barymix3(v0.pos, v1.pos, v2.pos, ba), 1.f);
+  state.pos     = HIT_OBJECT_TO_WORLD * vec4(barymix3(v0.pos, v1.pos, v2.pos, ba), 1.f);
   state.N       = barymix3(v0.normal, v1.normal, v2.normal, ba);
-  state.N       = makeNormal((state.N * gl_WorldToObjectEXT).xyz);
+  state.N       = makeNormal((state.N * HIT_WORLD_TO_OBJECT).xyz);
   state.ffN     = cross(v1.pos - v0.pos, v2.pos - v0.pos);
-  state.ffN     = makeNormal((state.ffN * gl_WorldToObjectEXT).xyz);
-  state.V       = makeNormal(-gl_WorldRayDirectionEXT);
+  state.ffN     = makeNormal((state.ffN * HIT_WORLD_TO_OBJECT).xyz);
+  state.V       = makeNormal(-HIT_RAY_DIRECTION);
+
+  // Ray cone footprint at the hit becomes the width of the next segment
+  float coneWidth   = payload.pRec.coneWidth + payload.pRec.coneSpread * HIT_T;
+  vec2  duv1        = v1.uv - v0.uv;
+  vec2  duv2        = v2.uv - v0.uv;
+  float uvArea      = abs(duv1.x * duv2.y - duv1.y * duv2.x);
+  vec3  e1          = HIT_OBJECT_TO_WORLD * vec4(v1.pos - v0.pos, 0.f);
+  vec3  e2          = HIT_OBJECT_TO_WORLD * vec4(v2.pos - v0.pos, 0.f);
+  float worldArea   = max(length(cross(e1, e2)), 1e-20);
+  float cosTheta    = max(abs(dot(state.ffN, state.V)), 1e-4);
+  state.lod         = 0.5 * log2(uvArea / worldArea) + log2(coneWidth / cosTheta);
+  payload.pRec.coneWidth = coneWidth;
 
   // Get material if hit surface is not emitter
-  if (state.lightId < 0) state.mat = Materials(_inst.materialAddress).m[0];
+  if (state.lightId < 0) state.mat = materials.m[_inst.materialId];
 
   configureShadingFrame(state);
 
@@ -101,21 +152,127 @@ vec3 sampleEnvironmentLight(inout LightSamplingRecord lRec) {
   lRec.flags = EArea;
   lRec.dist = INFINITY;
   // Eusure visible light
-  lRec.n = -makeNormal(gl_WorldRayDirectionEXT);
-  if (sunAndSky.in_use == 1)
-    radiance =
-        sampleSunSky(rand2(payload.pRec.seed), sunAndSky, lRec.d, lRec.pdf);
-  else if (pc.hasEnvMap == 1)
+  lRec.n = -makeNormal(HIT_RAY_DIRECTION);
+  if (specUseSunsky == 1)
+    radiance = sampleEnvmap(rand2(payload.pRec.seed), sunskySamplers, mat4(1),
+                            SUNSKY_BAKE_RESOLUTION, 0, 1.0, lRec.d, lRec.pdf);
+  else if (specHasEnvMap == 1)
     radiance = sampleEnvmap(rand2(payload.pRec.seed), envmapSamplers,
                             cameraInfo.envTransform, pc.envMapResolution,
-                            pc.envMapIntensity, lRec.d, lRec.pdf);
+                            pc.envMapAliasTable, pc.envMapIntensity, lRec.d,
+                            lRec.pdf);
   else
     radiance = sampleBackGround(rand2(payload.pRec.seed), pc.bgColor, lRec.d,
                                 lRec.pdf);
   return radiance;
 }
 
+// Importance of a light bvh node for a receiver at p: its power over the
+// squared distance, scaled by the cosine towards p that the cones allow
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  return cosA > cosB ? 1.0 : cosA * cosB + sinA * sinB;
+}
+
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  return cosA > cosB ? 0.0 : sinA * cosB - cosA * sinB;
+}
+
+float lightBvhImportance(int nodeId, vec3 p) {
+  GpuLightBvhNode node = lightBvh.n[nodeId];
+  // Directional lights reach everywhere
+  if (node.boundsMin.x > node.boundsMax.x) return node.power;
+
+  vec3 center = 0.5 * (node.boundsMin + node.boundsMax);
+  vec3 diag = node.boundsMax - node.boundsMin;
+  float radiusSq = 0.25 * dot(diag, diag);
+  float distSq = max(dot(p - center, p - center), radiusSq) + 1e-8;
+  vec3 wi = (p - center) * inversesqrt(distSq);
+
+  // Angle between the axis and p, minus the normal spread and the angle the
+  // bounds subtend from p
+  float cosThetaW = clamp(dot(node.axis, wi), -1.0, 1.0);
+  float sinThetaW = sqrt(max(1.0 - cosThetaW * cosThetaW, 0.0));
+  float sinTheta0 = sqrt(max(1.0 - node.cosTheta0 * node.cosTheta0, 0.0));
+  float cosThetaX =
+      cosSubClamped(sinThetaW, cosThetaW, sinTheta0, node.cosTheta0);
+  float sinThetaX =
+      sinSubClamped(sinThetaW, cosThetaW, sinTheta0, node.cosTheta0);
+  float sinThetaBSq = min(radiusSq / distSq, 1.0);
+  float sinThetaB = sqrt(sinThetaBSq);
+  // Inside the bounds every direction is possible
+  float cosThetaB = dot(p - center, p - center) < radiusSq
+                        ? -1.0
+                        : sqrt(1.0 - sinThetaBSq);
+  float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+  if (cosThetaP <= node.cosThetaE) return 0.0;
+
+  return node.power * cosThetaP / distSq;
+}
+
+// Probability of picking the left child, both are equally likely if none
+// of them matters
+float lightBvhLeftPdf(int child, vec3 p) {
+  float left = lightBvhImportance(child, p);
+  float right = lightBvhImportance(child + 1, p);
+  return left + right > 0.0 ? left / (left + right) : 0.5;
+}
+
+// Walk down the light bvh, u is reused for every decision
+int sampleLightBvh(vec3 p, float u, out float pdf) {
+  int nodeId = 0;
+  pdf = 1.0;
+  while (lightBvh.n[nodeId].child >= 0) {
+    int child = lightBvh.n[nodeId].child;
+    float leftPdf = lightBvhLeftPdf(child, p);
+    if (u < leftPdf) {
+      u = min(u / leftPdf, 0.99999994);
+      pdf *= leftPdf;
+      nodeId = child;
+    } else {
+      u = min((u - leftPdf) / (1.0 - leftPdf), 0.99999994);
+      pdf *= 1.0 - leftPdf;
+      nodeId = child + 1;
+    }
+  }
+  return lightBvh.n[nodeId].lightId;
+}
+
+// Probability of sampleLightBvh picking the light, walks up from its leaf
+float pdfLightBvh(vec3 p, int lightId) {
+  int nodeId = lights.l[lightId].bvhLeaf;
+  if (nodeId < 0) return 0.0;
+  float pdf = 1.0;
+  int parent = lightBvh.n[nodeId].parent;
+  while (parent >= 0) {
+    int child = lightBvh.n[parent].child;
+    float leftPdf = lightBvhLeftPdf(child, p);
+    pdf *= nodeId == child ? leftPdf : 1.0 - leftPdf;
+    nodeId = parent;
+    parent = lightBvh.n[nodeId].parent;
+  }
+  return pdf;
+}
+
+// Probability of sampleLights drawing from the analytic lights
+float analyticLightSelectPdf() {
+  bool hasEnv = (specHasEnvMap == 1 || specUseSunsky == 1);
+  bool hasLight = (pc.numLights > 0);
+  return hasLight ? (hasEnv ? 0.5 : 1.0) : 0.0;
+}
+
+#include "restir.glsl"
+
+// Mis weight of a light sample against bsdf sampling. Primary hits under
+// ReSTIR DI leave the lights to the resampled sample alone.
+float lightMisWeight(LightSamplingRecord lRec, float bsdfPdf) {
+  if (pc.restirDI == 1 && payload.pRec.depth == 1) return 1.0;
+  return powerHeuristic(lRec.pdf, bsdfPdf);
+}
+
 vec3 sampleLights(vec3 scatterPos, vec3 scatterNormal, out bool visible, out LightSamplingRecord lRec) {
+    if (pc.restirDI == 1 && payload.pRec.depth == 1)
+      return sampleLightsRestir(scatterPos, scatterNormal, visible, lRec);
+
     bool allowDoubleSide = false;
     vec3 radiance = vec3(0);
 
@@ -124,7 +281,7 @@ vec3 sampleLights(vec3 scatterPos, vec3 scatterNormal, out bool visible, out Lig
     // (2) no env & light: skip direct light
     // (3) has env, no light: envSelectPdf = 1.0, analyticSelectPdf = 0.0
     // (4) no env, has light: envSelectPdf = 0.0, analyticSelectPdf = 1.0
-    bool hasEnv = (pc.hasEnvMap == 1 || sunAndSky.in_use == 1);
+    bool hasEnv = (specHasEnvMap == 1 || specUseSunsky == 1);
     bool hasLight = (pc.numLights > 0);
     float envSelectPdf, analyticSelectPdf;
     if (hasEnv && hasLight)
@@ -136,24 +293,29 @@ vec3 sampleLights(vec3 scatterPos, vec3 scatterNormal, out bool visible, out Lig
     else
       envSelectPdf = analyticSelectPdf = 0.f;
 
+    // Lights are sampled from the origin of the shadow ray, which is also
+    // where a reflected bsdf ray leaves. hitLight() evaluates the mis pdf at
+    // that origin.
+    vec3 origin = offsetPositionAlongNormal(scatterPos, scatterNormal);
+
     float envOrAnalyticSelector = rand(payload.pRec.seed);
     if (envOrAnalyticSelector < envSelectPdf) {
       // Sample environment light
       radiance = sampleEnvironmentLight(lRec) / envSelectPdf;
       allowDoubleSide = true;
     } else if (envOrAnalyticSelector < envSelectPdf + analyticSelectPdf) {
-      // Sample analytic light, randomly pick one
-      int lightIndex =
-          min(1 + int(rand(payload.pRec.seed) * pc.numLights), pc.numLights);
+      // Sample analytic light, picked from the light bvh by importance. The
+      // pick is part of the light pdf, hitLight() uses the same for mis.
+      float pickPdf;
+      int lightIndex = sampleLightBvh(origin, rand(payload.pRec.seed), pickPdf);
       GpuLight light = lights.l[lightIndex];
-      radiance = sampleOneLight(rand2(payload.pRec.seed), light, scatterPos,
-                                lRec) *
-            pc.numLights / analyticSelectPdf;
+      radiance = sampleOneLight(rand2(payload.pRec.seed), light, origin, lRec);
+      lRec.pdf *= pickPdf * analyticSelectPdf;
       allowDoubleSide = (light.doubleSide == 1);
     }
 
     // Configure direct light setting by light sample
-    payload.dRec.ray.o = offsetPositionAlongNormal(scatterPos, scatterNormal);
+    payload.dRec.ray.o = origin;
     payload.dRec.ray.d = lRec.d;
     payload.dRec.dist = lRec.dist;
 
@@ -166,8 +328,11 @@ vec3 sampleLights(vec3 scatterPos, vec3 scatterNormal, out bool visible, out Lig
     return radiance;
 }
 
-vec4 textureEval(int texId, vec2 uv) {
-  return texture(textureSamplers[nonuniformEXT(texId)], uv).rgba;
+// Hit shaders have no derivatives, the mip level comes from the ray cone
+vec4 textureEval(int texId, vec2 uv, float lod) {
+  vec2 size = vec2(textureSize(textureSamplers[nonuniformEXT(texId)], 0));
+  lod += 0.5 * log2(size.x * size.y);
+  return textureLod(textureSamplers[nonuniformEXT(texId)], uv, lod).rgba;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,205 @@
+#ifndef RESTIR_GLSL
+#define RESTIR_GLSL
+
+#include "../../shared/restir.h"
+
+// ReSTIR DI for primary hits, after Bitterli et al. 2020. Candidates drawn
+// with the strategies of sampleLights are resampled by their unshadowed
+// contribution, then merged with the reservoirs the previous frame left at
+// this pixel and a few pixels around it. Only the survivor is tested for
+// visibility, by the shadow ray of the raygen shader, which also empties
+// the stored reservoir if it is occluded.
+
+// clang-format off
+layout(set = RtOut, binding = OutputReservoirs, scalar) buffer _Reservoirs { GpuReservoir r[]; } reservoirs[2];
+// clang-format on
+
+uint restirPixelIndex(ivec2 pixel) {
+  return uint(pixel.y) * LAUNCH_SIZE.x + uint(pixel.x);
+}
+
+vec3 evalEnvironmentLight(vec3 d) {
+  if (specUseSunsky == 1)
+    return evalEnvmap(sunskySamplers, mat4(1), 1.0, d);
+  if (specHasEnvMap == 1)
+    return evalEnvmap(envmapSamplers, cameraInfo.envTransform,
+                      pc.envMapIntensity, d);
+  return pc.bgColor;
+}
+
+// Radiance a light sample brings to p, already turned into the measure of
+// its source pdf: area lights carry the cosine at the light over the
+// squared distance. lRec is filled for the shadow ray and the bxdfs.
+vec3 evalRestirSample(int lightId, vec3 lightPos, vec3 p,
+                      out LightSamplingRecord lRec) {
+  lRec.flags = EArea;
+  if (lightId == 0) {
+    lRec.d = lightPos;
+    lRec.n = -lightPos;
+    lRec.dist = INFINITY;
+    return evalEnvironmentLight(lightPos);
+  }
+
+  GpuLight light = lights.l[lightId];
+  if (light.type == LightTypeDirectional) {
+    lRec.d = makeNormal(light.direction);
+    lRec.n = -lRec.d;
+    lRec.dist = INFINITY;
+    lRec.flags = EDelta;
+    return light.radiance;
+  }
+
+  lRec.d = lightPos - p;
+  lRec.dist = length(lRec.d);
+  float distSq = max(lRec.dist * lRec.dist, 1e-8);
+  lRec.d /= lRec.dist + 1e-8;
+  if (light.type == LightTypePoint) {
+    lRec.n = -lRec.d;
+    lRec.flags = EDelta;
+    return light.radiance / (distSq + EPS);
+  }
+  lRec.n = makeNormal(cross(light.u, light.v));
+  float cosLight = dot(lRec.n, lRec.d);
+  // Back of a single sided light
+  if (cosLight >= 0 && light.doubleSide == 0) return vec3(0);
+  return light.radiance * abs(cosLight) / distSq;
+}
+
+// Target function, the unshadowed contribution without the bsdf
+float restirTarget(vec3 radiance, vec3 d, vec3 n) {
+  return dot(radiance, vec3(0.2126, 0.7152, 0.0722)) * max(dot(n, d), 0.0);
+}
+
+// One candidate from the env or the light bvh, picked like sampleLights
+// does. The pdf is per unit area for area lights and per solid angle or
+// discrete otherwise, in step with evalRestirSample.
+float sampleRestirCandidate(vec3 p, float envSelectPdf,
+                            float analyticSelectPdf, out int lightId,
+                            out vec3 lightPos) {
+  LightSamplingRecord lRec;
+  lightId = -1;
+  lightPos = vec3(0);
+  float selector = rand(payload.pRec.seed);
+  if (selector < envSelectPdf) {
+    sampleEnvironmentLight(lRec);
+    lightId = 0;
+    lightPos = lRec.d;
+    return lRec.pdf * envSelectPdf;
+  }
+  if (selector >= envSelectPdf + analyticSelectPdf) return 0.0;
+
+  float pickPdf;
+  lightId = sampleLightBvh(p, rand(payload.pRec.seed), pickPdf);
+  GpuLight light = lights.l[lightId];
+  sampleOneLight(rand2(payload.pRec.seed), light, p, lRec);
+  float pdf = pickPdf * analyticSelectPdf;
+  if (light.type == LightTypeDirectional) return pdf;
+  if (light.type == LightTypePoint) {
+    lightPos = light.position;
+    return pdf;
+  }
+  // Solid angle pdf of the light sample turned into one per unit area
+  lightPos = p + lRec.d * lRec.dist;
+  float cosLight = abs(dot(lRec.n, lRec.d));
+  return pdf * lRec.pdf * cosLight / max(lRec.dist * lRec.dist, 1e-8);
+}
+
+// Stream a sample of weight w standing for M samples into the reservoir
+bool updateReservoir(inout GpuReservoir r, inout float wSum, int lightId,
+                     vec3 lightPos, float w, float M) {
+  wSum += w;
+  r.M += M;
+  if (w <= 0.0 || rand(payload.pRec.seed) * wSum > w) return false;
+  r.lightId = lightId;
+  r.lightPos = lightPos;
+  return true;
+}
+
+// Drop-in for sampleLights at primary hits. The returned radiance already
+// holds the contribution weight, so lRec.pdf is one.
+vec3 sampleLightsRestir(vec3 scatterPos, vec3 scatterNormal, out bool visible,
+                        out LightSamplingRecord lRec) {
+  bool hasEnv = (specHasEnvMap == 1 || specUseSunsky == 1);
+  float analyticSelectPdf = analyticLightSelectPdf();
+  float envSelectPdf = hasEnv ? 1.0 - analyticSelectPdf : 0.0;
+
+  GpuReservoir r;
+  r.lightPos = vec3(0);
+  r.lightId = -1;
+  r.receiverN = scatterNormal;
+  r.receiverDepth = HIT_T;
+  r.W = 0.0;
+  r.M = 0.0;
+  float wSum = 0.0, pHat = 0.0;
+  LightSamplingRecord cRec;
+
+  // Initial candidates
+  for (int i = 0; i < RESTIR_CANDIDATES; i++) {
+    int lightId;
+    vec3 lightPos;
+    float sourcePdf = sampleRestirCandidate(
+        scatterPos, envSelectPdf, analyticSelectPdf, lightId, lightPos);
+    float candidatePHat = 0.0;
+    if (sourcePdf > 0.0)
+      candidatePHat = restirTarget(
+          evalRestirSample(lightId, lightPos, scatterPos, cRec), cRec.d,
+          scatterNormal);
+    float w = sourcePdf > 0.0 ? candidatePHat / sourcePdf : 0.0;
+    if (updateReservoir(r, wSum, lightId, lightPos, w, 1.0))
+      pHat = candidatePHat;
+  }
+
+  // Temporal and spatial reuse from the previous frame. Neighbours on
+  // another surface would bias the result, they are skipped.
+  ivec2 pixel = ivec2(LAUNCH_ID.xy);
+  if (pc.curFrame > 0) {
+    uint prev = uint(pc.curFrame + 1) & 1;
+    ivec2 maxPixel = ivec2(LAUNCH_SIZE.xy) - 1;
+    for (int k = 0; k < RESTIR_NEIGHBOURS; k++) {
+      ivec2 q = pixel;
+      if (k > 0) {
+        vec2 offset = (2.0 * rand2(payload.pRec.seed) - 1.0) * RESTIR_RADIUS;
+        q = clamp(pixel + ivec2(offset), ivec2(0), maxPixel);
+      }
+      GpuReservoir n = reservoirs[prev].r[restirPixelIndex(q)];
+      if (n.M <= 0.0 || dot(n.receiverN, scatterNormal) < 0.9 ||
+          abs(n.receiverDepth - HIT_T) > 0.1 * HIT_T)
+        continue;
+      float neighbourPHat = 0.0;
+      if (n.lightId >= 0)
+        neighbourPHat = restirTarget(
+            evalRestirSample(n.lightId, n.lightPos, scatterPos, cRec), cRec.d,
+            scatterNormal);
+      float M = min(n.M, float(RESTIR_HISTORY * RESTIR_CANDIDATES));
+      if (updateReservoir(r, wSum, n.lightId, n.lightPos,
+                          neighbourPHat * n.W * M, M))
+        pHat = neighbourPHat;
+    }
+  }
+
+  r.W = pHat > 0.0 ? wSum / (r.M * pHat) : 0.0;
+  reservoirs[uint(pc.curFrame) & 1].r[restirPixelIndex(pixel)] = r;
+
+  vec3 radiance = vec3(0);
+  lRec.d = scatterNormal;
+  lRec.n = -scatterNormal;
+  lRec.dist = 0.0;
+  lRec.pdf = 0.0;
+  lRec.flags = EArea;
+  if (r.W > 0.0) {
+    radiance = evalRestirSample(r.lightId, r.lightPos, scatterPos, lRec) * r.W;
+    lRec.pdf = 1.0;
+  }
+
+  // Configure direct light setting by the resampled light
+  payload.dRec.ray.o = offsetPositionAlongNormal(scatterPos, scatterNormal);
+  payload.dRec.ray.d = lRec.d;
+  payload.dRec.dist = lRec.dist;
+
+  // Back sides of single sided lights are already out of the target
+  visible = (dot(lRec.d, scatterNormal) > 0.0 && lRec.pdf > 0.0);
+
+  return radiance;
+}
+
+#endif
@@ -1,29 +1,178 @@
 #ifndef SAMPLE_LIGHT_GLSL
 #define SAMPLE_LIGHT_GLSL
 
+#include "../../shared/envmap.h"
 #include "../../shared/light.h"
 #include "../../shared/sun_and_sky.h"
 #include "math.glsl"
 #include "structs.glsl"
 #include "sun_and_sky.glsl"
 
+// Lights covering less solid angle than this are sampled by area, the
+// spherical mappings lose precision there. Triangles close to a hemisphere
+// are unstable as well.
+#define MIN_SPHERICAL_SOLID_ANGLE 3e-4
+#define MAX_SPHERICAL_SOLID_ANGLE 6.22
+
+// Rectangle seen from o as a spherical rectangle, see "An Area-Preserving
+// Parametrization for Spherical Rectangles" (Urena et al. 2013). The local
+// frame has x and y along the edges and z pointing away from the rectangle.
+struct SphericalRect {
+  vec3 o, x, y, z;
+  float z0, x0, y0, x1, y1;
+  float b0, b1, k;
+  float solidAngle;
+};
+
+SphericalRect makeSphericalRect(vec3 s, vec3 ex, vec3 ey, vec3 o) {
+  SphericalRect rect;
+  float exLen = length(ex), eyLen = length(ey);
+  rect.o = o;
+  rect.x = ex / exLen;
+  rect.y = ey / eyLen;
+  rect.z = cross(rect.x, rect.y);
+  vec3 d = s - o;
+  rect.z0 = dot(d, rect.z);
+  if (rect.z0 > 0) {
+    rect.z = -rect.z;
+    rect.z0 = -rect.z0;
+  }
+  rect.x0 = dot(d, rect.x);
+  rect.y0 = dot(d, rect.y);
+  rect.x1 = rect.x0 + exLen;
+  rect.y1 = rect.y0 + eyLen;
+
+  // Normals of the planes through o and every edge, then the inner angles
+  vec3 v00 = vec3(rect.x0, rect.y0, rect.z0);
+  vec3 v01 = vec3(rect.x0, rect.y1, rect.z0);
+  vec3 v10 = vec3(rect.x1, rect.y0, rect.z0);
+  vec3 v11 = vec3(rect.x1, rect.y1, rect.z0);
+  vec3 n0 = makeNormal(cross(v00, v10));
+  vec3 n1 = makeNormal(cross(v10, v11));
+  vec3 n2 = makeNormal(cross(v11, v01));
+  vec3 n3 = makeNormal(cross(v01, v00));
+  float g0 = acos(clamp(-dot(n0, n1), -1.0, 1.0));
+  float g1 = acos(clamp(-dot(n1, n2), -1.0, 1.0));
+  float g2 = acos(clamp(-dot(n2, n3), -1.0, 1.0));
+  float g3 = acos(clamp(-dot(n3, n0), -1.0, 1.0));
+  rect.b0 = n0.z;
+  rect.b1 = n2.z;
+  rect.k = TWO_PI - g2 - g3;
+  rect.solidAngle = g0 + g1 - rect.k;
+  return rect;
+}
+
+// Point on the rectangle, uniform in solid angle
+vec3 sampleSphericalRect(SphericalRect rect, vec2 r) {
+  // Column from the solid angle to the left of it
+  float au = r.x * rect.solidAngle + rect.k;
+  float fu = (cos(au) * rect.b0 - rect.b1) / sin(au);
+  float cu = clamp(sign(fu) / sqrt(fu * fu + rect.b0 * rect.b0), -1.0, 1.0);
+  float xu = -(cu * rect.z0) / max(sqrt(1.0 - cu * cu), 1e-8);
+  xu = clamp(xu, rect.x0, rect.x1);
+  // Row, uniform in the projected height of the column
+  float dist = sqrt(xu * xu + rect.z0 * rect.z0);
+  float h0 = rect.y0 / sqrt(dist * dist + rect.y0 * rect.y0);
+  float h1 = rect.y1 / sqrt(dist * dist + rect.y1 * rect.y1);
+  float hv = h0 + r.y * (h1 - h0);
+  float yv = hv * hv < 1.0 - 1e-6 ? (hv * dist) / sqrt(1.0 - hv * hv) : rect.y1;
+  return rect.o + xu * rect.x + yv * rect.y + rect.z0 * rect.z;
+}
+
+// Solid angle of the triangle abc seen from o, see "Stratified Sampling of
+// Spherical Triangles" (Arvo 1995)
+float sphericalTriangleSolidAngle(vec3 a, vec3 b, vec3 c) {
+  return abs(2.0 * atan(dot(a, cross(b, c)),
+                        1.0 + dot(a, b) + dot(a, c) + dot(b, c)));
+}
+
+// Direction to a point of the spherical triangle abc, uniform in solid angle
+vec3 sampleSphericalTriangle(vec3 a, vec3 b, vec3 c, vec2 r) {
+  vec3 nab = makeNormal(cross(a, b));
+  vec3 nbc = makeNormal(cross(b, c));
+  vec3 nca = makeNormal(cross(c, a));
+  float alpha = acos(clamp(-dot(nab, nca), -1.0, 1.0));
+  float beta = acos(clamp(-dot(nbc, nab), -1.0, 1.0));
+  float gamma = acos(clamp(-dot(nca, nbc), -1.0, 1.0));
+
+  // Sub-triangle ab'c' holding the fraction r.x of the solid angle
+  float areaPi = mix(PI, alpha + beta + gamma, r.x);
+  float cosAlpha = cos(alpha), sinAlpha = sin(alpha);
+  float sinPhi = sin(areaPi) * cosAlpha - cos(areaPi) * sinAlpha;
+  float cosPhi = cos(areaPi) * cosAlpha + sin(areaPi) * sinAlpha;
+  float k1 = cosPhi + cosAlpha;
+  float k2 = sinPhi - sinAlpha * dot(a, b);
+  float cosBp = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) /
+                ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+  cosBp = clamp(cosBp, -1.0, 1.0);
+  float sinBp = safeSqrt(1.0 - cosBp * cosBp);
+  vec3 cp = cosBp * a + sinBp * makeNormal(c - dot(c, a) * a);
+
+  // Then along the arc from b to c'
+  float cosTheta = 1.0 - r.y * (1.0 - dot(cp, b));
+  float sinTheta = safeSqrt(1.0 - cosTheta * cosTheta);
+  return cosTheta * b + sinTheta * makeNormal(cp - dot(cp, b) * b);
+}
+
+bool useSphericalSampling(float solidAngle) {
+  return solidAngle > MIN_SPHERICAL_SOLID_ANGLE &&
+         solidAngle < MAX_SPHERICAL_SOLID_ANGLE;
+}
+
+// Solid angle the rect or triangle light covers from scatterPos
+float areaLightSolidAngle(GpuLight light, vec3 scatterPos) {
+  if (light.type == LightTypeRect)
+    return makeSphericalRect(light.position, light.u, light.v, scatterPos)
+        .solidAngle;
+  vec3 a = makeNormal(light.position - scatterPos);
+  vec3 b = makeNormal(light.position + light.u - scatterPos);
+  vec3 c = makeNormal(light.position + light.v - scatterPos);
+  return sphericalTriangleSolidAngle(a, b, c);
+}
+
+// Solid angle pdf of sampleOneLight reaching lightPos on a rect or triangle
+// light, for mis with bsdf sampling
+float pdfAreaLight(GpuLight light, vec3 scatterPos, vec3 lightPos) {
+  float solidAngle = areaLightSolidAngle(light, scatterPos);
+  if (useSphericalSampling(solidAngle)) return 1.0 / solidAngle;
+  vec3 d = lightPos - scatterPos;
+  float distSq = dot(d, d);
+  vec3 n = makeNormal(cross(light.u, light.v));
+  return distSq / (light.area * abs(dot(n, d)) * inversesqrt(distSq) + EPS);
+}
+
 vec3 sampleTriangleLight(vec2 r, GpuLight light, vec3 scatterPos,
                          inout LightSamplingRecord lRec) {
-  float r1 = r.x;
-  float r2 = (1 - r1) * r.y;
-  vec3 radiance = vec3(0);
+  vec3 v0 = light.position;
+  vec3 v1 = light.position + light.u;
+  vec3 v2 = light.position + light.v;
+  lRec.n = makeNormal(cross(light.u, light.v));
+  lRec.flags = EArea;
 
-  vec3 lightSurfacePos = light.position + light.u * r1 + light.v * r2;
+  vec3 a = makeNormal(v0 - scatterPos);
+  vec3 b = makeNormal(v1 - scatterPos);
+  vec3 c = makeNormal(v2 - scatterPos);
+  float solidAngle = sphericalTriangleSolidAngle(a, b, c);
+  if (useSphericalSampling(solidAngle)) {
+    lRec.d = sampleSphericalTriangle(a, b, c, r);
+    // Distance to the plane of the triangle along the sampled direction
+    float cosLight = dot(lRec.n, lRec.d);
+    lRec.dist = abs(cosLight) > 0.0 ? dot(v0 - scatterPos, lRec.n) / cosLight
+                                    : 0.0;
+    lRec.pdf = lRec.dist > 0.0 ? 1.0 / solidAngle : 0.0;
+    return light.radiance;
+  }
+
+  // Uniform in area
+  float su = sqrt(r.x);
+  vec3 lightSurfacePos = v0 + light.u * (1.0 - su) + light.v * (r.y * su);
   lRec.d = lightSurfacePos - scatterPos;
   lRec.dist = length(lRec.d);
   float distSq = lRec.dist * lRec.dist;
   lRec.d /= lRec.dist;
-  lRec.n = makeNormal(cross(light.u, light.v));
-  radiance = light.radiance;
   lRec.pdf = distSq / (light.area * abs(dot(lRec.n, lRec.d)) + EPS);
-  lRec.flags = EArea;
 
-  return radiance;
+  return light.radiance;
 }
 
 vec3 sampleDistantLight(in GpuLight light, in vec3 scatterPos,
@@ -52,22 +201,28 @@ vec3 samplePointLight(in GpuLight light, in vec3 scatterPos,
 
 vec3 sampleRectLight(vec2 r, GpuLight light, vec3 scatterPos,
                      out LightSamplingRecord lRec) {
-  float r1 = r.x;
-  float r2 = r.y;
-  vec3 radiance = vec3(0);
+  lRec.n = makeNormal(cross(light.u, light.v));
+  lRec.flags = EArea;
 
-  vec3 lightSurfacePos = light.position + light.u * r1 + light.v * r2;
+  SphericalRect rect =
+      makeSphericalRect(light.position, light.u, light.v, scatterPos);
+  vec3 lightSurfacePos;
+  if (useSphericalSampling(rect.solidAngle))
+    lightSurfacePos = sampleSphericalRect(rect, r);
+  else
+    lightSurfacePos = light.position + light.u * r.x + light.v * r.y;
   lRec.d = lightSurfacePos - scatterPos;
   lRec.dist = length(lRec.d);
   float distSq = lRec.dist * lRec.dist;
   lRec.d /= lRec.dist;
-  lRec.n = makeNormal(cross(light.u, light.v));
-  radiance = light.radiance;
-  lRec.pdf = distSq / (light.area * abs(dot(lRec.n, lRec.d)) + EPS);
-  lRec.flags = EArea;
+  if (useSphericalSampling(rect.solidAngle))
+    lRec.pdf = 1.0 / rect.solidAngle;
+  else
+    lRec.pdf = distSq / (light.area * abs(dot(lRec.n, lRec.d)) + EPS);
 
-  return radiance;
+  return light.radiance;
 }
+
 vec3 sampleOneLight(vec2 r, GpuLight light, vec3 scatterPos,
                     inout LightSamplingRecord lRec) {
   int type = int(light.type);
@@ -81,14 +236,44 @@ vec3 sampleOneLight(vec2 r, GpuLight light, vec3 scatterPos,
     return sampleTriangleLight(r, light, scatterPos, lRec);
 }
 
+// clang-format off
+layout(set = RtEnv, binding = EnvAliasTable, scalar) readonly buffer _EnvAlias { GpuEnvAlias a[]; } envAlias;
+// clang-format on
+
+// Pick one of n cells from the alias table at offset. u is reused: it
+// returns as a uniform position inside the picked cell.
+uint sampleAlias(uint offset, uint n, inout float u) {
+  float fu = min(u, 0.99999) * n;
+  uint i = min(uint(fu), n - 1);
+  u = fu - i;
+  GpuEnvAlias cell = envAlias.a[offset + i];
+  if (u < cell.prob) {
+    u /= cell.prob;
+    return i;
+  }
+  u = (u - cell.prob) / (1.0 - cell.prob);
+  return cell.alias;
+}
+
+float pdfEnvmapAlias(vec2 uv, vec2 hdrResolution) {
+  uint w = uint(hdrResolution.x), h = uint(hdrResolution.y);
+  uint row = min(uint(uv.y * h), h - 1);
+  uint col = min(uint(uv.x * w), w - 1);
+  return envAlias.a[row].pdf * envAlias.a[h + row * w + col].pdf;
+}
+
 float pdfEnvmap(in sampler2D envmapSamplers[3], in mat4 envTransform,
-                in vec2 hdrResolution, in vec3 L) {
+                in vec2 hdrResolution, in uint aliasTable, in vec3 L) {
   L = transformDirection(transpose(envTransform), L);
 
   float theta = acos(clamp(L.y, -1.0, 1.0));
   vec2 uv = vec2((PI + atan(L.z, L.x)) * INV_2PI, theta * INV_PI);
-  float pdf = texture(envmapSamplers[2], uv).y *
-              texture(envmapSamplers[1], vec2(0., uv.y)).y;
+  float pdf;
+  if (aliasTable == 1)
+    pdf = pdfEnvmapAlias(uv, hdrResolution);
+  else
+    pdf = texture(envmapSamplers[2], uv).y *
+          texture(envmapSamplers[1], vec2(0., uv.y)).y;
   float sinTheta = sin(theta);
   if (sinTheta == 0) return 0;
   return (pdf * hdrResolution.x * hdrResolution.y) / (TWO_PI * PI * sinTheta);
@@ -104,17 +289,26 @@ vec3 evalEnvmap(in sampler2D envmapSamplers[3], in mat4 envTransform,
 }
 
 vec3 sampleEnvmap(vec2 r, sampler2D envmapSamplers[3], mat4 envTransform,
-                  vec2 hdrResolution, float intensity, out vec3 L,
-                  out float pdf) {
+                  vec2 hdrResolution, uint aliasTable, float intensity,
+                  out vec3 L, out float pdf) {
   float r1 = r.x;
   float r2 = r.y;
 
   vec2 uv;
-  uv.y = texture(envmapSamplers[1], vec2(0., r1)).x;    // marginal
-  uv.x = texture(envmapSamplers[2], vec2(r2, uv.y)).x;  // conditional
+  if (aliasTable == 1) {
+    // Row from the marginal table, then column from the table of the row
+    uint w = uint(hdrResolution.x), h = uint(hdrResolution.y);
+    uint row = sampleAlias(0, h, r1);
+    uint col = sampleAlias(h + row * w, w, r2);
+    uv = vec2((col + r2) / w, (row + r1) / h);
+    pdf = envAlias.a[row].pdf * envAlias.a[h + row * w + col].pdf;
+  } else {
+    uv.y = texture(envmapSamplers[1], vec2(0., r1)).x;    // marginal
+    uv.x = texture(envmapSamplers[2], vec2(r2, uv.y)).x;  // conditional
 
-  pdf = texture(envmapSamplers[2], uv).y *
-        texture(envmapSamplers[1], vec2(0., uv.y)).y;
+    pdf = texture(envmapSamplers[2], uv).y *
+          texture(envmapSamplers[1], vec2(0., uv.y)).y;
+  }
 
   float phi = uv.x * TWO_PI;
   float theta = uv.y * PI;
@@ -134,10 +328,4 @@ vec3 sampleBackGround(vec2 u, vec3 bgColor, out vec3 L, out float pdf) {
   return bgColor;
 }
 
-vec3 sampleSunSky(vec2 u, GpuSunAndSky sk, out vec3 L, out float pdf) {
-  L = uniformSampleSphere(u);
-  pdf = uniformSpherePdf();
-  return sun_and_sky(sk, L);
-}
-
 #endif
\ No newline at end of file
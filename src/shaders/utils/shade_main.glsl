@@ -0,0 +1,81 @@
+#ifndef SHADE_MAIN_GLSL
+#define SHADE_MAIN_GLSL
+
+// Entry point of a bxdf, included right after its shade(). The ray tracing
+// pipeline runs it as a closest hit shader. Built with WAVEFRONT_SHADE it
+// is a compute kernel of the wavefront integrator over the paths sorted
+// into its hit group.
+
+// Multi-channel output of the primary hit of the centered sample. Misses
+// leave the images cleared, see the miss shader and the generate kernel.
+void storeMultiChannel() {
+  if (!isMultiChannelSample(payload.pRec, pc.curFrame)) return;
+  for (uint cid = 0; cid < specNumMultiChannel; cid++)
+    imageStore(images[cid + 1], ivec2(LAUNCH_ID.xy),
+               vec4(mRec.channel[cid], 1.f));
+}
+
+#ifdef WAVEFRONT_SHADE
+// clang-format off
+layout(constant_id = 0) const uint hitGroup = 0;
+layout(local_size_x = WAVEFRONT_GROUP_SIZE) in;
+// clang-format on
+
+void main() {
+  uint slot = gl_GlobalInvocationID.x;
+  if (slot >= counters.numHits[hitGroup]) return;
+  uint pathId = shadeQueue.q[counters.hitOffset[hitGroup] + slot];
+
+  WavefrontPath path = paths.p[pathId];
+  GpuWavefrontHit hit = hits.h[pathId];
+  payload.pRec = path.pRec;
+  payload.bRec = path.bRec;
+  payload.dRec = path.dRec;
+  for (int i = 0; i < NUM_OUTPUT_IMAGES - 1; i++) mRec.channel[i] = vec3(0.0);
+
+  // What the hit shader builtins would hold
+  _bary = hit.bary;
+  wfObjectToWorld = transpose(mat3x4(hit.objectToWorld[0],
+                                     hit.objectToWorld[1],
+                                     hit.objectToWorld[2]));
+  mat3 linear = inverse(mat3(wfObjectToWorld));
+  wfWorldToObject = mat4x3(linear[0], linear[1], linear[2],
+                           -linear * wfObjectToWorld[3]);
+  wfRayDirection = payload.pRec.ray.d;
+  wfHitT = hit.t;
+  wfInstanceId = hit.instanceId;
+  wfPrimitiveId = hit.primitiveId;
+  wfLaunchId = uvec3(wavefrontPixel(pathId), 0);
+  wfLaunchSize = uvec3(counters.width, counters.height, 1);
+
+  shade();
+  storeMultiChannel();
+
+  if (!payload.dRec.skip)
+    shadowQueue.q[atomicAdd(counters.numShadowRays, 1)] = pathId;
+
+  if (!payload.pRec.stop) {
+    // Rough lobes widen the ray cone, as in the raygen shader
+    if (isNonSpecular(payload.bRec.flags))
+      payload.pRec.coneSpread +=
+          2.f * sqrt(1.f / (PI * max(payload.bRec.pdf, EPS)));
+    uint nextDepth = payload.pRec.depth + 1;
+    if (nextDepth <= pc.maxPathDepth)
+      rayQueue.q[wavefrontRaySlot(
+          nextDepth, atomicAdd(counters.numNextRays, 1))] = pathId;
+  }
+
+  path.pRec = payload.pRec;
+  path.bRec = payload.bRec;
+  path.dRec = payload.dRec;
+  paths.p[pathId] = path;
+}
+#else
+void main() {
+  for (int i = 0; i < NUM_OUTPUT_IMAGES - 1; i++) mRec.channel[i] = vec3(0.0);
+  shade();
+  storeMultiChannel();
+}
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef SPECIALIZATION_GLSL
+#define SPECIALIZATION_GLSL
+
+#include "../../shared/camera.h"
+#include "../../shared/specialization.h"
+
+// Copies of the push constant fields and sunAndSky.in_use the pipeline is
+// built with, so the paths of unused features are compiled out. Pipeline
+// variants are cached per value, see SpecKey.
+// clang-format off
+layout(constant_id = SpecConstantHasEnvMap)           const uint specHasEnvMap           = 0;
+layout(constant_id = SpecConstantUseSunsky)           const uint specUseSunsky           = 0;
+layout(constant_id = SpecConstantNumMultiChannel)     const uint specNumMultiChannel     = 0;
+layout(constant_id = SpecConstantDiffuseOutChannel)   const int  specDiffuseOutChannel   = -1;
+layout(constant_id = SpecConstantSpecularOutChannel)  const int  specSpecularOutChannel  = -1;
+layout(constant_id = SpecConstantRoughnessOutChannel) const int  specRoughnessOutChannel = -1;
+layout(constant_id = SpecConstantNormalOutChannel)    const int  specNormalOutChannel    = -1;
+layout(constant_id = SpecConstantPositionOutChannel)  const int  specPositionOutChannel  = -1;
+layout(constant_id = SpecConstantTangentOutChannel)   const int  specTangentOutChannel   = -1;
+layout(constant_id = SpecConstantUvOutChannel)        const int  specUvOutChannel        = -1;
+layout(constant_id = SpecConstantUseFaceNormal)       const uint specUseFaceNormal       = 0;
+layout(constant_id = SpecConstantCameraType)          const uint specCameraType          = CameraTypePerspective;
+// clang-format on
+
+#endif
@@ -76,8 +76,16 @@ struct PathRecord {
   uint depth;
   uint seed;
   bool stop;
+  // Sample of the pixel within the launch
+  uint sampleId;
+  // Ray cone for texture lod selection: footprint width at the ray origin
+  // and spread angle
+  float coneWidth;
+  float coneSpread;
 };
 
+// Multi-channel output of a primary hit. Closest hits fill it and store it
+// to the output images themselves, it is not part of the payload.
 struct MultiChannelRecord {
   vec3 channel[NUM_OUTPUT_IMAGES-1];
 };
@@ -85,8 +93,13 @@ struct MultiChannelRecord {
 struct RayPayload {
   PathRecord pRec;
   BsdfSamplingRecord bRec;
-  MultiChannelRecord mRec;
   DirectLightRecord dRec;
 };
 
+// Primary ray of the first sample of frame 0, which goes through the pixel
+// center. Only it writes or clears the multi-channel output.
+bool isMultiChannelSample(PathRecord pRec, int curFrame) {
+  return pRec.depth == 1 && pRec.sampleId == 0 && curFrame == 0;
+}
+
 #endif
\ No newline at end of file
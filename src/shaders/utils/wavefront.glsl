@@ -0,0 +1,40 @@
+#ifndef WAVEFRONT_GLSL
+#define WAVEFRONT_GLSL
+
+#include "../../shared/wavefront.h"
+#include "structs.glsl"
+
+// State of a path between the wavefront kernels: the payload of the
+// megakernel without its multi-channel record, which the shading kernels
+// write out right away
+struct WavefrontPath {
+  PathRecord pRec;
+  BsdfSamplingRecord bRec;
+  DirectLightRecord dRec;
+  // Position of the camera ray inside its pixel, for the filter
+  vec2 jitter;
+};
+
+// clang-format off
+layout(set = WfQueues, binding = WavefrontCounters, scalar) buffer _WfCounters { GpuWavefrontCounters counters; };
+layout(set = WfQueues, binding = WavefrontPaths, scalar)    buffer _WfPaths    { WavefrontPath p[];    } paths;
+layout(set = WfQueues, binding = WavefrontHits, scalar)     buffer _WfHits     { GpuWavefrontHit h[];  } hits;
+layout(set = WfQueues, binding = WavefrontRayQueue)         buffer _WfRays     { uint q[];             } rayQueue;
+layout(set = WfQueues, binding = WavefrontShadeQueue)       buffer _WfShade    { uint q[];             } shadeQueue;
+layout(set = WfQueues, binding = WavefrontShadowQueue)      buffer _WfShadow   { uint q[];             } shadowQueue;
+// clang-format on
+
+// One path per pixel, paths are indexed like the pixels
+uint wavefrontNumPaths() { return counters.width * counters.height; }
+
+ivec2 wavefrontPixel(uint pathId) {
+  return ivec2(pathId % counters.width, pathId / counters.width);
+}
+
+// Paths to intersect at a depth live in the half of the ray queue its
+// parity selects, the shading kernels fill the other one
+uint wavefrontRaySlot(uint depth, uint slot) {
+  return (depth & 1) * wavefrontNumPaths() + slot;
+}
+
+#endif
@@ -34,6 +34,12 @@ START_ENUM(RtBindSet)
   RtNum   = 4
 END_ENUM();
 
+// Wavefront kernels bind the ray tracing sets and their own queues
+START_ENUM(WfBindSet)
+  WfQueues = 4,  // Path states and work queues
+  WfNum    = 5
+END_ENUM();
+
 START_ENUM(PostBindSet)
   PostInput = 0,
   PostNum   = 1
@@ -46,7 +52,8 @@ END_ENUM();
 
 // Output image - Set 1
 START_ENUM(OutputBindings)
-  OutputStore   = 0  // As storage
+  OutputStore      = 0,  // As storage
+  OutputReservoirs = 1   // ReSTIR DI reservoirs, current and previous frame
 END_ENUM();
 
 // Scene Data - Set 2
@@ -54,13 +61,34 @@ START_ENUM(SceneBindings)
   SceneCamera    = 0, 
   SceneInstances = 1, 
   SceneLights    = 2,            
-  SceneTextures  = 3  // must be last elem            
+  SceneEmitters  = 3,  // light id of every emissive primitive
+  SceneMaterials = 4,
+  SceneLightBvh  = 5,  // see GpuLightBvhNode
+  SceneTextures  = 6  // must be last elem            
 END_ENUM();
 
 // Environment - Set 3
 START_ENUM(EnvBindings)
   EnvSunsky = 0,
-  EnvAccelMap = 1
+  EnvAccelMap = 1,
+  EnvAliasTable = 2,  // envmap alias tables, see GpuEnvAlias
+  EnvSunskyMap = 3    // baked sun and sky with its sampling tables
+END_ENUM();
+
+// Sun and sky bake, compute only
+START_ENUM(SunskyBakeBindings)
+  SunskyBakeParams = 0,
+  SunskyBakeMaps   = 1  // radiance, marginal, conditional
+END_ENUM();
+
+// Wavefront queues - Set 4
+START_ENUM(WavefrontBindings)
+  WavefrontCounters    = 0,  // see GpuWavefrontCounters
+  WavefrontPaths       = 1,
+  WavefrontHits        = 2,
+  WavefrontRayQueue    = 3,  // paths to intersect, two halves by depth
+  WavefrontShadeQueue  = 4,  // paths sorted by hit group
+  WavefrontShadowQueue = 5
 END_ENUM();
 
 START_ENUM(InputBindings)
@@ -0,0 +1,18 @@
+#ifndef ENVMAP_H
+#define ENVMAP_H
+
+#include "binding.h"
+
+// One cell of an alias table for sampling the environment map. The first
+// height entries sample a row, then every row has width entries for its
+// columns.
+struct GpuEnvAlias {
+  // Probability of keeping this cell instead of its alias
+  float prob;
+  // Cell chosen otherwise
+  uint alias;
+  // Normalized probability of this cell, for pdf evaluation
+  float pdf;
+};
+
+#endif
@@ -5,14 +5,19 @@
 
 // Information of a obj model when referenced in a shader
 struct GpuInstance {
-  // Address of the Vertex buffer
+  // Address of the Vertex buffer (position stream for compact meshes)
   uint64_t vertexAddress;
+  // Address of the attribute buffer (compact meshes only)
+  uint64_t attribAddress;
   // Address of the index buffer
   uint64_t indexAddress;
-  // Address of the material buffer
-  uint64_t materialAddress;
-  // light index
-  int lightId;
+  // Index into the material table
+  uint materialId;
+  // Offset into the per-primitive emitter table, -1 if not an emitter
+  int emitterOffset;
+  // VertexFormat flags
+  uint vertexFormat;
+  uint padding;
 };
 
 // SceneDesc = GPUMeshDesc[] + GPUMaterialDesc[]
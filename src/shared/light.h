@@ -22,6 +22,22 @@ struct GpuLight {
   float radius;
   float area;
   uint doubleSide;
+  int bvhLeaf;  // node of the light in the light bvh, -1 if not in it
+};
+
+// Node of the light bvh. Bounds the positions, the power and the emitted
+// directions of all lights below it. Nodes above directional lights only
+// have empty bounds.
+struct GpuLightBvhNode {
+  vec3 boundsMin;
+  float power;
+  vec3 boundsMax;
+  float cosTheta0;  // spread of the emitter normals around the axis
+  vec3 axis;
+  float cosThetaE;  // spread of the emission around every normal
+  int child;        // left child, the right one follows it, -1 for leaves
+  int parent;       // -1 for the root
+  int lightId;      // light of a leaf
 };
 
 #endif
\ No newline at end of file
@@ -31,6 +31,10 @@ struct GpuPushConstantRaytrace {
   int tangentOutChannel;
 
   int uvOutChannel;
+  // Sample the envmap from its alias tables instead of the inverted cdfs
+  uint envMapAliasTable;
+  // Resample direct light at primary hits across pixels and frames
+  uint restirDI;
 };
 
 // clang-format off
@@ -0,0 +1,32 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "binding.h"
+
+// Light samples streamed into the reservoir of a primary hit
+#define RESTIR_CANDIDATES 8
+// Reservoirs of the previous frame merged in, the first is the same pixel
+#define RESTIR_NEIGHBOURS 3
+// Pixel radius the other neighbours are picked in
+#define RESTIR_RADIUS 16
+// Cap of the merged sample count, in units of RESTIR_CANDIDATES
+#define RESTIR_HISTORY 20
+
+// Reservoir of one pixel holding a single light sample for direct
+// illumination. Kept across frames for reuse.
+struct GpuReservoir {
+  // Point on the light, or the direction to it for distant lights and the
+  // environment
+  vec3 lightPos;
+  // 0 for the environment, -1 if the reservoir is empty
+  int lightId;
+  // Primary hit the sample was resampled for, neighbours far from it are
+  // not reused
+  vec3 receiverN;
+  float receiverDepth;
+  // Unbiased contribution weight and number of samples seen
+  float W;
+  float M;
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SPECIALIZATION_H
+#define SPECIALIZATION_H
+
+#include "binding.h"
+
+// clang-format off
+// Scene features the integrator shaders are specialized on, see
+// utils/specialization.glsl. Ids below SpecConstantFirst are left to the
+// kernels of the wavefront integrator.
+START_ENUM(SpecConstant)
+  SpecConstantHasEnvMap           = 8,
+  SpecConstantUseSunsky           = 9,   // sunAndSky.in_use
+  SpecConstantNumMultiChannel     = 10,
+  SpecConstantDiffuseOutChannel   = 11,
+  SpecConstantSpecularOutChannel  = 12,
+  SpecConstantRoughnessOutChannel = 13,
+  SpecConstantNormalOutChannel    = 14,
+  SpecConstantPositionOutChannel  = 15,
+  SpecConstantTangentOutChannel   = 16,
+  SpecConstantUvOutChannel        = 17,
+  SpecConstantUseFaceNormal       = 18,
+  SpecConstantCameraType          = 19,
+  SpecConstantFirst               = 8,
+  SpecConstantNum                 = 12
+END_ENUM();
+// clang-format on
+
+#endif
@@ -3,6 +3,21 @@
 
 #include "binding.h"
 
+// Resolution of the baked equirectangular sun and sky, every texel averages
+// SUNSKY_BAKE_SUBSAMPLES^2 evaluations of the model
+#define SUNSKY_BAKE_WIDTH 1024
+#define SUNSKY_BAKE_HEIGHT 512
+#define SUNSKY_BAKE_SUBSAMPLES 2
+#define SUNSKY_BAKE_RESOLUTION vec2(SUNSKY_BAKE_WIDTH, SUNSKY_BAKE_HEIGHT)
+
+// clang-format off
+START_ENUM(SunskyBakeStage)
+  SunskyBakeRadiance = 0,
+  SunskyBakeRows     = 1,
+  SunskyBakeMarginal = 2
+END_ENUM();
+// clang-format on
+
 struct GpuSunAndSky {
   vec3 rgb_unit_conversion;
   float multiplier;
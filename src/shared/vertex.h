@@ -10,4 +10,23 @@ struct GpuVertex {
   vec3 tangent;
 };
 
+// Attribute stream of compact meshes, positions live in their own stream
+struct GpuVertexAttrib {
+  uint normal;   // octahedral, snorm16x2
+  uint tangent;  // octahedral, snorm16x2
+  uint uv;       // half2x16
+};
+
+// clang-format off
+START_ENUM(VertexFormat)
+  VertexFormatFull    = 0,  // interleaved GpuVertex and 32-bit indices
+  VertexFormatCompact = 1,  // vec3 position + GpuVertexAttrib streams
+  VertexFormatIndex16 = 2   // indices packed as 16-bit, two per uint
+END_ENUM();
+// clang-format on
+
+// Encoded zero vector, never produced for unit vectors since snorm16
+// encoding clamps to [-32767, 32767]
+#define OCT_ZERO_VECTOR 0x80008000u
+
 #endif
\ No newline at end of file
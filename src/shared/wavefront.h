@@ -0,0 +1,61 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "binding.h"
+#include "material.h"
+
+// Threads per group of every wavefront kernel
+#define WAVEFRONT_GROUP_SIZE 64
+// Upper bound of the scalar size of WavefrontPath in wavefront.glsl
+#define WAVEFRONT_PATH_SIZE 160
+
+// clang-format off
+// Kernels of wavefront.integrator.comp, picked by specialization constant.
+// The shading kernels are the closest hit shaders compiled for compute.
+START_ENUM(WavefrontStage)
+  WavefrontStageGenerate  = 0,  // camera rays of all pixels
+  WavefrontStageIntersect = 1,  // closest hits, counted per hit group
+  WavefrontStageSort      = 2,  // hits grouped by hit group
+  WavefrontStageShade     = 3,  // one kernel per hit group
+  WavefrontStageShadow    = 4,  // shadow rays of all shaded paths
+  WavefrontStageResolve   = 5,  // samples accumulated into the output
+  WavefrontStageSchedule  = 6,  // indirect arguments, single invocation
+  WavefrontStageNum       = 7
+END_ENUM();
+
+// What WavefrontStageSchedule prepares
+START_ENUM(WavefrontSchedule)
+  WavefrontScheduleShade  = 0,  // offsets and arguments of the shade queues
+  WavefrontScheduleShadow = 1,  // arguments of the shadow rays
+  WavefrontScheduleNext   = 2   // next depth from the continued paths
+END_ENUM();
+// clang-format on
+
+// Closest hit of a path, the hit shader builtins in the shading kernels
+struct GpuWavefrontHit {
+  vec4 objectToWorld[3];  // rows of the instance transform
+  vec2 bary;
+  float t;
+  int instanceId;
+  int primitiveId;
+  uint hitGroup;  // MaterialTypeNum if the ray left the scene
+};
+
+// Queue sizes of the current depth, also the indirect dispatch arguments of
+// the kernels processing them
+struct GpuWavefrontCounters {
+  uint width;  // size of the film, one path per pixel
+  uint height;
+  uint depth;
+  uint numRays;        // paths to intersect
+  uint numNextRays;    // paths the shading kernels continue
+  uint numShadowRays;  // shadow rays the shading kernels queued
+  uint numHits[MaterialTypeNum];
+  uint hitOffset[MaterialTypeNum];  // first slot of a hit group
+  uint hitCursor[MaterialTypeNum];  // slots taken while sorting
+  uint intersectArgs[3];
+  uint shadowArgs[3];
+  uint shadeArgs[MaterialTypeNum * 3];
+};
+
+#endif
@@ -585,8 +585,7 @@ void DenoiserOptix::createCopyPipeline() {
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
     stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
     stageInfo.module = nvvk::createShaderModule(
-        m_device, nvh::loadFile("../shaders/post.img2buffer.comp.spv", true,
-                                {m_pContext->getRoot()}));
+        m_device, m_pContext->loadShader("shaders/post.img2buffer.comp.spv"));
     stageInfo.pName = "main";
 
     VkComputePipelineCreateInfo compInfo{
@@ -594,8 +593,8 @@ void DenoiserOptix::createCopyPipeline() {
     compInfo.layout = m_pipelines[SHD].layout;
     compInfo.stage = stageInfo;
 
-    vkCreateComputePipelines(m_device, {}, 1, &compInfo, nullptr,
-                             &m_pipelines[SHD].p);
+    vkCreateComputePipelines(m_device, m_pContext->getPipelineCache(), 1,
+                             &compInfo, nullptr, &m_pipelines[SHD].p);
     NAME_VK(m_pipelines[SHD].p);
 
     vkDestroyShaderModule(m_device, compInfo.stage.module, nullptr);
@@ -628,8 +627,7 @@ void DenoiserOptix::createCopyPipeline() {
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
     stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
     stageInfo.module = nvvk::createShaderModule(
-        m_device, nvh::loadFile("../shaders/post.buffer2img.comp.spv", true,
-                                {m_pContext->getRoot()}));
+        m_device, m_pContext->loadShader("shaders/post.buffer2img.comp.spv"));
     stageInfo.pName = "main";
 
     VkComputePipelineCreateInfo compInfo{
@@ -637,8 +635,8 @@ void DenoiserOptix::createCopyPipeline() {
     compInfo.layout = m_pipelines[SHD].layout;
     compInfo.stage = stageInfo;
 
-    vkCreateComputePipelines(m_device, {}, 1, &compInfo, nullptr,
-                             &m_pipelines[SHD].p);
+    vkCreateComputePipelines(m_device, m_pContext->getPipelineCache(), 1,
+                             &compInfo, nullptr, &m_pipelines[SHD].p);
     NAME_VK(m_pipelines[SHD].p);
 
     vkDestroyShaderModule(m_device, compInfo.stage.module, nullptr);
@@ -252,9 +252,28 @@ bool Tracer::guiPathTracer() {
   auto& pc = m_pipelineRaytrace.getPushconstant();
   changed |= ImGui::Checkbox("Use Face Normal", (bool*)&pc.useFaceNormal);
   changed |= ImGui::Checkbox("Ignore Emissive", (bool*)&pc.ignoreEmissive);
+  if (m_pipelineRaytrace.hasWavefront()) {
+    changed |= ImGui::Checkbox("Wavefront", &m_pipelineRaytrace.useWavefront());
+    if (m_pipelineRaytrace.useWavefront()) guiWavefrontStats();
+  }
   return changed;
 }
 
+void Tracer::guiWavefrontStats() {
+  static const char* stageNames[WavefrontStageNum] = {
+      "Generate", "Intersect", "Sort",    "Shade",
+      "Shadow",   "Resolve",   "Schedule"};
+  auto& stats = m_pipelineRaytrace.getWavefrontStats();
+  for (uint stage = 0; stage < WavefrontStageNum; stage++)
+    ImGui::Text("%-10s %7.3f ms", stageNames[stage], stats.stageMs[stage]);
+  for (size_t depth = 0; depth < stats.numRays.size(); depth++)
+    ImGui::Text("Depth %zu: %u rays, %u shadow rays", depth + 1,
+                stats.numRays[depth], stats.numShadowRays[depth]);
+  for (uint group = 0; group < MaterialTypeNum; group++)
+    if (stats.numHits[group] > 0)
+      ImGui::Text("Hit group %u: %u hits", group, stats.numHits[group]);
+}
+
 void Tracer::guiBusy() {
   static int nb_dots = 0;
   static float deltaTime = 0;
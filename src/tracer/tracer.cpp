@@ -11,6 +11,7 @@
 
 #include <iostream>
 #include <chrono>
+#include <deque>
 #include <fstream>
 
 #include <filesystem/path.h>
@@ -112,9 +113,6 @@ void Tracer::runOnline() {
         setImageToDisplay();
         vkBeginCommandBuffer(cmdBuf1, &beginInfo);
 
-        // For procedural rendering
-        m_pipelineRaytrace.setSpp(1);
-
         // Update camera and sunsky
         m_pipelineGraphics.run(cmdBuf1);
 
@@ -185,19 +183,13 @@ void Tracer::runOffline() {
   clearValues[0].color = {0.0f, 0.0f, 0.0f, 0.0f};
   clearValues[1].depthStencil = {1.0f, 0};
 
-  // Vulkan allocator and image size
-  auto& m_alloc = ContextAware::getAlloc();
-  auto m_size = ContextAware::getSize();
-
-  // Create a temporary buffer to hold the output pixels of the image
-  VkBufferUsageFlags usage{VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                           VK_BUFFER_USAGE_TRANSFER_DST_BIT};
-  VkDeviceSize bufferSize = 4 * sizeof(float) * m_size.width * m_size.height;
-  nvvk::Buffer pixelBuffer = m_alloc.createBuffer(
-      bufferSize, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-
   nvvk::CommandPool genCmdBuf(ContextAware::getDevice(),
                               ContextAware::getQueueFamily());
+  createOfflineSemaphore();
+
+  // Several batches of launches are kept in flight, the cpu only waits
+  // when it is about to reuse the command buffer of an older batch
+  std::deque<std::pair<VkCommandBuffer, uint64_t>> inFlight;
 
   // Multi-view rendering
   int shotsNum = m_scene.getShotsNum();
@@ -207,87 +199,232 @@ void Tracer::runOffline() {
 
     // Main loop of single image rendering
     int tot = m_scene.getPipelineState().rtxState.spp;
+    int batch = m_scene.getPipelineState().launchesPerSubmit;
     // Still procedural rendering, but in offscreen this time
-    m_pipelineRaytrace.setSpp(1);
     m_pipelineRaytrace.resetFrame();
+    nvh::Stopwatch sw;
 
     // Progress bar
     tqdm bar;
     bar.set_theme_arrow();
 
-    for (int spp = 0; spp < tot; spp++) {
+    for (int spp = 0; spp < tot;) {
       bar.progress(spp, tot);
-      if (spp < tot - 1) {
-        const VkCommandBuffer& cmdBuf = genCmdBuf.createCommandBuffer();
-        // Update camera and sunsky
-        m_pipelineGraphics.run(cmdBuf);
-        // Ray tracing and do not render gui
-        m_pipelineRaytrace.run(cmdBuf);
-        genCmdBuf.submitAndWait(cmdBuf);
-      } else {
-        const VkCommandBuffer& cmdBuf1 = genCmdBuf.createCommandBuffer();
-        const VkCommandBuffer& cmdBuf2 = genCmdBuf.createCommandBuffer();
+      if (inFlight.size() == FRAMES_IN_FLIGHT) {
+        waitOfflineSemaphore(inFlight.front().second);
+        genCmdBuf.destroy(inFlight.front().first);
+        inFlight.pop_front();
+      }
+      const VkCommandBuffer& cmdBuf = genCmdBuf.createCommandBuffer();
+      // Camera and sunsky only change with the shot
+      if (spp == 0) m_pipelineGraphics.run(cmdBuf);
+      // Ray tracing and do not render gui, samples per launch adapt to the
+      // launch budget
+      spp += m_pipelineRaytrace.runBatch(cmdBuf, batch, tot - spp);
+      if (spp == tot) {
         setImageToDisplay();
-        // Update camera and sunsky
-        m_pipelineGraphics.run(cmdBuf1);
-        // Ray tracing
-        m_pipelineRaytrace.run(cmdBuf1);
-        copyImagesToCuda(cmdBuf1);
-        genCmdBuf.submitAndWait(cmdBuf1);
-
-        denoise();
-
-        copyCudaImagesToVulkan(cmdBuf2);
-        // Only post-processing in the last pass since
-        // we do not care the intermediate result in offline mode
-        VkRenderPassBeginInfo postRenderPassBeginInfo{
-            VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
-        postRenderPassBeginInfo.clearValueCount = 2;
-        postRenderPassBeginInfo.pClearValues = clearValues.data();
-        postRenderPassBeginInfo.renderPass = ContextAware::getRenderPass();
-        postRenderPassBeginInfo.framebuffer = ContextAware::getFramebuffer();
-        postRenderPassBeginInfo.renderArea = {{0, 0}, ContextAware::getSize()};
-        vkCmdBeginRenderPass(cmdBuf2, &postRenderPassBeginInfo,
-                             VK_SUBPASS_CONTENTS_INLINE);
-        m_pipelinePost.run(cmdBuf2);
-        vkCmdEndRenderPass(cmdBuf2);
-        genCmdBuf.submitAndWait(cmdBuf2);
+        copyImagesToCuda(cmdBuf);
       }
+      vkEndCommandBuffer(cmdBuf);
+      inFlight.emplace_back(cmdBuf, submitOffline(cmdBuf));
     }
-    bar.finish();
-    vkDeviceWaitIdle(ContextAware::getDevice());
+    waitOfflineSemaphore(m_offlineValue);
+    for (auto& record : inFlight) genCmdBuf.destroy(record.first);
+    inFlight.clear();
+    // Camera paths per second, to compare render settings and shaders
+    VkExtent2D size = ContextAware::getSize();
+    double paths = double(tot) * size.width * size.height;
+    LOG_INFO("{}: shot {} traced {:.2f} Mpaths/s", "Tracer", shotId,
+             paths / (sw.elapsed() * 1e3));
+
+    denoise();
+
+    // Images of an older shot may still be encoded from this slot
+    Readback& readback = m_readbacks[shotId % m_readbacks.size()];
+    ThreadPool::get().wait(readback.writing);
+
+    const VkCommandBuffer& cmdBuf2 = genCmdBuf.createCommandBuffer();
+    copyCudaImagesToVulkan(cmdBuf2);
+    // Only post-processing in the last pass since
+    // we do not care the intermediate result in offline mode
+    VkRenderPassBeginInfo postRenderPassBeginInfo{
+        VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+    postRenderPassBeginInfo.clearValueCount = 2;
+    postRenderPassBeginInfo.pClearValues = clearValues.data();
+    postRenderPassBeginInfo.renderPass = ContextAware::getRenderPass();
+    postRenderPassBeginInfo.framebuffer = ContextAware::getFramebuffer();
+    postRenderPassBeginInfo.renderArea = {{0, 0}, ContextAware::getSize()};
+    vkCmdBeginRenderPass(cmdBuf2, &postRenderPassBeginInfo,
+                         VK_SUBPASS_CONTENTS_INLINE);
+    m_pipelinePost.run(cmdBuf2);
+    vkCmdEndRenderPass(cmdBuf2);
+
+    // Read back the shot in the same submission, the next shot is recorded
+    // right away while its files are written
+    auto images = recordShotReadback(cmdBuf2, readback, shotId);
+    vkEndCommandBuffer(cmdBuf2);
+    uint64_t copyValue = submitOffline(cmdBuf2);
+    inFlight.emplace_back(cmdBuf2, copyValue);
+    saveShotImages(readback, std::move(images), copyValue);
 
-    callSavingImage(m_alloc, pixelBuffer, shotId);
+    bar.finish();
   }
-  // Destroy temporary buffer
-  m_alloc.destroy(pixelBuffer);
+  waitOfflineSemaphore(m_offlineValue);
+  for (auto& record : inFlight) genCmdBuf.destroy(record.first);
+  destroyReadbacks();
+  vkDestroySemaphore(m_device, m_offlineSemaphore, nullptr);
+  m_offlineSemaphore = VK_NULL_HANDLE;
+}
+
+void Tracer::createOfflineSemaphore() {
+  VkSemaphoreTypeCreateInfo timelineCreateInfo{
+      VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+  timelineCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  timelineCreateInfo.initialValue = 0;
+  VkSemaphoreCreateInfo sci{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+  sci.pNext = &timelineCreateInfo;
+  vkCreateSemaphore(m_device, &sci, nullptr, &m_offlineSemaphore);
+  m_offlineValue = 0;
+}
+
+uint64_t Tracer::submitOffline(const VkCommandBuffer& cmdBuf) {
+  // Increment for signaling
+  m_offlineValue++;
+
+  VkCommandBufferSubmitInfoKHR cmdBufInfo{
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO_KHR};
+  cmdBufInfo.commandBuffer = cmdBuf;
+
+  VkSemaphoreSubmitInfoKHR signalSemaphore{
+      VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO_KHR};
+  signalSemaphore.semaphore = m_offlineSemaphore;
+  signalSemaphore.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
+  signalSemaphore.value = m_offlineValue;
+
+  VkSubmitInfo2KHR submits{VK_STRUCTURE_TYPE_SUBMIT_INFO_2_KHR};
+  submits.commandBufferInfoCount = 1;
+  submits.pCommandBufferInfos = &cmdBufInfo;
+  submits.signalSemaphoreInfoCount = 1;
+  submits.pSignalSemaphoreInfos = &signalSemaphore;
+
+  vkQueueSubmit2(m_queue, 1, &submits, {});
+  return m_offlineValue;
+}
+
+void Tracer::waitOfflineSemaphore(uint64_t value) {
+  VkSemaphoreWaitInfo waitInfo{VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &m_offlineSemaphore;
+  waitInfo.pValues = &value;
+  vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX);
 }
 
-void Tracer::callSavingImage(nvvk::ResourceAllocatorDedicated& m_alloc,
-                             nvvk::Buffer& pixelBuffer, int shotId) {
-  // Save image
+vector<Tracer::ShotImage> Tracer::recordShotReadback(
+    const VkCommandBuffer& cmdBuf, Readback& readback, int shotId) {
   static char outputName[200];
+  vector<ShotImage> images;
   auto& state = m_scene.getPipelineState();
   if (state.outputRenderResult) {
     if (state.outputHdr) {
       sprintf(outputName, "%s_shot_%04d.exr", m_tis.outputname.c_str(), shotId);
-      saveBufferToImage(pixelBuffer, outputName, 0);
+      images.push_back({outputName, 0});
     } else {
       sprintf(outputName, "%s_shot_%04d.png", m_tis.outputname.c_str(), shotId);
-      saveBufferToImage(pixelBuffer, outputName);
+      images.push_back({outputName, -1});
     }
     for (uint cid = 0; cid < state.rtxState.nMultiChannel; cid++) {
-      // std::chrono::steady_clock::time_point begin =
-      //     std::chrono::steady_clock::now();
       if (state.channelOutputLdr[cid])
         sprintf(outputName, "%s_shot_%04d_channel_%04d.png",
                 m_tis.outputname.c_str(), shotId, cid);
       else
         sprintf(outputName, "%s_shot_%04d_channel_%04d.exr",
                 m_tis.outputname.c_str(), shotId, cid);
-      saveBufferToImage(pixelBuffer, outputName, cid + 1);
+      images.push_back({outputName, int(cid + 1)});
     }
   }
+  if (images.empty()) return images;
+
+  // (Re)create the slot if this shot saves more channels than it can hold
+  auto& m_alloc = ContextAware::getAlloc();
+  auto m_size = ContextAware::getSize();
+  VkDeviceSize imageSize = 4 * sizeof(float) * m_size.width * m_size.height;
+  VkDeviceSize bufferSize = imageSize * images.size();
+  if (readback.size < bufferSize) {
+    if (readback.pData) {
+      m_alloc.unmap(readback.buffer);
+      m_alloc.destroy(readback.buffer);
+    }
+    MemCategoryScope memScope(MemCategoryFilm);
+    readback.buffer = m_alloc.createBuffer(
+        bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    readback.size = bufferSize;
+    readback.pData = reinterpret_cast<float*>(m_alloc.map(readback.buffer));
+  }
+
+  // Rendering and post processing must be done before copying
+  VkMemoryBarrier renderBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  renderBarrier.srcAccessMask =
+      VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  renderBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf,
+                       VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &renderBarrier, 0,
+                       nullptr, 0, nullptr);
+
+  for (size_t i = 0; i < images.size(); i++) {
+    int channelId = images[i].channelId;
+    // Default framebuffer color after post processing
+    if (channelId == -1)
+      vkTextureToBuffer(cmdBuf, ContextAware::getOfflineColor(),
+                        readback.buffer.buffer, i * imageSize);
+    // Hdr channel before post processing
+    else
+      vkTextureToBuffer(cmdBuf, m_pipelineGraphics.getColorTexture(channelId),
+                        readback.buffer.buffer, i * imageSize);
+  }
+
+  // Make the copies visible to the host
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr,
+                       0, nullptr);
+  return images;
+}
+
+void Tracer::saveShotImages(Readback& readback, vector<ShotImage> images,
+                            uint64_t copyValue) {
+  if (images.empty()) return;
+  auto m_size = ContextAware::getSize();
+  size_t imageFloats = 4 * size_t(m_size.width) * m_size.height;
+  float* pData = readback.pData;
+  ThreadPool::get().run(
+      readback.writing, [this, pData, imageFloats, copyValue, images] {
+        waitOfflineSemaphore(copyValue);
+        // Channels are written in order, scanline output of later channels
+        // depends on channel 1
+        std::vector<int> validPixelIndex;
+        for (size_t i = 0; i < images.size(); i++)
+          saveBufferToImage(pData + i * imageFloats, images[i].outputpath,
+                            images[i].channelId, validPixelIndex);
+      });
+}
+
+void Tracer::destroyReadbacks() {
+  auto& m_alloc = ContextAware::getAlloc();
+  for (auto& readback : m_readbacks) {
+    ThreadPool::get().wait(readback.writing);
+    if (readback.pData) {
+      m_alloc.unmap(readback.buffer);
+      m_alloc.destroy(readback.buffer);
+    }
+    readback.pData = nullptr;
+    readback.size = 0;
+  }
 }
 
 void Tracer::parallelLoading() {
@@ -308,14 +445,15 @@ void Tracer::parallelLoading() {
   // Post pipeline processes hdr output
   m_pipelinePost.init(reinterpret_cast<ContextAware*>(this), &m_scene,
                       &m_pipelineGraphics.getHdrOutImageInfo());
-}
 
-void Tracer::vkTextureToBuffer(const nvvk::Texture& imgIn,
-                               const VkBuffer& pixelBufferOut) {
-  nvvk::CommandPool genCmdBuf(ContextAware::getDevice(),
-                              ContextAware::getQueueFamily());
-  VkCommandBuffer cmdBuf = genCmdBuf.createCommandBuffer();
+  // Every scene and pipeline resource is allocated by now
+  ContextAware::getAlloc().printReport();
+}
 
+void Tracer::vkTextureToBuffer(const VkCommandBuffer& cmdBuf,
+                               const nvvk::Texture& imgIn,
+                               const VkBuffer& pixelBufferOut,
+                               VkDeviceSize offset) {
   // Make the image layout eTransferSrcOptimal to copy to buffer
   nvvk::cmdBarrierImageLayout(cmdBuf, imgIn.image, VK_IMAGE_LAYOUT_GENERAL,
                               VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
@@ -327,7 +465,7 @@ void Tracer::vkTextureToBuffer(const nvvk::Texture& imgIn,
   copyRegion.imageExtent = {ContextAware::getSize().width,
                             ContextAware::getSize().height, 1};
   copyRegion.imageOffset = {0};
-  copyRegion.bufferOffset = 0;
+  copyRegion.bufferOffset = offset;
   copyRegion.bufferImageHeight = ContextAware::getSize().height;
   copyRegion.bufferRowLength = ContextAware::getSize().width;
   vkCmdCopyImageToBuffer(cmdBuf, imgIn.image,
@@ -338,60 +476,43 @@ void Tracer::vkTextureToBuffer(const nvvk::Texture& imgIn,
   nvvk::cmdBarrierImageLayout(
       cmdBuf, imgIn.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
       VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_ASPECT_COLOR_BIT);
-  genCmdBuf.submitAndWait(cmdBuf);
 }
 
-std::vector<int> valid_pixel_index{};
-std::vector<float> valid_pixel_data{};
-
-void Tracer::saveBufferToImage(nvvk::Buffer pixelBuffer, std::string outputpath,
-                               int channelId) {
+void Tracer::saveBufferToImage(float* data, std::string outputpath,
+                               int channelId,
+                               std::vector<int>& validPixelIndex) {
   auto fp = path(outputpath);
   bool isRelativePath = !fp.is_absolute();
   if (isRelativePath) outputpath = NVPSystem::exePath() + outputpath;
 
-  auto& m_alloc = ContextAware::getAlloc();
   auto m_size = ContextAware::getSize();
 
-  // Default framebuffer color after post processing
-  if (channelId == -1)
-    vkTextureToBuffer(ContextAware::getOfflineColor(), pixelBuffer.buffer);
-  // Hdr channel before post processing
-  else
-    vkTextureToBuffer(m_pipelineGraphics.getColorTexture(channelId),
-                      pixelBuffer.buffer);
-
   // Write the image to disk
-  void* data = m_alloc.map(pixelBuffer);
   if (!m_tis.output_scanline || channelId == 0)
-    writeImage(outputpath.c_str(), m_size.width, m_size.height,
-               reinterpret_cast<float*>(data));
+    writeImage(outputpath.c_str(), m_size.width, m_size.height, data);
   else {
-    float* float_data = reinterpret_cast<float*>(data);
+    float* float_data = data;
     if (channelId == 1) {
-      valid_pixel_index.clear();
-      valid_pixel_data.clear();
+      validPixelIndex.clear();
       for (int idx = 0; idx < m_size.width * m_size.height; idx++) {
         if (float_data[4 * idx + 2] == 1.0) {
-          valid_pixel_index.emplace_back(idx);
+          validPixelIndex.emplace_back(idx);
           float_data[4 * idx + 2] = idx;
         }
       }
-      valid_pixel_data.resize(valid_pixel_index.size() * 3);
     }
+    std::vector<float> validPixelData(validPixelIndex.size() * 3);
     int sp = 0;
-    for (auto idx : valid_pixel_index) {
-      valid_pixel_data[sp++] = float_data[4 * idx];
-      valid_pixel_data[sp++] = float_data[4 * idx + 1];
-      valid_pixel_data[sp++] = float_data[4 * idx + 2];
+    for (auto idx : validPixelIndex) {
+      validPixelData[sp++] = float_data[4 * idx];
+      validPixelData[sp++] = float_data[4 * idx + 1];
+      validPixelData[sp++] = float_data[4 * idx + 2];
     }
-    const std::vector<unsigned long> shape{(unsigned)valid_pixel_index.size(),
+    const std::vector<unsigned long> shape{(unsigned)validPixelIndex.size(),
                                            3};
     npy::SaveArrayAsNumpy(outputpath, false, shape.size(), shape.data(),
-                          valid_pixel_data.data());
+                          validPixelData.data());
   }
-
-  m_alloc.unmap(pixelBuffer);
 }
 
 void Tracer::submitWithTLSemaphore(const VkCommandBuffer& cmdBuf) {
@@ -468,6 +589,7 @@ void Tracer::submitFrame(const VkCommandBuffer& cmdBuf) {
 
 void Tracer::createGbuffers() {
   auto& m_alloc = ContextAware::getAlloc();
+  MemCategoryScope memScope(MemCategoryFilm);
   auto& m_debug = ContextAware::getDebug();
 
   m_alloc.destroy(m_gAlbedo);
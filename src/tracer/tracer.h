@@ -5,6 +5,7 @@
 #include "pipeline/pipeline_post.h"
 #include "pipeline/pipeline_raytrace.h"
 #include "scene/scene.h"
+#include "core/thread_pool.h"
 #include "denoiser.h"
 
 struct TracerInitSettings {
@@ -33,18 +34,48 @@ private:
   void runOnline();
   void runOffline();
   void parallelLoading();
-  void vkTextureToBuffer(const nvvk::Texture& imgIn,
-                         const VkBuffer& pixelBufferOut);
+  void vkTextureToBuffer(const VkCommandBuffer& cmdBuf,
+                         const nvvk::Texture& imgIn,
+                         const VkBuffer& pixelBufferOut, VkDeviceSize offset);
 
-  // Transfer color data to pixelBuffer, and write it to disk as an image.
-  // channelId controls which color data will be copied to pixelBuffer:
+  // Offline mode: all channels of a shot are copied into one host buffer of
+  // a small ring, and the files are encoded on the thread pool while the
+  // next shot renders
+  struct ShotImage {
+    std::string outputpath;
+    int channelId;
+  };
+  struct Readback {
+    nvvk::Buffer buffer;
+    VkDeviceSize size{0};
+    float* pData{nullptr};
+    TaskGroup writing;
+  };
+  std::array<Readback, 2> m_readbacks;
+
+  // Record the copies of every channel to save into readback.
+  // channelId controls which color data will be copied:
   // (1) channelId = -1, copy ldr output after post processing
-  // (2) channelId > 0, copy corresponding hdr channel before post processing
-  void saveBufferToImage(nvvk::Buffer pixelBuffer, std::string outputpath,
-                         int channelId = -1);
+  // (2) channelId >= 0, copy corresponding hdr channel before post processing
+  vector<ShotImage> recordShotReadback(const VkCommandBuffer& cmdBuf,
+                                       Readback& readback, int shotId);
+
+  // Encode the images once the copy submission has signaled copyValue
+  void saveShotImages(Readback& readback, vector<ShotImage> images,
+                      uint64_t copyValue);
+
+  // Write channel data to disk as an image. validPixelIndex carries the
+  // valid pixels of channel 1 to the others in scanline output mode.
+  void saveBufferToImage(float* data, std::string outputpath, int channelId,
+                         std::vector<int>& validPixelIndex);
+
+  void destroyReadbacks();
 
-  void callSavingImage(nvvk::ResourceAllocatorDedicated& m_alloc,
-                       nvvk::Buffer& pixelBuffer, int shotId);
+  // Offline mode: batches of launches are tracked with a timeline semaphore
+  // instead of waiting for the queue after every submission
+  void createOfflineSemaphore();
+  uint64_t submitOffline(const VkCommandBuffer& cmdBuf);
+  void waitOfflineSemaphore(uint64_t value);
 
 private:
   bool m_busy = false;
@@ -54,6 +85,7 @@ private:
   bool guiEnvironment();
   bool guiTonemapper();
   bool guiPathTracer();
+  void guiWavefrontStats();
   bool guiDenoiser();
   void guiBusy();
 
@@ -65,6 +97,8 @@ private:
 
   // Timeline semaphores
   uint64_t m_fenceValue{0};
+  VkSemaphore m_offlineSemaphore{VK_NULL_HANDLE};
+  uint64_t m_offlineValue{0};
   bool m_denoiseApply{false};
   bool m_denoiseFirstFrame{false};
   int m_denoiseEveryNFrames{100};